@@ -0,0 +1,322 @@
+#include "gameboy.h"
+#include "emulator.h"
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <algorithm>
+#include <condition_variable>
+
+struct gb_env
+{
+	std::string romPath;
+	Emulator emu;
+};
+
+struct gb_pool
+{
+	std::vector<std::thread> threads;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	uint64_t generation = 0;
+	unsigned busy = 0;
+	bool stopping = false;
+
+	// the batch being stepped, set before generation goes up
+	gb_env* const* envs = nullptr;
+	const uint8_t* actions = nullptr;
+	size_t count = 0;
+	uint32_t frames = 0;
+	std::atomic<size_t> next = 0;
+
+	int failures = 0;
+	std::string firstError;
+};
+
+static thread_local std::string s_LastError;
+
+static void SetError(const char* message)
+{
+	s_LastError = message;
+}
+
+const char* gb_last_error(void)
+{
+	return s_LastError.c_str();
+}
+
+static void Step(gb_env* env, uint8_t actions, uint32_t frames)
+{
+	env->emu.buttonState.SetHeld(actions);
+
+	for (uint32_t i = 0; i < frames; i++)
+		env->emu.UpdateFrame();
+}
+
+gb_env* gb_create(const char* rom_path)
+{
+	try
+	{
+		std::unique_ptr<gb_env> env = std::make_unique<gb_env>();
+		env->romPath = rom_path;
+		env->emu.serialOutput = nullptr;
+		env->emu.saveOptions.mode = SaveOptions::Mode::None;
+		env->emu.LoadROM(rom_path);
+		env->emu.Reset();
+		return env.release();
+	}
+	catch (std::exception& e)
+	{
+		SetError(e.what());
+		return nullptr;
+	}
+}
+
+void gb_destroy(gb_env* env)
+{
+	delete env;
+}
+
+gb_env* gb_clone(const gb_env* env)
+{
+	try
+	{
+		// saving only settles the cpu's lazily computed flags, nothing the environment would notice
+		std::vector<uint8_t> state;
+		const_cast<Emulator&>(env->emu).SaveState(state);
+
+		// the ROM comes out of the cache, so this only costs a new set of RAM
+		std::unique_ptr<gb_env> clone(gb_create(env->romPath.c_str()));
+		if (!clone) return nullptr;
+
+		clone->emu.LoadState(state);
+		clone->emu.SetResetPoint(env->emu.GetResetPoint());
+		clone->emu.buttonState = env->emu.buttonState;
+
+		// and steps the same way
+		clone->emu.cpu.executionMode = env->emu.cpu.executionMode;
+		clone->emu.cpu.idleLoopDetection = env->emu.cpu.idleLoopDetection;
+		clone->emu.runAheadFrames = env->emu.runAheadFrames;
+		clone->emu.ppu.videoOutput = env->emu.ppu.videoOutput;
+		return clone.release();
+	}
+	catch (std::exception& e)
+	{
+		SetError(e.what());
+		return nullptr;
+	}
+}
+
+int gb_set_reset_point(gb_env* env, uint64_t warmup_frames, uint8_t actions)
+{
+	try
+	{
+		InputScript input;
+		input.changes.push_back({ 0, actions });
+
+		env->emu.CaptureResetPoint(warmup_frames, input);
+		return 0;
+	}
+	catch (std::exception& e)
+	{
+		SetError(e.what());
+		return -1;
+	}
+}
+
+int gb_reset(gb_env* env)
+{
+	try
+	{
+		env->emu.FastReset();
+		return 0;
+	}
+	catch (std::exception& e)
+	{
+		SetError(e.what());
+		return -1;
+	}
+}
+
+int gb_step(gb_env* env, uint8_t actions, uint32_t frames)
+{
+	try
+	{
+		Step(env, actions, frames);
+		return 0;
+	}
+	catch (std::exception& e)
+	{
+		SetError(e.what());
+		return -1;
+	}
+}
+
+const uint32_t* gb_screen(const gb_env* env)
+{
+	return env->emu.ppu.videoBuffer.data();
+}
+
+int gb_set_output(gb_env* env, int mode)
+{
+	if (mode < GB_OUTPUT_RGBA || mode > GB_OUTPUT_GRAY_4X)
+	{
+		SetError("Unknown output mode");
+		return -1;
+	}
+
+	// the defines are in the same order as the enum
+	env->emu.ppu.videoOutput = (PPU::VideoOutput)mode;
+	return 0;
+}
+
+const uint8_t* gb_observation(const gb_env* env, size_t* size)
+{
+	std::span<const uint8_t> output = env->emu.ppu.GetOutput();
+	if (size) *size = output.size();
+	return output.data();
+}
+
+const uint8_t* gb_wram(const gb_env* env, size_t* size)
+{
+	if (size) *size = env->emu.wram.size();
+	return env->emu.wram.data();
+}
+
+const uint8_t* gb_hram(const gb_env* env, size_t* size)
+{
+	if (size) *size = env->emu.hram.size();
+	return env->emu.hram.data();
+}
+
+uint8_t gb_read(gb_env* env, uint16_t address)
+{
+	return env->emu.read(address);
+}
+
+int64_t gb_save_state(gb_env* env, uint8_t* buffer, size_t capacity)
+{
+	try
+	{
+		std::vector<uint8_t> state;
+		env->emu.SaveState(state);
+
+		if (buffer && capacity >= state.size()) memcpy(buffer, state.data(), state.size());
+		return (int64_t)state.size();
+	}
+	catch (std::exception& e)
+	{
+		SetError(e.what());
+		return -1;
+	}
+}
+
+int gb_load_state(gb_env* env, const uint8_t* state, size_t size)
+{
+	try
+	{
+		env->emu.LoadState({ state, size });
+		return 0;
+	}
+	catch (std::exception& e)
+	{
+		SetError(e.what());
+		return -1;
+	}
+}
+
+// takes environments off the batch until there are none left, run by every pool thread and the caller
+static void StepShare(gb_pool* pool)
+{
+	size_t i;
+	while ((i = pool->next.fetch_add(1)) < pool->count)
+	{
+		try
+		{
+			Step(pool->envs[i], pool->actions[i], pool->frames);
+		}
+		catch (std::exception& e)
+		{
+			std::lock_guard lock(pool->mutex);
+			if (pool->failures++ == 0) pool->firstError = e.what();
+		}
+	}
+}
+
+static void RunPoolThread(gb_pool* pool)
+{
+	std::unique_lock lock(pool->mutex);
+	uint64_t seen = 0; // generation starts at 0, a batch might have been started before this thread got going
+
+	while (true)
+	{
+		pool->wake.wait(lock, [&] { return pool->stopping || pool->generation != seen; });
+		if (pool->stopping) return;
+
+		seen = pool->generation;
+
+		lock.unlock();
+		StepShare(pool);
+		lock.lock();
+
+		if (--pool->busy == 0) pool->done.notify_one();
+	}
+}
+
+gb_pool* gb_pool_create(unsigned threads)
+{
+	gb_pool* pool = new gb_pool();
+
+	if (threads == 0) threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+	// the thread calling gb_step_batch does its share too
+	for (unsigned i = 1; i < threads; i++)
+		pool->threads.emplace_back(RunPoolThread, pool);
+
+	return pool;
+}
+
+void gb_pool_destroy(gb_pool* pool)
+{
+	if (!pool) return;
+
+	{
+		std::lock_guard lock(pool->mutex);
+		pool->stopping = true;
+	}
+
+	pool->wake.notify_all();
+	for (std::thread& thread : pool->threads)
+		thread.join();
+
+	delete pool;
+}
+
+int gb_step_batch(gb_pool* pool, gb_env* const* envs, const uint8_t* actions, size_t count, uint32_t frames)
+{
+	{
+		std::lock_guard lock(pool->mutex);
+		pool->envs = envs;
+		pool->actions = actions;
+		pool->count = count;
+		pool->frames = frames;
+		pool->next = 0;
+		pool->failures = 0;
+		pool->firstError.clear();
+
+		pool->busy = (unsigned)pool->threads.size();
+		pool->generation++;
+	}
+	pool->wake.notify_all();
+
+	StepShare(pool);
+
+	std::unique_lock lock(pool->mutex);
+	pool->done.wait(lock, [&] { return pool->busy == 0; });
+
+	if (pool->failures) SetError(pool->firstError.c_str());
+	return pool->failures;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// C interface to the emulator, meant for driving it as a reinforcement learning environment from other languages.
+// Nothing here throws, functions that can fail return NULL or a negative number and gb_last_error says why.
+//
+// Observations are pointers straight into the emulator, they stay valid until the environment is destroyed and
+// change in place as it runs. From Python with ctypes:
+//   lib = ctypes.CDLL("libGameBoyC.so")
+//   lib.gb_create.restype = ctypes.c_void_p
+//   lib.gb_screen.restype = ctypes.POINTER(ctypes.c_uint32)
+//   env = ctypes.c_void_p(lib.gb_create(b"game.gb"))
+//   lib.gb_step(env, GB_BUTTON_START, 4)
+//   screen = numpy.ctypeslib.as_array(lib.gb_screen(env), shape=(144, 160))  # no copy
+
+#ifdef _WIN32
+#define GB_API __declspec(dllexport)
+#else
+#define GB_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GB_SCREEN_WIDTH 160
+#define GB_SCREEN_HEIGHT 144
+
+// actions are the buttons held, one bit each
+#define GB_BUTTON_A      0x01
+#define GB_BUTTON_B      0x02
+#define GB_BUTTON_SELECT 0x04
+#define GB_BUTTON_START  0x08
+#define GB_BUTTON_RIGHT  0x10
+#define GB_BUTTON_LEFT   0x20
+#define GB_BUTTON_UP     0x40
+#define GB_BUTTON_DOWN   0x80
+
+// what gb_observation gives back, see gb_set_output
+#define GB_OUTPUT_RGBA        0 // the same as gb_screen, 4 bytes a pixel
+#define GB_OUTPUT_INDEXED     1 // one byte a pixel, the shade 0-3 after the palettes
+#define GB_OUTPUT_PACKED_2BPP 2 // four pixels a byte, the first pixel in the low 2 bits
+#define GB_OUTPUT_GRAY_2X     3 // 80x72, one byte a pixel, 255 is white
+#define GB_OUTPUT_GRAY_4X     4 // 40x36
+
+typedef struct gb_env gb_env;
+typedef struct gb_pool gb_pool;
+
+// why the last call on this thread failed
+GB_API const char* gb_last_error(void);
+
+// loads a ROM and resets, cart RAM is never read from or written to a .sav so environments dont share anything
+GB_API gb_env* gb_create(const char* rom_path);
+GB_API void gb_destroy(gb_env* env);
+
+// a new environment at the same point as env, with the same reset point
+GB_API gb_env* gb_clone(const gb_env* env);
+
+// runs warmup_frames frames (holding actions the whole time) and makes that where gb_reset goes back to
+GB_API int gb_set_reset_point(gb_env* env, uint64_t warmup_frames, uint8_t actions);
+// back to the reset point, or power on if there isnt one
+GB_API int gb_reset(gb_env* env);
+
+// holds actions for frames frames
+GB_API int gb_step(gb_env* env, uint8_t actions, uint32_t frames);
+
+// GB_SCREEN_WIDTH * GB_SCREEN_HEIGHT pixels, RGBA in memory order, row by row from the top
+GB_API const uint32_t* gb_screen(const gb_env* env);
+
+// picks the format the screen is drawn in. the PPU writes it as it draws, so anything but GB_OUTPUT_RGBA leaves
+// gb_screen stale, and costs less to step and to copy out
+GB_API int gb_set_output(gb_env* env, int mode);
+GB_API const uint8_t* gb_observation(const gb_env* env, size_t* size);
+
+GB_API const uint8_t* gb_wram(const gb_env* env, size_t* size); // 0xC000-0xDFFF
+GB_API const uint8_t* gb_hram(const gb_env* env, size_t* size); // 0xFF80-0xFFFE
+GB_API uint8_t gb_read(gb_env* env, uint16_t address); // anything else on the bus
+
+// save states, see savestate.h. gb_save_state returns the size of the state, and only writes it if capacity is enough
+GB_API int64_t gb_save_state(gb_env* env, uint8_t* buffer, size_t capacity);
+GB_API int gb_load_state(gb_env* env, const uint8_t* state, size_t size);
+
+// threads for gb_step_batch, 0 uses one per core
+GB_API gb_pool* gb_pool_create(unsigned threads);
+GB_API void gb_pool_destroy(gb_pool* pool);
+
+// steps every environment with its own actions on the pool's threads, returns once they are all done.
+// returns how many failed, gb_last_error has the first of those
+GB_API int gb_step_batch(gb_pool* pool, gb_env* const* envs, const uint8_t* actions, size_t count, uint32_t frames);
+
+#ifdef __cplusplus
+}
+#endif
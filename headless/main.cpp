@@ -0,0 +1,121 @@
+#include "emulator.h"
+#include "inputscript.h"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <string>
+
+// Runs a ROM without a window for as many frames as asked, as fast as it goes.
+
+static void PrintUsage()
+{
+	std::cerr <<
+		"usage: GameBoyHeadless <rom> [options]\n"
+		"  --frames <n>         frames to run (default 60)\n"
+		"  --input <file>       input script, see include/inputscript.h for the format\n"
+		"  --screenshot <file>  writes the last frame as a binary PPM\n"
+		"  --state <file>       writes a save state after the last frame\n"
+		"  --serial             prints what the game sends over the link cable to stdout\n"
+		"  --stats              prints how long the run took to stderr\n";
+}
+
+static void WriteScreenshot(const std::string& path, const PPU& ppu)
+{
+	std::ofstream file(path, std::ios::binary);
+	if (!file.good()) throw std::runtime_error("Could not write " + path);
+
+	file << "P6\n" << RESX << " " << RESY << "\n255\n";
+
+	// the video buffer is RGBA in memory order, which is what raylib uploads
+	for (uint32_t pixel : ppu.videoBuffer)
+	{
+		char rgb[3] = { (char)(pixel & 0xFF), (char)((pixel >> 8) & 0xFF), (char)((pixel >> 16) & 0xFF) };
+		file.write(rgb, 3);
+	}
+}
+
+static void WriteState(const std::string& path, Emulator& emu)
+{
+	std::vector<uint8_t> state;
+	emu.SaveState(state);
+
+	std::ofstream file(path, std::ios::binary);
+	if (!file.good()) throw std::runtime_error("Could not write " + path);
+	file.write((const char*)state.data(), state.size());
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2 || argv[1][0] == '-')
+	{
+		PrintUsage();
+		return 2;
+	}
+
+	std::string romPath = argv[1];
+	uint64_t frames = 60;
+	std::string inputPath, screenshotPath, statePath;
+	bool serial = false;
+	bool stats = false;
+
+	for (int i = 2; i < argc; i++)
+	{
+		bool hasValue = i + 1 < argc;
+
+		if (!strcmp(argv[i], "--frames") && hasValue) frames = std::strtoull(argv[++i], nullptr, 10);
+		else if (!strcmp(argv[i], "--input") && hasValue) inputPath = argv[++i];
+		else if (!strcmp(argv[i], "--screenshot") && hasValue) screenshotPath = argv[++i];
+		else if (!strcmp(argv[i], "--state") && hasValue) statePath = argv[++i];
+		else if (!strcmp(argv[i], "--serial")) serial = true;
+		else if (!strcmp(argv[i], "--stats")) stats = true;
+		else
+		{
+			std::cerr << "Unknown option " << argv[i] << "\n";
+			PrintUsage();
+			return 2;
+		}
+	}
+
+	try
+	{
+		InputScript input;
+		if (!inputPath.empty()) input = InputScript::Load(inputPath);
+
+		Emulator emu;
+		emu.serialOutput = serial ? &std::cout : nullptr;
+		emu.LoadROM(romPath);
+		emu.Reset();
+
+		size_t inputCursor = 0;
+		auto start = std::chrono::steady_clock::now();
+
+		for (uint64_t frame = 0; frame < frames; frame++)
+		{
+			emu.buttonState.SetHeld(input.GetButtons(frame, inputCursor));
+			emu.UpdateFrame();
+		}
+
+		auto end = std::chrono::steady_clock::now();
+
+		if (!screenshotPath.empty()) WriteScreenshot(screenshotPath, emu.ppu);
+		if (!statePath.empty()) WriteState(statePath, emu);
+
+		emu.FlushSave();
+
+		if (stats)
+		{
+			double seconds = std::chrono::duration<double>(end - start).count();
+			std::cerr << frames << " frames in " << seconds << "s (" << (seconds > 0 ? frames / seconds : 0) << " fps)\n";
+		}
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
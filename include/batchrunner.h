@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <span>
+#include <chrono>
+
+#include "inputscript.h"
+
+struct BatchJob
+{
+	std::string romPath;
+	InputScript input;
+	uint64_t frames = 60; // the job is done after this many frames
+	std::chrono::milliseconds timeout{ 0 }; // wall clock, 0 lets it run for as long as the frames take
+};
+
+struct BatchResult
+{
+	enum class Status
+	{
+		Finished,
+		TimedOut, // everything below is from the frame it was stopped at
+		Failed, // the ROM didnt load, see error
+	};
+
+	Status status = Status::Failed;
+	uint64_t framesRun = 0;
+	uint64_t framebufferHash = 0; // ROM::Hash of the last frame
+	std::string serial; // everything the game sent over the link cable
+	std::vector<uint8_t> ram; // WRAM then HRAM after the last frame
+	std::string error;
+	double seconds = 0;
+};
+
+// Runs lots of independent emulators across every core.
+// Jobs are dealt out round robin to one queue per thread up front, a thread works through its own queue from the
+// back and once that is empty steals from the front of the others, so a few long jobs dont leave the rest of the
+// threads idle at the end. Emulators share nothing but the read only ROM cache, and the jobs dont save anything
+// to disk (SaveOptions::Mode::None) so the same game can be in any number of jobs at once.
+class BatchRunner
+{
+public:
+	explicit BatchRunner(unsigned threadCount = 0); // 0 uses one thread per core
+
+	// blocks until every job is done, the results are in the same order as the jobs
+	std::vector<BatchResult> Run(std::span<const BatchJob> jobs);
+
+	// runs one job on the calling thread
+	static BatchResult RunJob(const BatchJob& job);
+
+	unsigned GetThreadCount() const { return m_ThreadCount; }
+
+private:
+	unsigned m_ThreadCount;
+};
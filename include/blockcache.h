@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <vector>
+#include <unordered_map>
+
+#include "cpu.h"
+#include "jit.h"
+#include "memorymap.h"
+
+class Emulator;
+
+// Straight line runs of SM83 code decoded once and kept around, keyed by (ROM bank, PC).
+// A block ends at anything that changes control flow or interrupt state, so the cpu can run
+// it back to back without going through Emulator::read for every opcode and immediate.
+// Code running from WRAM/HRAM is cached too and thrown away when the page it lives in gets written.
+class BlockCache
+{
+public:
+	struct Block
+	{
+		uint16_t startPC;
+		uint16_t endPC; // one past the last byte of the block
+		uint16_t maxCycles; // M-cycles if every branch in it is taken
+		std::vector<CPU::DecodedInstruction> instructions;
+
+		// for the JIT, see GetNativeCode
+		mutable uint32_t runs = 0;
+		mutable CPU::NativeBlock native = nullptr;
+	};
+
+	static constexpr int MAX_BLOCK_LENGTH = 64;
+
+	// times a block runs before it gets compiled to machine code
+	static constexpr uint32_t JIT_THRESHOLD = 16;
+
+	BlockCache();
+
+	// pages with cached code in them are watched so writes to them come through OnWrite
+	void ConnectMemoryMap(MemoryMap* memoryMap);
+
+	void Clear();
+
+	// drops every block in WRAM/HRAM without counting it as self modifying code, for when the whole RAM gets replaced
+	void DiscardRAMBlocks();
+
+	const Block* Find(uint16_t pc, uint16_t romBank) const;
+
+	// decodes and caches the block starting at pc, returns nullptr if the code lives somewhere that isnt cached
+	const Block* Compile(Emulator& emu, uint16_t pc);
+
+	// block compiled by the Jit once it is hot, nullptr until then or if there is no JIT
+	CPU::NativeBlock GetNativeCode(CPU& cpu, const Block& block);
+
+	// called by the bus on every WRAM/HRAM write
+	void OnWrite(uint16_t address)
+	{
+		if (m_CodePages[address >> 8]) InvalidatePage(address >> 8);
+	}
+
+	// called by the bus on ROM and IO writes, a bank switch means the rest of the running block might not be
+	// mapped anymore and an IO write can schedule an event or raise an interrupt
+	void RequestStop() { m_StopRequested = true; }
+
+	// tells the block being run to stop after the current instruction
+	bool StopRequested() const { return m_StopRequested; }
+	void ClearStopRequest() { m_StopRequested = false; }
+
+	// blocks cant be freed while they are running so invalidation is deferred until the next lookup
+	void FlushInvalidations();
+
+	// lockstep checking, compares a cached instruction against what is on the bus at pc right now.
+	// counts anything that doesnt match
+	bool Verify(Emulator& emu, uint16_t pc, const CPU::DecodedInstruction& decoded);
+	void CountMismatch() { m_Mismatches++; } // for checks the cpu does itself, like a compiled block ending up somewhere Step() doesnt
+	void Discard(uint16_t pc, uint16_t romBank);
+
+	size_t GetBlockCount() const { return m_Blocks.size(); }
+	uint64_t GetMismatchCount() const { return m_Mismatches; }
+	size_t GetNativeCodeSize() const { return m_Jit.GetCodeSize(); }
+
+	// RAM pages that got rewritten this many times are treated as self modifying and left to the interpreter
+	static constexpr int SELF_MODIFYING_THRESHOLD = 8;
+
+private:
+	static bool IsInRAM(uint16_t address) { return address >= 0xC000; }
+	static uint32_t MakeKey(uint16_t pc, uint16_t romBank);
+
+	void InvalidatePage(uint8_t page);
+
+	std::unordered_map<uint32_t, Block> m_Blocks;
+	MemoryMap* m_MemoryMap = nullptr;
+
+	// RAM pages that have at least one block in them and the keys of those blocks
+	std::array<bool, 256> m_CodePages;
+	std::array<std::vector<uint32_t>, 256> m_PageBlocks;
+
+	std::array<uint8_t, 256> m_PageInvalidations;
+
+	std::vector<uint8_t> m_DirtyPages;
+	bool m_StopRequested = false;
+
+	uint64_t m_Mismatches = 0;
+
+	Jit m_Jit;
+};
@@ -3,10 +3,14 @@
 #include <array>
 #include <string>
 #include <vector>
+#include <memory>
 #include <cstdint>
 #include <expected>
+#include <stdexcept>
+#include <type_traits>
 
 #include "mbc.h"
+#include "rom.h"
 
 struct CartridgeHeader
 {
@@ -30,15 +34,71 @@ struct CartridgeHeader
 class Cartridge
 {
 public:
-	Cartridge(const std::string& filename);
+	Cartridge(const std::string& filename, const SaveOptions& saveOptions = {});
 
-	uint8_t ReadCart(uint16_t address);
-	void WriteCart(uint16_t address, uint8_t data);
+	// inline so the visit and the controllers read/write get resolved right where the bus calls them
+	uint8_t ReadCart(uint16_t address)
+	{
+		return VisitMBC([address](auto& mbc) { return mbc.read(address); });
+	}
+
+	void WriteCart(uint16_t address, uint8_t data)
+	{
+		VisitMBC([address, data](auto& mbc)
+		{
+			mbc.write(address, data);
+
+			// any register write can switch a bank or enable/disable RAM
+			if (address < 0x8000)
+				mbc.MapPages();
+		});
+	}
+
+	uint16_t GetROMBank()
+	{
+		return VisitMBC([](auto& mbc) { return mbc.GetROMBank(); });
+	}
+
+	void ConnectMemoryMap(MemoryMap* memoryMap);
+
+	// only MBC3 has a clock
+	void ConnectSystemClock(const uint64_t* systemTicks)
+	{
+		VisitMBC([systemTicks](auto& mbc)
+		{
+			if constexpr (requires { mbc.ConnectSystemClock(systemTicks); })
+				mbc.ConnectSystemClock(systemTicks);
+		});
+	}
+
+	// the controller and its RAM, tagged with the ROM hash so a state cant be loaded into a different game
+	void SaveState(StateWriter& writer);
+	void LoadState(StateReader& reader);
+
+	void FlushSave()
+	{
+		VisitMBC([](auto& mbc) { mbc.FlushSave(); });
+	}
 
 private:
 	CartridgeHeader m_Header;
-	std::unique_ptr<MBC> m_MemoryBankController;
-	uint8_t* m_CartData; // all cart memory including whats in the different banks
+	MBCVariant m_MemoryBankController;
+	std::shared_ptr<const ROM> m_ROM;
+	const uint8_t* m_CartData; // all cart memory including whats in the different banks
 	uint32_t m_ROM_size; // size in bytes
 
+	template<typename Func>
+	auto VisitMBC(Func&& func) -> decltype(func(std::declval<MBC0&>()))
+	{
+		using Result = decltype(func(std::declval<MBC0&>()));
+
+		return std::visit([&](auto& mbc) -> Result
+		{
+			if constexpr (std::is_same_v<std::decay_t<decltype(mbc)>, std::monostate>)
+				throw std::runtime_error("Cartridge has no memory bank controller");
+			else
+				return func(mbc);
+		}, m_MemoryBankController);
+	}
+
 };
\ No newline at end of file
@@ -3,25 +3,63 @@
 #include <cstdint>
 #include <functional>
 #include <string>
+#include <string_view>
 #include <variant>
-#include <fstream>
 #include <array>
+#include <unordered_map>
+#include <vector>
 
 
 class Emulator; // forward declare to avoid circular definition, need to to link read and write
 
 class CPUTest;
+class Jit;
+
+class StateWriter;
+class StateReader;
 
 class CPU
 {
 	friend class CPUTest;
+	friend class Jit; // compiled code works on the registers and lazy flags directly
 public:
 
 	CPU();
 	void ConnectCPUToBus(Emulator* emu);
 
 	void Reset();
-	void Clock();
+
+	// registers and interrupt state, see savestate.h
+	void SaveState(StateWriter& writer);
+	void LoadState(StateReader& reader);
+
+	uint8_t Step(); // runs a whole instruction (or interrupt dispatch) and returns how many M-cycles it took
+
+	enum class ExecutionMode : uint8_t
+	{
+		Interpreter,	// Step() one instruction at a time
+		BlockCache,		// runs pre-decoded blocks from the emulators BlockCache, falls back to Step() when it cant
+		Lockstep,		// JIT but every cached instruction is checked against what Step() would decode and every compiled
+						// block is run again with Step() to compare registers, flags and ticks
+		Threaded,		// one function with a label per opcode, see RunThreaded()
+		JIT				// BlockCache with hot blocks compiled to x86-64 (see jit.h), the interpreter on anything else
+	};
+
+	ExecutionMode executionMode = ExecutionMode::Interpreter;
+
+	// runs at least one instruction and keeps going until the system tick reaches limit (or the next event)
+	void Execute(uint64_t limit);
+
+	// skips busy wait loops (polling LY, STAT or a flag in RAM) that cant exit before the next event
+	bool idleLoopDetection = true;
+
+	struct IdleLoopStats
+	{
+		uint64_t loopsSkipped = 0;	// how many times a loop got fast forwarded
+		uint64_t cyclesSkipped = 0;	// T-cycles that didnt have to be emulated
+	};
+
+	IdleLoopStats idleLoopStats;
 
 
 	enum Interrupt
@@ -53,7 +91,7 @@ public:
 		};
 	};
 
-	enum AddressingMode {
+	enum AddressingMode : uint8_t {
 		IMPL,
 		IMM8,
 		IMM16,
@@ -67,13 +105,13 @@ public:
 	};
 
 	
-	enum class CondType {
+	enum class CondType : uint8_t {
 		NONE,
 		Z, NZ,
 		C, NC
 	};
 
-	 enum class RegType {
+	 enum class RegType : uint8_t {
 		NONE,
 		A, B, C, D, E, H, L,
 		AF, BC, DE, HL, SP,
@@ -81,23 +119,63 @@ public:
 	};
 
 
+	// packed into 4 bytes, also used as a template argument to build the specialised handlers
 	struct Operand {
 		AddressingMode mode;
 		RegType reg;
 		CondType cond;
-		int meta; // rst's return address or bit index or anything else encoded into the instruction
+		uint8_t meta; // rst's return address or bit index or anything else encoded into the instruction
 	};
 
+	using Handler = void (CPU::*)();
 
+	// Only what is needed to execute, this gets looked up for every instruction so it is kept small
+	// and both jump tables fit in L1. names live in the InstructionInfo tables.
 	struct Instruction
 	{
-		std::string name = ""; // For disassembly
+		Handler execute = nullptr;
 		uint8_t cycles = 0;
-		void (CPU::* execute)() = nullptr;
 		
 		Operand operand1;
 		Operand operand2;
+	};
 
+	// which handler an opcode uses, the operands pick which specialisation of it
+	enum class Op : uint8_t
+	{
+		NOP, HALT, LD, LD_HL_SP, INC, DEC, ADD, ADD_SP, SUB, ADC, SBC, AND, XOR, OR, CP,
+		RET, PUSH, POP, JP, JR, CALL, RLCA, RLA, RRCA, RRA, SCF, CPL, CCF, STOP, RETI, DI, EI, RST, DAA,
+		RLC, RRC, RL, RR, SLA, SRA, SWAP, SRL, BIT, SET, RES
+	};
+
+	// For disassembly, tracing and anything else that needs to know what an opcode is
+	struct InstructionInfo
+	{
+		std::string_view name = "";
+		Op op = Op::NOP;
+	};
+
+	// an instruction decoded ahead of time by the block cache, any immediate has already been read
+	struct DecodedInstruction
+	{
+		const Instruction* instruction;
+		uint16_t immediate;
+		uint8_t length;
+	};
+
+	// a block compiled to machine code by the Jit. runs until the block ends, the system tick reaches stopAt or something
+	// needs it to stop early the way RunBlock does, and returns how many instructions it ran
+	using NativeBlock = uint32_t (*)(CPU* cpu, uint64_t stopAt);
+
+	// what the decoders return, gets split into the two tables above at compile time
+	struct InstructionDescription
+	{
+		std::string_view name = "";
+		uint8_t cycles = 0;
+		Op op = Op::NOP;
+
+		Operand operand1;
+		Operand operand2;
 	};
 
 	Register AF;
@@ -116,24 +194,33 @@ public:
 	uint8_t int_enable = 0;
 	uint8_t int_flag = 0;
 
-	Instruction InstructionByOpcode(uint8_t opcode);
+	static constexpr InstructionDescription InstructionByOpcode(uint8_t opcode);
 	uint8_t m_Cycles = 0;
 
+	// flags are evaluated lazily, AF.lo is only up to date after MaterializeFlags()
 	void SetFlag(Flag flag, uint8_t value);
 	uint8_t GetFlag(Flag flag);
 
+	uint8_t GetFlagsRegister(); // F as the hardware would have it
+	void SetFlagsRegister(uint8_t value);
+	void MaterializeFlags(); // writes the flags back into AF.lo
+
 	bool CheckInterrupt(Interrupt interupt_type, uint16_t address);
 	void RequestInterrupt(Interrupt interrupt_type);
 
-	Instruction HandleCBInstruction(uint8_t opcode);
-	std::array<Instruction, 256> m_JumpTable;
-	std::array<Instruction, 256> m_CBPrefixJumpTable;
+	static constexpr InstructionDescription HandleCBInstruction(uint8_t opcode);
+
+	// built at compile time from the decoders above, shared by every CPU
+	static const std::array<Instruction, 256> m_JumpTable;
+	static const std::array<Instruction, 256> m_CBPrefixJumpTable;
+
+	static const std::array<InstructionInfo, 256> m_JumpTableInfo;
+	static const std::array<InstructionInfo, 256> m_CBPrefixJumpTableInfo;
 
 
 private:
 	Emulator* emu;
 	
-	std::ofstream debug_file;
 
 	void cpu_push(uint8_t byte);
 	uint8_t cpu_pop();
@@ -142,28 +229,29 @@ private:
 	uint16_t cpu_pop16();
 
 public:
-	// Instructions 
+	// Instructions, the templated ones get a copy for every operand combination that appears in the jump tables
+	// so none of the operand decoding happens at runtime
 	void NOP();
 	void HALT();
-	void LD();
-	void LD_HL_SP();
-	void INC();
-	void DEC();
-	void ADD();
-	void ADD_SP();
-	void SUB();
-	void ADC();
-	void SBC();
-	void AND();
-	void XOR();
-	void OR();
-	void CP();
-	void RET();
-	void PUSH();
-	void POP();
-	void JP();
-	void JR();
-	void CALL();
+	template<Operand Dst, Operand Src> void LD();
+	template<Operand Src> void LD_HL_SP();
+	template<Operand Dst> void INC();
+	template<Operand Dst> void DEC();
+	template<Operand Dst, Operand Src> void ADD();
+	template<Operand Src> void ADD_SP();
+	template<Operand Src> void SUB();
+	template<Operand Dst, Operand Src> void ADC();
+	template<Operand Dst, Operand Src> void SBC();
+	template<Operand Src> void AND();
+	template<Operand Src> void XOR();
+	template<Operand Src> void OR();
+	template<Operand Src> void CP();
+	template<Operand Cond> void RET();
+	template<Operand Src> void PUSH();
+	template<Operand Dst> void POP();
+	template<Operand Cond, Operand Src> void JP();
+	template<Operand Cond, Operand Src> void JR();
+	template<Operand Cond, Operand Src> void CALL();
 	void RLCA();
 	void RLA();
 	void RRCA();
@@ -175,55 +263,150 @@ public:
 	void RETI();
 	void DI();
 	void EI();
-	void RST();
+	template<Operand Target> void RST();
 	void DAA();
 
 	// CB instructions
-	void RLC();
-	void RRC();
-	void RL();
-	void RR();
-	void SLA();
-	void SRA();
-	void SWAP();
-	void SRL();
-	void BIT();
-	void SET();
-	void RES();
+	template<Operand Dst> void RLC();
+	template<Operand Dst> void RRC();
+	template<Operand Dst> void RL();
+	template<Operand Dst> void RR();
+	template<Operand Dst> void SLA();
+	template<Operand Dst> void SRA();
+	template<Operand Dst> void SWAP();
+	template<Operand Dst> void SRL();
+	template<Operand Bit, Operand Src> void BIT();
+	template<Operand Bit, Operand Dst> void SET();
+	template<Operand Bit, Operand Dst> void RES();
 	
 
-	Instruction m_CurrentInstruction;
+	const Instruction* m_CurrentInstruction = nullptr; // points into one of the jump tables
 
 private:
 
-	inline bool Is16Bit(const Operand& operand) {
-		return operand.mode == REG16 ||
-			   operand.mode == IMM16			   ;
+	const DecodedInstruction* m_CurrentDecoded = nullptr; // set while running a cached block
+
+	// Lazy flags. ALU instructions just store what they need and the flag only gets worked out when something reads it.
+	// Z is set when m_ZeroResult is 0 and H keeps the operands of the last add/sub that touched it
+	enum class HalfCarryMode : uint8_t { Clear, Set, Add, Sub };
+
+	uint8_t m_ZeroResult = 0;
+	bool m_FlagN = false;
+	bool m_FlagC = false;
+
+	HalfCarryMode m_HalfCarryMode = HalfCarryMode::Clear;
+	uint8_t m_HalfA = 0;
+	uint8_t m_HalfB = 0;
+	uint8_t m_HalfCarryIn = 0;
+
+	void SetZeroFrom(uint8_t result) { m_ZeroResult = result; }
 
+	void SetHalfCarryAdd(uint8_t a, uint8_t b, uint8_t carry = 0)
+	{
+		m_HalfCarryMode = HalfCarryMode::Add;
+		m_HalfA = a;
+		m_HalfB = b;
+		m_HalfCarryIn = carry;
+	}
+
+	void SetHalfCarrySub(uint8_t a, uint8_t b, uint8_t carry = 0)
+	{
+		m_HalfCarryMode = HalfCarryMode::Sub;
+		m_HalfA = a;
+		m_HalfB = b;
+		m_HalfCarryIn = carry;
 	}
 
+	bool GetHalfCarry() const;
+
+	// Idle loops. The first time a short backward branch is taken the loop body gets checked once (cached per bank and PC)
+	// for anything that could change state: writes, stack use, timer reads etc. After that if a whole iteration comes back
+	// to the head with the same registers and no event in between, every iteration until the next event will be the same
+	// so they get skipped in one go.
+	struct IdleLoop
+	{
+		bool idle = false;
+
+		// registers used as read addresses, they never change in the loop so the addresses get checked when skipping
+		uint8_t addressRegCount = 0;
+		std::array<RegType, 4> addressRegs;
+	};
+
+	struct IdleLoopWatch
+	{
+		const IdleLoop* loop = nullptr;
+		uint16_t head = 0;
+		uint16_t bank = 0;
+
+		uint64_t arrival = 0;	// tick the loop head was last reached
+		uint64_t events = 0;	// events dispatched at that point
+		std::array<uint16_t, 5> registers;
+	};
 
-	uint16_t fetch(const Operand& operand);
-	// fetching helper functions
-	uint16_t getRegisterValue(RegType type);
+	static constexpr int MAX_IDLE_LOOP_LENGTH = 8; // instructions, not counting the branch back
+
+	std::unordered_map<uint32_t, IdleLoop> m_IdleLoops; // ROM only
+	IdleLoop m_RAMIdleLoop; // analysed again whenever it could have been rewritten
+	IdleLoopWatch m_IdleWatch;
+
+	uint64_t m_RunLimit = 0; // limit passed to Execute(), 0 when single stepping
+
+	void OnBackwardBranch(uint16_t branchPC);
+	IdleLoop AnalyzeIdleLoop(uint16_t head, uint16_t branchPC);
+	static bool IsIdleReadAddress(uint16_t address);
+	std::array<uint16_t, 5> GetLoopRegisters();
+
+	// fast forwards to the next event if halted with nothing pending, returns false if the cpu has work to do
+	bool SkipHalt(uint64_t limit);
+
+	void RunBlock(uint64_t limit);
+	void RunThreaded(uint64_t limit);
+
+	// runs the handler for one opcode directly so the threaded core can inline it
+	template<bool CBPrefix, uint8_t Opcode>
+	void ExecuteOpcode();
+
+	// runs a compiled block, then rolls back and runs it again with Step() to check it. what Step() did is kept
+	void RunNativeLockstep(NativeBlock code, uint64_t limit, uint16_t startPC);
+	std::vector<uint8_t> m_LockstepState;
+
+	// the same as plain functions, for compiled code to call
+	template<bool CBPrefix, uint8_t Opcode>
+	static void RunOpcode(CPU* cpu);
+
+	using OpcodeFunction = void (*)(CPU* cpu);
+	static const std::array<OpcodeFunction, 256> m_OpcodeFunctions;
+	static const std::array<OpcodeFunction, 256> m_CBOpcodeFunctions;
+
+	// called by compiled code after every handler, the tick it has to stop at or 0 if it has to stop now
+	static uint64_t NativeStopTime(CPU* cpu);
+
+	uint8_t FetchImmediate8();
+	uint16_t FetchImmediate16();
+
+	static constexpr bool Is16Bit(const Operand& operand) {
+		return operand.mode == REG16 ||
+			   operand.mode == IMM16			   ;
+
+	}
 
-	// might do function overloading but seems fine for now
-	void writeOperand8(Operand& op, uint8_t operand);
-	void writeOperand16(Operand& op, uint16_t operand);
+	template<RegType Reg> uint8_t& Register8();
+	template<RegType Reg> uint16_t& Register16();
 
-	void writeRegister8(RegType reg, uint8_t value);
-	void writeRegister16(RegType reg, uint16_t value);
+	template<Operand Op> uint16_t fetch();
 
-	bool checkCond(CondType cond);
+	template<Operand Op> void writeOperand8(uint8_t value);
+	template<Operand Op> void writeOperand16(uint16_t value);
 
+	template<CondType Cond> bool checkCond();
 
 	
 	// https://gbdev.io/pandocs/CPU_Instruction_Set.html
-	static Operand DecodeReg8(uint8_t bits);
-	static Operand DecodeReg16(uint8_t bits);
-	static Operand DecodeReg16STK(uint8_t bits);
-	static Operand DecodeReg16MEM(uint8_t bits);
-	static Operand DecodeCond(uint8_t bits);
+	static constexpr Operand DecodeReg8(uint8_t bits);
+	static constexpr Operand DecodeReg16(uint8_t bits);
+	static constexpr Operand DecodeReg16STK(uint8_t bits);
+	static constexpr Operand DecodeReg16MEM(uint8_t bits);
+	static constexpr Operand DecodeCond(uint8_t bits);
 
 
 };
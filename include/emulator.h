@@ -3,13 +3,20 @@
 #include <array>
 #include <string>
 #include <memory>
-#include <cstdint>
+#include <vector>
+#include <span>
+#include <iostream>
 
 
 #include "cartridge.h"
 #include "cpu.h"
 #include "timer.h"
 #include "ppu.h"
+#include "scheduler.h"
+#include "blockcache.h"
+#include "memorymap.h"
+#include "rewind.h"
+#include "inputscript.h"
 
   
 
@@ -19,7 +26,11 @@ public:
 	Emulator();
 
 	void UpdateFrame(); // this updates all emulator things, including the buffer of pixels
-	void clock();
+	void RunFrame(); // one frame and nothing else, UpdateFrame without run ahead or recording it for rewind
+	void clock(); // steps a single cpu instruction, used for debugging
+
+	// runs the cpu back to back until the next scheduled event, then lets the components handle it
+	void RunUntil(uint64_t targetTick);
 	
 	struct ButtonState
 	{
@@ -34,6 +45,25 @@ public:
 
 		bool sel_dpad = false;
 		bool sel_button = false;
+
+		// the eight buttons as one byte, a is bit 0 through to down in bit 7. the select bits belong to the game
+		// and are left alone
+		uint8_t GetHeld() const
+		{
+			return (uint8_t)(a | (b << 1) | (select << 2) | (start << 3) | (right << 4) | (left << 5) | (up << 6) | (down << 7));
+		}
+
+		void SetHeld(uint8_t held)
+		{
+			a = held & 0x01;
+			b = held & 0x02;
+			select = held & 0x04;
+			start = held & 0x08;
+			right = held & 0x10;
+			left = held & 0x20;
+			up = held & 0x40;
+			down = held & 0x80;
+		}
 	};
 
 	ButtonState buttonState;
@@ -48,29 +78,75 @@ public:
 
 	void LoadROM(const std::string& filepath);
 
+	uint16_t GetROMBank() const; // bank currently mapped at 0x4000-0x7FFF
+
 	void Reset();
 
+	// Resets, runs warmupFrames frames with the buttons from input and remembers where that left the emulator.
+	// FastReset goes straight back there by loading it as a state, so the boot and whatever the script skips (title
+	// screens, menus) only get emulated once no matter how many times the game is reset. cart RAM is part of it too
+	void CaptureResetPoint(uint64_t warmupFrames = 0, const InputScript& input = {});
+	void FastReset(); // a plain Reset if no reset point was captured
+	bool HasResetPoint() const { return !m_ResetPoint.empty(); }
+	// for copying one to another emulator running the same ROM, checked when FastReset loads it
+	std::span<const uint8_t> GetResetPoint() const { return m_ResetPoint; }
+	void SetResetPoint(std::span<const uint8_t> state) { m_ResetPoint.assign(state.begin(), state.end()); }
+
+	// Snapshots everything but the ROM and host side settings into state, see savestate.h for the layout.
+	// state keeps its capacity between calls so saving over and over doesnt allocate.
+	// without the frame the screen is left as is on load until the next frame is drawn, which keeps states that
+	// are only ever loaded and run forward (rewind, run ahead) a lot smaller
+	void SaveState(std::vector<uint8_t>& state, bool includeFrame = true);
+	// throws std::runtime_error if the state is broken, from another version or for another ROM, and leaves the
+	// emulator as it was
+	void LoadState(std::span<const uint8_t> state);
+
+	// writes battery RAM to disk now, the save writer otherwise waits until the game stops writing to it
+	void FlushSave();
+
+	Scheduler scheduler;
+	MemoryMap memoryMap; // fast path for read/write, anything not mapped goes through the address decoding below
+	BlockCache blockCache; // decoded code for CPU::ExecutionMode::BlockCache and JIT
+	SaveOptions saveOptions; // picked up by the next LoadROM
+	Rewind rewind; // off until Enable is called, records every UpdateFrame after that (but not the frames run ahead)
+
+	// frames UpdateFrame runs past the real one with the same input and shows, then rolls back. hides the lag games
+	// have between reading the joypad and drawing the result, at the cost of running 1 + runAheadFrames frames each time
+	int runAheadFrames = 0;
 	CPU cpu; // public just to draw stuff
 	Timer timer;
 	PPU ppu;
 	LCD lcd;
 	DMA dma;
 	
-	std::array<uint8_t, 0x10000> memory;
-
 	std::array<uint8_t, 0x2000> wram;
 	std::array<uint8_t, 0x80> hram;
 
 
+	std::ostream* serialOutput = &std::cout; // bytes the game sends over the link cable, nullptr drops them
+
 	bool romLoaded = false;
 	uint64_t m_SystemTicks = 0;
+	uint64_t m_EventsDispatched = 0; // lets the cpu tell if anything outside of it could have changed between two points in time
 
 
 private:
+	friend class CPU; // lockstep rolls back to the start of a compiled block to run it again with Step()
+
 	std::unique_ptr<Cartridge> cartridge;
 
 
 	uint8_t serial_data[2];
 	uint8_t joypadState = 0x30;
 
+	std::vector<uint8_t> m_RunAheadState; // the real frame while the frames ahead of it are shown
+	std::vector<uint8_t> m_ResetPoint; // empty until CaptureResetPoint, dropped when another ROM is loaded
+	std::vector<uint8_t> m_LoadBackup; // what LoadState puts back if the state turns out to be broken
+
+	// LoadState without the safety net, for states made by this emulator. keepRAMBlocks is for rolling back to a state
+	// saved moments ago, code in RAM that got written over since then is already invalidated
+	void RestoreState(std::span<const uint8_t> state, bool keepRAMBlocks = false);
+
+	void DispatchEvents();
+	void CompleteSerialTransfer();
 };
\ No newline at end of file
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <istream>
+
+// Buttons to press over a run, for the headless runner and batch jobs.
+// One line per change: the frame it happens on and the buttons held from then on, a line with just a frame lets go
+// of everything. Lines have to be in frame order and # starts a comment
+//   60 start
+//   70
+//   200 right a
+struct InputScript
+{
+	struct Change
+	{
+		uint64_t frame;
+		uint8_t buttons; // as Emulator::ButtonState::GetHeld
+	};
+
+	std::vector<Change> changes;
+
+	// throws std::runtime_error with the line number if something doesnt parse
+	static InputScript Parse(std::istream& in);
+	static InputScript Load(const std::string& path);
+
+	// buttons held during frame, which has to be the same or later than last time. cursor starts at 0
+	uint8_t GetButtons(uint64_t frame, size_t& cursor) const
+	{
+		while (cursor < changes.size() && changes[cursor].frame <= frame) cursor++;
+		return cursor ? changes[cursor - 1].buttons : 0;
+	}
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <span>
+
+#include "cpu.h"
+
+// GB_JIT=0 leaves it out, it only gets built for x86-64 either way
+#ifndef GB_JIT
+#define GB_JIT 1
+#endif
+
+#if GB_JIT && (defined(__x86_64__) || defined(_M_X64))
+#define GB_JIT_X64 1
+#else
+#define GB_JIT_X64 0
+#endif
+
+// Compiles hot blocks from the BlockCache to x86-64 for CPU::ExecutionMode::JIT.
+// Register loads, INC/DEC and 8-bit ALU ops on registers or immediates get their own machine code. Anything that touches
+// memory, jumps or is rare enough not to matter calls the same handler Step() would. The system tick is added to after
+// every instruction and the block exits at the same instruction boundaries RunBlock would stop at, so events and
+// interrupts happen exactly when they would with the interpreter.
+class Jit
+{
+public:
+	static constexpr bool IsSupported() { return GB_JIT_X64; }
+
+	Jit() = default;
+	~Jit();
+
+	Jit(const Jit&) = delete;
+	Jit& operator=(const Jit&) = delete;
+
+	// nullptr if this build has no JIT, there is no executable memory to be had or the buffer is full
+	CPU::NativeBlock Compile(CPU& cpu, uint16_t startPC, std::span<const CPU::DecodedInstruction> instructions);
+
+	// throws away all compiled code, nothing compiled before can be called after this
+	void Reset() { m_Used = 0; }
+
+	size_t GetCodeSize() const { return m_Used; }
+
+	static constexpr size_t BUFFER_SIZE = 4 * 1024 * 1024;
+
+private:
+	uint8_t* m_Buffer = nullptr; // allocated by the first Compile
+	size_t m_Used = 0;
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <condition_variable>
+
+// The other way of keeping battery RAM on disk: the .sav file is mapped shared into memory and used as the
+// cart RAM directly, so the game writing to it is just a store and the OS writes the pages back on its own.
+// A thread syncs the mapping every so often so not much is lost if the machine (not just the emulator) goes down.
+class MappedSave
+{
+public:
+	// returns nullptr if the file cant be created or mapped
+	static std::unique_ptr<MappedSave> Open(const std::string& fileName, size_t size, std::chrono::milliseconds syncInterval);
+	~MappedSave(); // syncs and unmaps
+
+	MappedSave(const MappedSave&) = delete;
+	MappedSave& operator=(const MappedSave&) = delete;
+
+	uint8_t* GetData() { return m_Data; }
+
+	// syncs now and waits for it
+	void Flush();
+
+private:
+	MappedSave() = default;
+
+	void Run();
+
+	uint8_t* m_Data = nullptr;
+	size_t m_Size = 0;
+
+#ifdef _WIN32
+	void* m_File = nullptr;
+	void* m_Mapping = nullptr;
+#else
+	int m_File = -1;
+#endif
+
+	std::chrono::milliseconds m_SyncInterval{};
+
+	std::mutex m_Mutex;
+	std::condition_variable m_Wake;
+	bool m_Stopping = false;
+
+	std::thread m_Thread;
+};
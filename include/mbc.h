@@ -1,58 +1,120 @@
 #pragma once
 
 #include <cstdint>
+#include <cassert>
 #include <array>
 #include <memory>
 #include <vector>
 #include <string>
 #include <fstream>
+#include <variant>
+#include <span>
 
-struct CartridgeHeader; // forward declare to avoid circular definition
+#include "memorymap.h"
+#include "savemanager.h"
+#include "mappedsave.h"
+#include "savestate.h"
 
-class SaveManager
-{
-public:
-	SaveManager(std::string_view fileName);
-	void Save(char* data, size_t size);
-private:
-	std::ofstream m_OutputStream;
-};
+struct CartridgeHeader; // forward declare to avoid circular definition
 
 
 // Memory bank controller
 class MBC {
 public:
-	MBC(uint8_t* cartData);
+	MBC(const uint8_t* cartData);
 	virtual ~MBC() = default;
 
 	virtual uint8_t read(uint16_t address) = 0;
 	virtual void write(uint16_t address, uint8_t data) = 0;
+
+	// bank mapped at 0x4000-0x7FFF, used to key cached code
+	virtual uint16_t GetROMBank() const { return 1; }
+
+	void ConnectMemoryMap(MemoryMap* memoryMap, size_t romSize);
+
+	// points the ROM and external RAM pages at whatever is currently banked in, called after every register write
+	virtual void MapPages();
+
+	// makes the save writer write battery RAM right now instead of whenever it gets to it
+	void FlushSave()
+	{
+		if (saveManager) saveManager->Flush();
+		if (mappedSave) mappedSave->Flush();
+	}
 protected:
-	uint8_t* cartData;
+	const uint8_t* cartData; // shared between every cart running this ROM, never written
+
+	// cart RAM lives in one of these, saveManager is declared last so it stops before the RAM goes away
+	std::unique_ptr<uint8_t[]> ramStorage;
+	std::unique_ptr<MappedSave> mappedSave;
+	std::unique_ptr<SaveManager> saveManager; // null unless the cart has a battery and uses SaveOptions::Mode::Writer
+
+	// cart RAM writes go through here so battery backed RAM gets picked up by the save writer
+	void WriteRAM(uint8_t* ram, size_t offset, uint8_t data)
+	{
+		if (saveManager) saveManager->Write(offset, data);
+		else ram[offset] = data;
+	}
+
+	MemoryMap* memoryMap = nullptr;
+	size_t romSize = 0;
+
+	// bank numbers wrap around at the ROM size like on hardware, so read() never goes past the end of cartData
+	uint16_t romBankMask = 0xFFFF;
+	void SetROMBankMask(uint8_t headerROMSize) { romBankMask = (2 << headerROMSize) - 1; }
+
+	void MapROMBank(uint32_t bank);
+	// RAM the save writer is watching is only mapped for reading, writes still go through write() so they get saved
+	void MapRAMBank(uint8_t* ram, size_t ramSize, uint32_t bank, bool enabled);
+
+	// allocates the cart RAM and loads whatever is in the .sav into it, or maps the .sav as the RAM.
+	// footer is filled with whatever comes after the RAM in the file (zeros if nothing does)
+	uint8_t* OpenRAM(const std::string& title, size_t ramSize, bool requiresSave, const SaveOptions& saveOptions, std::span<uint8_t> footer = {});
+
+	// replaces what gets written after the RAM
+	void WriteFooter(std::span<const uint8_t> footer);
+
+	// for save states, loading only touches the RAM (and the save writer) if it actually changed
+	static void SaveRAM(StateWriter& writer, const uint8_t* ram, size_t size) { writer.WriteBytes(ram, size); }
+	void LoadRAM(StateReader& reader, uint8_t* ram, size_t size);
+
+	static constexpr uint32_t STATE_ID = MakeChunkID("MBC ");
+	static constexpr uint32_t STATE_VERSION = 1;
+	size_t savedRAMSize = 0;
 };
 // ROM ONLY
-class MBC0 : public MBC {
+class MBC0 final : public MBC {
 public:
-	MBC0(uint8_t* cartData);
+	MBC0(const uint8_t* cartData);
 
 	uint8_t read(uint16_t address) override;
 	void write(uint16_t address, uint8_t data) override;
 
+	void MapPages() override;
+
+	// save states: each controller writes its registers and RAM (and clock) into one chunk.
+	// MapPages has to be called after loading
+	void SaveState(StateWriter& writer);
+	void LoadState(StateReader& reader);
+
 private:
 	std::array<uint8_t, 0x2000> externalRam;
 };
 
-class MBC1 : public MBC {
+class MBC1 final : public MBC {
 public:
-	MBC1(uint8_t* cartData, const CartridgeHeader& header);
-	~MBC1() override;
+	MBC1(const uint8_t* cartData, const CartridgeHeader& header, const SaveOptions& saveOptions = {});
 
 	uint8_t read(uint16_t address) override;
 	void write(uint16_t address, uint8_t data) override;
-private:
 
-	void save();
+	uint16_t GetROMBank() const override { return romBankNumber; }
+
+	void MapPages() override;
 
+	void SaveState(StateWriter& writer);
+	void LoadState(StateReader& reader);
+private:
 	uint8_t* externalRAM;
 
 	bool ramEnabled = false;
@@ -65,95 +127,281 @@ private:
 
 	std::string title; // file name to save and read from
 	
-	std::ofstream ofs;
 	bool requiresSave;
 };
 
-class MBC2 : public MBC
+class MBC2 final : public MBC
 {
 public:
-	MBC2(uint8_t* cartData, const CartridgeHeader& header);
-	~MBC2();
-	
+	MBC2(const uint8_t* cartData, const CartridgeHeader& header, const SaveOptions& saveOptions = {});
 
 	uint8_t read(uint16_t address) override;
 	void write(uint16_t address, uint8_t data) override;
 
+	uint16_t GetROMBank() const override { return romBankNumber; }
+
+	void SaveState(StateWriter& writer);
+	void LoadState(StateReader& reader);
+
 private:
 	int romBankNumber = 1;
 
-	std::array<uint8_t, 512> ram;
+	static constexpr size_t RAM_SIZE = 512;
+	uint8_t* ram;
 	bool requiresSave;
 
 	bool ramEnabled = false;
 
 	std::string title;
-
-	std::ofstream ofs;
-	void save();
-
 };
 
-// Real Time Clock (realised all only gameboy color games uses this which this emualtor does not support)
-// basically this struct is useless
-// keeping it here in case i want to ever make this a gameboy color emulator
-struct RTC
+// MBC3 Real Time Clock. It counts emulated T-cycles instead of reading the host clock, so it keeps up with
+// fast forward and the same run always sees the same time. The host clock is only looked at when a .sav is
+// loaded with SaveOptions::rtcCatchUp
+class RTC
 {
+public:
+	static constexpr uint64_t CYCLES_PER_SECOND = 4194304;
 
-	RTC() = default;
+	// 5 live registers then 5 latched ones as 32 bit values, then a 64 bit unix timestamp of when it was saved.
+	// same layout as most other emulators put at the end of the .sav
+	static constexpr size_t SAVE_FOOTER_SIZE = 48;
+
+	void ConnectSystemClock(const uint64_t* systemTicks);
+
+	// reg is 0x08-0x0C, reads give the latched value
+	uint8_t Read(uint8_t reg) const;
+	void Write(uint8_t reg, uint8_t data);
+
+	// writing 0 then 1 copies the live registers into the latched ones
+	void WriteLatch(uint8_t data);
+
+	void SaveFooter(uint8_t* footer);
+	// just the registers, from emulated time only. cheap enough to do on every cart RAM write
+	void SaveFooterRegisters(uint8_t* footer);
+	// puts the host time in the footer as the time it was saved at
+	static void StampFooter(uint8_t* footer);
+	// an all zero footer means there wasnt a clock in the save
+	void LoadFooter(const uint8_t* footer, bool catchUp);
+
+	void AdvanceSeconds(uint64_t seconds);
+
+	// everything including the part of a second that has gone by, written into the MBC3 chunk
+	void SaveState(StateWriter& writer);
+	void LoadState(StateReader& reader);
 
-	uint8_t S;
-	uint8_t M;
-	uint8_t H;
-	uint8_t DL;
-	uint8_t DH;
-	
-	uint8_t latchRegister;
-
-	void SetActive(uint8_t reg);
-	void WriteActive(uint8_t data);
-	uint8_t GetActive();
-	void LatchRegisters(uint8_t data);
-	bool IsHalted();
-	uint8_t GetDayCounterCarry();
-	
 private:
-	// shouldnt be able to set the pointer to whatever
-	uint8_t* active = nullptr;
+	struct Registers
+	{
+		uint8_t S = 0;
+		uint8_t M = 0;
+		uint8_t H = 0;
+		uint8_t DL = 0;
+		uint8_t DH = 0; // bit 0 is bit 8 of the day counter, bit 6 halts the clock, bit 7 is the day counter carry
+	};
+
+	Registers live;
+	Registers latched;
+
+	uint8_t latchRegister = 0xFF;
+
+	const uint64_t* systemTicks = nullptr;
+	uint64_t lastSync = 0;
+	uint64_t subSecondCycles = 0;
 
+	bool IsHalted() const { return live.DH & (1 << 6); }
+
+	// catches the live registers up with the system clock
+	void Sync();
+	void Tick(); // one second, the slow way so out of range values wrap like on hardware
 };
 
-class MBC3 : public MBC
+class MBC3 final : public MBC
 {
 public:
-	MBC3(uint8_t* cartData, const CartridgeHeader header, bool requiresSave);
-	~MBC3();
+	MBC3(const uint8_t* cartData, const CartridgeHeader header, bool requiresSave, const SaveOptions& saveOptions = {});
+	~MBC3() override;
 
 
 	uint8_t read(uint16_t address) override;
 	void write(uint16_t address, uint8_t data) override;
 
+	uint16_t GetROMBank() const override { return romBankNumber; }
+
+	void MapPages() override;
+
+	// the clock runs off the emulators cycle counter
+	void ConnectSystemClock(const uint64_t* systemTicks) { rtc.ConnectSystemClock(systemTicks); }
+
+	// hides MBC::FlushSave so the clock gets saved along with the RAM
+	void FlushSave();
+
+	void SaveState(StateWriter& writer);
+	void LoadState(StateReader& reader);
 
 private:
 
 	uint8_t romBankNumber = 1;
-	uint8_t ramBankNumber = 1;
+	uint8_t ramBankNumber = 0;
 
 	uint8_t registerSelect = 0;
 
 	bool ramAndTimerEnable = false;
 
 	uint8_t* ram;
+
 	RTC rtc;
+	bool hasTimer;
+	void SaveRTC();
+
+	// the save writer can write the RAM any time after a write to it, so every RAM write hands it the clock as it is
+	// then. only goes through the writers lock when the clock has moved
+	std::array<uint8_t, RTC::SAVE_FOOTER_SIZE> writerFooter = {};
+	void RefreshRTCFooter();
 
 	bool requiresSave;
 	std::string title;
 	uint32_t ramSize;
+};
 
-	std::ofstream ofs;
+// 9 bit ROM bank (up to 8MiB) and 16 RAM banks. Bank 0 can be mapped at 0x4000 too.
+// The base address of every bank is worked out once when the cart loads, so a bank switch is a pointer store
+// and a read is a single index
+class MBC5 final : public MBC
+{
+public:
+	MBC5(const uint8_t* cartData, const CartridgeHeader& header, const SaveOptions& saveOptions = {});
+
+	uint8_t read(uint16_t address) override;
+	void write(uint16_t address, uint8_t data) override;
+
+	uint16_t GetROMBank() const override { return romBankNumber; }
+
+	void MapPages() override;
+
+	void SaveState(StateWriter& writer);
+	void LoadState(StateReader& reader);
+
+private:
+	uint16_t romBankNumber = 1;
+	uint8_t ramBankNumber = 0;
+	bool ramEnabled = false;
 
-	void save();
+	bool hasRumble;
 
+	std::array<const uint8_t*, 512> romBanks; // every bank number, wrapped to the ROM size
+	std::array<uint8_t*, 16> ramBanks;
+
+	const uint8_t* romBank; // romBanks[romBankNumber]
+	uint8_t* ramBank; // ramBanks[ramBankNumber]
+
+	uint8_t* ram;
+	uint32_t ramSize;
+
+	std::string title;
 };
 
-std::unique_ptr<MBC> CreateMBCByType(const CartridgeHeader& header, uint8_t* cartData);
\ No newline at end of file
+// read is on the bus path for anything that isnt mapped, kept here so it can inline into Cartridge::ReadCart
+
+inline uint8_t MBC0::read(uint16_t address)
+{
+	if (address < 0x8000)
+		return cartData[address];
+	else
+		return externalRam[address - 0xA000];
+}
+
+inline uint8_t MBC1::read(uint16_t address)
+{
+	if (address < 0x4000)
+		return cartData[address];
+	
+	if ((address & 0xE000) == 0xA000)
+	{
+		if (!ramEnabled) return 0xFF;
+
+		uint8_t ramBank = bankingMode == 0 ? 0 : ramBankNumber;
+		int effectiveAddress = (address - 0xA000) + ramBank * 0x2000;
+
+		return externalRAM[effectiveAddress];
+	}
+
+	int effectiveAddress1 = (address - 0x4000) + romBankNumber * 0x4000;
+
+	assert(effectiveAddress1 < cartDataSize);
+
+	return cartData[effectiveAddress1];
+}
+
+inline uint8_t MBC2::read(uint16_t address)
+{
+	if (address < 0x4000)
+		return cartData[address];
+	else if (address < 0x8000)
+	{
+		int effectiveAddress = (address - 0x4000) + romBankNumber * 0x4000;
+		assert(effectiveAddress < 262144);
+		return cartData[effectiveAddress];
+	}
+
+	else if (address >= 0xA000 && address < 0xA200)
+	{
+		if (!ramEnabled) return 0xBB;
+		return (ram[address - 0xA000] & 0xF) | 0xF0;
+	}
+	else if (address >= 0xA200 && address < 0xC000)
+	{
+		if (!ramEnabled) return 0xBB;
+		return (ram[address & 0x1FF] & 0xF) | 0xF0; // lower 9 bits only
+	}
+
+	return 0xFF; // the bus only sends ROM and cart RAM addresses here
+}
+
+inline uint8_t MBC3::read(uint16_t address)
+{
+	if (address < 0x4000)
+		return cartData[address];
+	else if (address < 0x8000)
+	{
+		int effectiveAddress = (address - 0x4000) + romBankNumber * 0x4000;
+		return cartData[effectiveAddress];
+	}
+	else if (address >= 0xA000 && address <= 0xBFFF)
+	{
+		if (!ramAndTimerEnable) return 0xFF;
+
+		if (registerSelect < 8)
+		{
+			if (ramSize == 0) return 0xFF;
+
+			int effectiveAddress = (address - 0xA000) + ramBankNumber * 0x2000;
+			return ram[effectiveAddress];
+		}
+
+		if (registerSelect <= 0x0C) return rtc.Read(registerSelect);
+	}
+
+	return 0xFF;
+}
+
+inline uint8_t MBC5::read(uint16_t address)
+{
+	if (address < 0x4000)
+		return cartData[address];
+	else if (address < 0x8000)
+		return romBank[address - 0x4000];
+	else if (address >= 0xA000 && address < 0xC000)
+	{
+		if (!ramEnabled || ramSize == 0) return 0xFF;
+		return ramBank[address - 0xA000];
+	}
+
+	return 0xFF;
+}
+
+// The controller type is picked once when the ROM is loaded. Cartridge visits this instead of going through
+// the virtual interface so every call is resolved at compile time, the base class is still there for shared code
+using MBCVariant = std::variant<std::monostate, MBC0, MBC1, MBC2, MBC3, MBC5>;
+
+void CreateMBCByType(MBCVariant& mbc, const CartridgeHeader& header, const uint8_t* cartData, const SaveOptions& saveOptions);
\ No newline at end of file
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+
+// 256 pages of 256 bytes each pointing straight at host memory, so most reads and writes are a
+// single lookup instead of going through the address decoding in Emulator::read/write.
+// A null page means the access needs a handler (IO, OAM, banked RAM with side effects etc.) and
+// falls back to the slow path. MBCs remap their pages whenever a bank gets switched.
+class MemoryMap
+{
+public:
+	static constexpr int PAGE_SIZE = 0x100;
+	static constexpr int PAGE_COUNT = 0x100;
+
+	MemoryMap();
+
+	void Clear();
+
+	// size has to be a multiple of PAGE_SIZE
+	void Map(uint16_t start, uint32_t size, uint8_t* data, bool writable);
+	void Map(uint16_t start, uint32_t size, const uint8_t* data); // read only, writes go to the slow path
+	void Unmap(uint16_t start, uint32_t size);
+
+	// writes to a watched page always go through the slow path, used by the block cache for pages with code in them
+	void WatchWrites(uint8_t page);
+	void UnwatchWrites(uint8_t page);
+
+	const uint8_t* GetReadPage(uint16_t address) const { return m_ReadPages[address >> 8]; }
+	uint8_t* GetWritePage(uint16_t address) const { return m_WritePages[address >> 8]; }
+
+private:
+	std::array<const uint8_t*, PAGE_COUNT> m_ReadPages;
+	std::array<uint8_t*, PAGE_COUNT> m_WritePages;
+
+	std::array<uint8_t*, PAGE_COUNT> m_MappedWrites; // what m_WritePages points at when not watched
+	std::array<bool, PAGE_COUNT> m_Watched;
+};
@@ -1,8 +1,10 @@
 #pragma once
 
 #include <cstdint>
-#include <queue>
+#include <deque>
+#include <vector>
 #include <array>
+#include <span>
 #include "cpu.h"
 
 constexpr int RESX = 160;
@@ -33,14 +35,20 @@ struct Sprite // USELESS NOW
 };
 
 class Emulator;
+class StateWriter;
+class StateReader;
 
 class DMA
 {
 public:
-    void Reset() { currentAddress = 0; transferring = false; }
+    void Reset();
     void ConnectToEmulator(Emulator* emu);
+
+    void SaveState(StateWriter& writer) const;
+    void LoadState(StateReader& reader);
+
     void StartTransfer(uint8_t value);
-    void Tick();
+    void Complete(); // called by the scheduler once the 160 byte transfer is done
     inline bool isTransferring() const { return transferring; }
 private:
     Emulator* emu;
@@ -83,6 +91,8 @@ struct LCD
     
     void Reset();
 
+    void SaveState(StateWriter& writer) const;
+    void LoadState(StateReader& reader);
     
     bool GetStatusBit(const Status statusType) const noexcept { return !!(status & statusType); }
     bool GetControlBit(const Control controlType) const noexcept { return !!(lcdc & controlType); }
@@ -132,10 +142,20 @@ public:
 
     void VRAM_write(uint16_t address, uint8_t data);
     uint8_t VRAM_read(uint16_t address);
+    uint8_t* GetVRAM() { return vram; } // for the memory map
     
-    void tick();
+    // catches the pixel pipeline up to the given system tick, only mode 3 does any per dot work
+    void Sync(uint64_t now);
+    void OnEvent(uint64_t when);
     void Reset();
 
+    // VRAM, OAM, the pixel fifos and fetcher
+    void SaveState(StateWriter& writer) const;
+    void LoadState(StateReader& reader);
+    // the frame drawn so far, its own chunk since it is output rather than state the game can read back
+    void SaveFrame(StateWriter& writer) const;
+    void LoadFrame(StateReader& reader); // keeps the current frame if the state was saved without one
+
     void ConnectCPU(CPU* cpu);
     void ConnectLCD(LCD* lcd);
     void ConnectToEmulator(Emulator* emu);
@@ -147,13 +167,34 @@ public:
         DRAWPIXELS
     };
 
+    // what the ppu writes pixels out as. everything but RGBA goes to outputBuffer instead of videoBuffer, for
+    // things like training agents where the 92KB RGBA frame is mostly memory bandwidth
+    enum class VideoOutput {
+        RGBA,       // videoBuffer, what the window shows
+        Indexed,    // one byte per pixel, 0 (white) to 3 (black) after the palettes
+        Packed2bpp, // the same four pixels to a byte, leftmost in the low bits. 5760 bytes
+        Gray2x,     // 80x72, each byte the average brightness (255 is white) of a 2x2 block
+        Gray4x,     // 40x36 the same way
+    };
+
     std::array<uint32_t, RESX * RESY> videoBuffer;
+    std::array<uint8_t, RESX * RESY> outputBuffer;
+    VideoOutput videoOutput = VideoOutput::RGBA;
+    // off for frames nobody will see (run ahead). the pixel fifo still runs so mode 3 takes just as long
+    bool renderVideo = true;
+
+    // the frame in the current output mode, only as long as that mode needs
+    std::span<const uint8_t> GetOutput() const;
 
     uint16_t windowLineCounter = 0;
 
 
 private:
 
+    void OutputPixel(int x, int y, uint8_t color);
+
+    std::array<uint16_t, RESX / 2> grayRowSums; // the downsampled modes add a block up over its rows
+
     CPU* cpu;
     LCD* lcd = nullptr;
     Emulator* emu;
@@ -163,11 +204,14 @@ private:
 
     Mode mode = OAMSCAN;
     void SwitchMode(Mode mode);
+    void EnterOAMScan();
+    void ScheduleNextEvent();
 
     void IncrementLY();
 
 
     uint16_t dots = 0;
+    uint64_t lastSync = 0; // system tick the ppu has been run up to
 	uint16_t scanlineX = 0; // this is the x position in the scanline, used for pixel drawing
     uint16_t pushedX = 0;
     uint8_t tileY = 0;
@@ -181,11 +225,11 @@ private:
     void HandleModeDrawPixels();
 
     // Pixel FIFO
-    std::queue<uint8_t> background_pixels;
+    std::deque<uint8_t> background_pixels;
     std::array<OBJPixel, 160> sprite_pixels;
 
     uint8_t fetchedX = 0;
-    uint16_t tileAddress;
+    uint16_t tileAddress = 0x8000; // goes into save states before the first fetch sets it
 
     bool windowTriggered = false;
 
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class Emulator;
+
+struct RewindOptions
+{
+	int interval = 5; // frames between snapshots, stepping back runs up to this many frames again
+	size_t memoryBudget = 16 * 1024 * 1024; // the oldest snapshots are dropped once the history gets bigger than this
+};
+
+// Lets the emulator go back in time one frame at a time.
+// Every few frames the emulator is saved (without the screen) and handed to a worker thread, which keeps only the
+// newest snapshot in full and stores each older one as the XOR against the one after it, run length encoded. Most of
+// the state doesnt change between two snapshots so those come out a few hundred bytes each.
+// Going back a frame undoes snapshots newest first until it gets to one from before that frame, loads it and runs the
+// frames in between again with the buttons that were held the first time.
+class Rewind
+{
+public:
+	~Rewind();
+
+	void ConnectToEmulator(Emulator* emu);
+
+	// starts recording from the next frame, any history from before is dropped
+	void Enable(const RewindOptions& options = {});
+	void Disable();
+	bool IsEnabled() const { return m_Enabled; }
+
+	// forgets the history, for when the emulator jumps somewhere the snapshots cant get back from (loading a ROM or a state)
+	void Clear();
+
+	// called by UpdateFrame once a frame has been run
+	void OnFrame();
+
+	// puts the emulator back to where it was one frame ago, false if the history doesnt go back that far
+	bool StepBack();
+
+	uint64_t GetHistoryFrames(); // how many frames StepBack can go back
+	size_t GetMemoryUsed();
+
+	// older ^ newer as runs of zeros and literal bytes, newer can be a different size
+	static void EncodeDelta(std::span<const uint8_t> older, std::span<const uint8_t> newer, std::vector<uint8_t>& delta);
+	// turns newer back into older
+	static void ApplyDelta(std::span<const uint8_t> delta, std::vector<uint8_t>& state);
+
+private:
+	struct Snapshot
+	{
+		uint64_t frame;
+		std::vector<uint8_t> delta; // gets this frame back from the next newer snapshot
+	};
+
+	struct PendingState
+	{
+		uint64_t frame;
+		std::vector<uint8_t> state;
+	};
+
+	void Run();
+	void WaitUntilIdle(std::unique_lock<std::mutex>& lock);
+	void Evict();
+
+	Emulator* emu = nullptr;
+
+	RewindOptions m_Options;
+	bool m_Enabled = false;
+	bool m_Replaying = false; // StepBack loads states through the emulator, those shouldnt clear the history
+
+	// emulation thread only
+	uint64_t m_Frame = 0; // frames run since recording started
+	uint64_t m_LastCapture = 0;
+	bool m_Captured = false;
+
+	std::mutex m_Mutex;
+	std::condition_variable m_Wake;
+	std::condition_variable m_Idle;
+
+	std::deque<PendingState> m_Pending; // waiting for the worker
+	std::vector<std::vector<uint8_t>> m_Spare; // buffers handed back by the worker so capturing doesnt allocate
+	bool m_Busy = false;
+	bool m_Stopping = false;
+
+	std::deque<Snapshot> m_Snapshots; // oldest first, all older than m_Latest
+	std::vector<uint8_t> m_Latest;
+	uint64_t m_LatestFrame = 0;
+	bool m_HasLatest = false;
+	size_t m_DeltaBytes = 0;
+
+	// buttons held during each frame from the oldest snapshot on, as Emulator::ButtonState::GetHeld
+	std::deque<uint8_t> m_Inputs;
+	uint64_t m_InputBase = 0; // frame m_Inputs[0] is for
+
+	std::vector<uint8_t> m_Scratch; // worker only
+
+	std::thread m_Thread;
+};
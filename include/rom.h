@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+
+// A ROM file mapped read only into memory.
+// Loaded ROMs are kept in a process wide cache keyed by a hash of their contents, so any number of
+// emulators running the same game (even from different paths) share one copy of it. Loading a file that is
+// already in there, with the same size and modified time, skips reading and hashing it.
+class ROM
+{
+public:
+	// throws std::runtime_error if the file cant be opened or is smaller than its header says
+	static std::shared_ptr<const ROM> Load(const std::string& path);
+
+	~ROM();
+
+	ROM(const ROM&) = delete;
+	ROM& operator=(const ROM&) = delete;
+
+	const uint8_t* GetData() const { return m_Data; }
+	size_t GetSize() const { return m_Size; } // from the header, the file can be longer
+	uint64_t GetHash() const { return m_Hash; }
+
+	// how many different ROMs are loaded right now
+	static size_t GetCachedCount();
+
+	static uint64_t Hash(const uint8_t* data, size_t size);
+
+private:
+	ROM() = default;
+
+	const uint8_t* m_Data = nullptr;
+	size_t m_Size = 0;
+	uint64_t m_Hash = 0;
+
+	// whole file as mapped, m_Data points into it
+	void* m_Mapping = nullptr;
+	size_t m_MappingSize = 0;
+#ifdef _WIN32
+	void* m_MappingHandle = nullptr;
+#endif
+
+	std::vector<uint8_t> m_Buffer; // used instead if the file cant be mapped
+};
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <atomic>
+#include <condition_variable>
+
+// how battery backed cart RAM gets to the .sav file
+struct SaveOptions
+{
+	enum class Mode
+	{
+		Writer, // SaveManager
+		Mapped, // MappedSave, falls back to Writer if the file cant be mapped
+		None, // RAM starts empty and never touches the disk, for batch runs where lots of instances share a game
+	};
+
+	Mode mode = Mode::Writer;
+	std::chrono::milliseconds syncInterval{ 1000 }; // Mapped only, 0 leaves write back entirely to the OS
+
+	// moves the MBC3 clock on by however long the host was off since the .sav was written.
+	// off by default so the clock only ever depends on emulated time
+	bool rtcCatchUp = false;
+};
+
+// Writes battery backed cart RAM to the .sav file on its own thread.
+// The cart only marks which bytes changed, the writer waits until the game has stopped writing for a bit
+// (or until the RAM has been dirty for too long) and writes the whole image to a temp file then renames it
+// over the .sav, so a crash halfway through never leaves a broken save behind.
+class SaveManager
+{
+public:
+	// data is the cart RAM, it has to outlive the SaveManager
+	SaveManager(const std::string& fileName, uint8_t* data, size_t size);
+	~SaveManager(); // writes anything still dirty
+
+	SaveManager(const SaveManager&) = delete;
+	SaveManager& operator=(const SaveManager&) = delete;
+
+	// every write to the RAM has to come through here, the writer thread reads it while the game runs
+	void Write(size_t offset, uint8_t value)
+	{
+		std::lock_guard lock(m_Mutex);
+
+		m_Data[offset] = value;
+
+		if (m_DirtyBegin >= m_DirtyEnd)
+		{
+			m_DirtyBegin = offset;
+			m_DirtyEnd = offset + 1;
+			m_DirtySince = Clock::now();
+		}
+		else
+		{
+			if (offset < m_DirtyBegin) m_DirtyBegin = offset;
+			if (offset >= m_DirtyEnd) m_DirtyEnd = offset + 1;
+		}
+
+		m_Writes++;
+	}
+
+	// replaces a whole range at once, used when a save state is loaded
+	void WriteBlock(size_t offset, const uint8_t* data, size_t size);
+
+	// extra bytes written after the RAM (the MBC3 clock). they dont trigger a write on their own,
+	// they go out with the next RAM write or flush
+	void SetFooter(const uint8_t* data, size_t size);
+
+	// runs on the writer thread on its copy of the footer right before it goes out, for whatever depends on when
+	// the file is written (the MBC3 timestamp)
+	void SetFooterStamp(std::function<void(std::vector<uint8_t>&)> stamp);
+
+	// writes now and waits for it, used when the emulator is paused
+	void Flush();
+
+	uint64_t GetFileWrites() const { return m_FileWrites; }
+
+	using Clock = std::chrono::steady_clock;
+
+	// the file is written once nothing has been written for this long
+	static constexpr Clock::duration DEBOUNCE_TIME = std::chrono::milliseconds(250);
+	// a game that never stops writing still gets saved this often
+	static constexpr Clock::duration MAX_DELAY = std::chrono::seconds(2);
+
+private:
+	void Run();
+	void WriteFile(std::unique_lock<std::mutex>& lock);
+
+	std::string m_FileName;
+
+	uint8_t* m_Data;
+	std::vector<uint8_t> m_Shadow; // what the file has (or is about to have), only touched by the writer thread
+	size_t m_Size;
+
+	std::vector<uint8_t> m_Footer;
+	bool m_FooterChanged = false;
+	std::function<void(std::vector<uint8_t>&)> m_FooterStamp;
+
+	std::mutex m_Mutex;
+	std::condition_variable m_Wake;
+	std::condition_variable m_Flushed;
+
+	size_t m_DirtyBegin = 0;
+	size_t m_DirtyEnd = 0; // empty when begin >= end
+	Clock::time_point m_DirtySince;
+	uint64_t m_Writes = 0;
+
+	uint64_t m_FlushRequests = 0;
+	uint64_t m_FlushesDone = 0;
+	bool m_Stopping = false;
+
+	std::atomic<uint64_t> m_FileWrites = 0;
+
+	std::thread m_Thread;
+};
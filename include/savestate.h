@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <array>
+#include <vector>
+#include <type_traits>
+
+// Save state format:
+//   header: magic "GBST", format version
+//   chunks: id, version, size in bytes, then the data
+// Every component writes its own chunk with its own version, so one of them changing layout only breaks states for
+// that chunk and a reader can skip chunks it doesnt know about. Component state is written as plain structs and
+// raw memory blocks so saving and loading is mostly memcpy. Everything is in host byte order, states are meant to be
+// loaded by the same build that made them (rewind, run ahead, exploration), not shared between machines.
+
+constexpr uint32_t MakeChunkID(const char (&name)[5])
+{
+	return (uint32_t)(uint8_t)name[0] | ((uint32_t)(uint8_t)name[1] << 8) | ((uint32_t)(uint8_t)name[2] << 16) | ((uint32_t)(uint8_t)name[3] << 24);
+}
+
+class StateWriter
+{
+public:
+	static constexpr uint32_t MAGIC = MakeChunkID("GBST");
+	static constexpr uint32_t VERSION = 1;
+
+	// clears the buffer but keeps its capacity, so saving into the same buffer again doesnt allocate
+	explicit StateWriter(std::vector<uint8_t>& buffer);
+
+	void BeginChunk(uint32_t id, uint32_t version);
+	void EndChunk();
+
+	template<typename T>
+	void Write(const T& value)
+	{
+		static_assert(std::is_trivially_copyable_v<T>, "only plain data can be written straight into a state");
+		// padding bytes hold whatever was on the stack, which would make two saves of the same state differ
+		static_assert(std::has_unique_object_representations_v<T>, "state structs cant have padding, order the fields by size");
+		WriteBytes(&value, sizeof(T));
+	}
+
+	void WriteBytes(const void* data, size_t size)
+	{
+		const uint8_t* bytes = (const uint8_t*)data;
+		m_Buffer.insert(m_Buffer.end(), bytes, bytes + size);
+	}
+
+private:
+	std::vector<uint8_t>& m_Buffer;
+	size_t m_ChunkStart = 0; // where the size of the open chunk goes
+};
+
+class StateReader
+{
+public:
+	// checks the header and that every chunk fits, throws std::runtime_error if not
+	explicit StateReader(std::span<const uint8_t> data);
+
+	bool HasChunk(uint32_t id) const;
+
+	// moves to the start of a chunk and returns its version, throws if the state doesnt have it
+	uint32_t OpenChunk(uint32_t id);
+	// same but also throws if the chunk isnt the given version, for components that only read their latest layout
+	void OpenChunk(uint32_t id, uint32_t version);
+
+	template<typename T>
+	void Read(T& value)
+	{
+		static_assert(std::is_trivially_copyable_v<T>, "only plain data can be read straight out of a state");
+		ReadBytes(&value, sizeof(T));
+	}
+
+	void ReadBytes(void* out, size_t size)
+	{
+		memcpy(out, ReadView(size), size);
+	}
+
+	// points into the state instead of copying, throws if there isnt that much left in the chunk
+	const uint8_t* ReadView(size_t size);
+
+private:
+	struct Chunk
+	{
+		uint32_t id;
+		uint32_t version;
+		size_t offset;
+		size_t size;
+	};
+
+	static constexpr int MAX_CHUNKS = 32;
+
+	std::span<const uint8_t> m_Data;
+
+	std::array<Chunk, MAX_CHUNKS> m_Chunks;
+	int m_ChunkCount = 0;
+
+	size_t m_Cursor = 0;
+	size_t m_ChunkEnd = 0;
+};
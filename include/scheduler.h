@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <limits>
+
+class StateWriter;
+class StateReader;
+
+// Cycle timestamped event queue, components register the next T-cycle they need attention
+// and the emulator runs the cpu back to back until then instead of stepping everything every T-cycle.
+// Each event type can only be pending once, scheduling it again just moves it.
+class Scheduler
+{
+public:
+	enum class EventType : uint8_t
+	{
+		PPU,		// ppu mode changes
+		Timer,		// TIMA overflow
+		DMA,		// OAM DMA completion
+		Serial,		// serial transfer completion
+
+		Count
+	};
+
+	static constexpr uint64_t NEVER = std::numeric_limits<uint64_t>::max();
+
+	Scheduler();
+
+	void Reset();
+
+	// the whole queue, so pending events come back at the same ticks
+	void SaveState(StateWriter& writer) const;
+	void LoadState(StateReader& reader);
+
+	void Schedule(EventType type, uint64_t when);
+	void Cancel(EventType type);
+
+	bool IsScheduled(EventType type) const { return m_HeapIndex[(int)type] != NOT_QUEUED; }
+	uint64_t NextEventTime() const { return m_Size > 0 ? m_Heap[0].when : NEVER; }
+
+	// removes the earliest event if it is due at or before now
+	bool PopDue(uint64_t now, EventType& type, uint64_t& when);
+
+private:
+	struct Event
+	{
+		uint64_t when;
+		EventType type;
+		uint8_t unused[7] = {}; // the heap goes into save states as is, padding would be whatever was there before
+	};
+
+	static constexpr uint8_t NOT_QUEUED = 0xFF;
+	static constexpr int MAX_EVENTS = (int)EventType::Count;
+
+	// binary min heap ordered by when, m_HeapIndex tracks where each type lives so it can be moved or removed
+	std::array<Event, MAX_EVENTS> m_Heap;
+	std::array<uint8_t, MAX_EVENTS> m_HeapIndex;
+	int m_Size = 0;
+
+	void SiftUp(int index);
+	void SiftDown(int index);
+	void Swap(int a, int b);
+	void RemoveAt(int index);
+};
@@ -4,22 +4,42 @@
 
 #include "cpu.h"
 
+class Emulator;
+class StateWriter;
+class StateReader;
+
+// DIV and TIMA are computed from the system tick counter instead of being stepped every T-cycle,
+// the only thing that gets scheduled is the TIMA overflow
 class Timer
 {
 public:
     Timer();
 
-    void tick();
     void ConnectTimerToCPU(CPU* cpu);
+    void ConnectToEmulator(Emulator* emu);
 
     void Reset();
 
+    void SaveState(StateWriter& writer);
+    void LoadState(StateReader& reader);
+
+    void OnOverflow(uint64_t when);
+
     uint8_t read(uint16_t address);
     void write(uint16_t address, uint8_t data);
 private:
     CPU* cpu; // for requesting interrupts
-    uint16_t div;
+    Emulator* emu = nullptr;
+
+    uint64_t divBase = 0;   // system tick at which the internal 16 bit divider was 0
+    uint64_t timaSync = 0;  // system tick that tima is up to date with
     uint8_t tima;
     uint8_t tma;
     uint8_t tac;
-};
\ No newline at end of file
+
+    bool IsEnabled() const { return tac & (1 << 2); }
+    uint8_t GetEdgeShift() const; // log2 of T-cycles per TIMA increment
+
+    void Sync(uint64_t now);
+    void ScheduleOverflow();
+};
@@ -0,0 +1,130 @@
+#include "batchrunner.h"
+#include "emulator.h"
+#include "rom.h"
+
+#include <mutex>
+#include <deque>
+#include <thread>
+#include <memory>
+#include <sstream>
+#include <algorithm>
+
+BatchRunner::BatchRunner(unsigned threadCount)
+	: m_ThreadCount(threadCount ? threadCount : std::max(std::thread::hardware_concurrency(), 1u))
+{
+}
+
+// own cache line each so threads popping their own queue dont slow each other down
+struct alignas(64) BatchQueue
+{
+	std::mutex mutex;
+	std::deque<size_t> jobs;
+};
+
+std::vector<BatchResult> BatchRunner::Run(std::span<const BatchJob> jobs)
+{
+	std::vector<BatchResult> results(jobs.size());
+
+	unsigned threadCount = (unsigned)std::min<size_t>(m_ThreadCount, jobs.size());
+	if (threadCount == 0) return results;
+
+	std::unique_ptr<BatchQueue[]> queues(new BatchQueue[threadCount]);
+	for (size_t i = 0; i < jobs.size(); i++)
+		queues[i % threadCount].jobs.push_back(i);
+
+	auto work = [&](unsigned self)
+	{
+		while (true)
+		{
+			size_t job = SIZE_MAX;
+
+			{
+				BatchQueue& own = queues[self];
+				std::lock_guard lock(own.mutex);
+				if (!own.jobs.empty())
+				{
+					job = own.jobs.back();
+					own.jobs.pop_back();
+				}
+			}
+
+			// nothing new ever gets queued, so once every queue has been seen empty this thread is done
+			for (unsigned offset = 1; job == SIZE_MAX && offset < threadCount; offset++)
+			{
+				BatchQueue& victim = queues[(self + offset) % threadCount];
+				std::lock_guard lock(victim.mutex);
+				if (!victim.jobs.empty())
+				{
+					job = victim.jobs.front();
+					victim.jobs.pop_front();
+				}
+			}
+
+			if (job == SIZE_MAX) return;
+
+			results[job] = RunJob(jobs[job]);
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < threadCount; i++)
+		threads.emplace_back(work, i);
+
+	work(0);
+
+	for (std::thread& thread : threads)
+		thread.join();
+
+	return results;
+}
+
+BatchResult BatchRunner::RunJob(const BatchJob& job)
+{
+	using Clock = std::chrono::steady_clock;
+
+	BatchResult result;
+	std::ostringstream serial;
+
+	auto start = Clock::now();
+
+	try
+	{
+		// big enough that it shouldnt live on a worker thread's stack
+		std::unique_ptr<Emulator> emu = std::make_unique<Emulator>();
+		emu->saveOptions.mode = SaveOptions::Mode::None;
+		emu->serialOutput = &serial;
+		emu->LoadROM(job.romPath);
+		emu->Reset();
+
+		result.status = BatchResult::Status::Finished;
+
+		size_t inputCursor = 0;
+		for (uint64_t frame = 0; frame < job.frames; frame++)
+		{
+			if (job.timeout.count() > 0 && Clock::now() - start > job.timeout)
+			{
+				result.status = BatchResult::Status::TimedOut;
+				break;
+			}
+
+			emu->buttonState.SetHeld(job.input.GetButtons(frame, inputCursor));
+			emu->UpdateFrame();
+			result.framesRun++;
+		}
+
+		result.framebufferHash = ROM::Hash((const uint8_t*)emu->ppu.videoBuffer.data(), sizeof(emu->ppu.videoBuffer));
+
+		result.ram.reserve(emu->wram.size() + emu->hram.size());
+		result.ram.insert(result.ram.end(), emu->wram.begin(), emu->wram.end());
+		result.ram.insert(result.ram.end(), emu->hram.begin(), emu->hram.end());
+	}
+	catch (std::exception& e)
+	{
+		result.status = BatchResult::Status::Failed;
+		result.error = e.what();
+	}
+
+	result.serial = serial.str();
+	result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	return result;
+}
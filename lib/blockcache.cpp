@@ -0,0 +1,274 @@
+#include "blockcache.h"
+
+#include "emulator.h"
+
+using Op = CPU::Op;
+
+// anything that jumps or changes when interrupts can happen has to be the last instruction
+static bool EndsBlock(Op op)
+{
+	switch (op)
+	{
+	case Op::JP:
+	case Op::JR:
+	case Op::CALL:
+	case Op::RET:
+	case Op::RETI:
+	case Op::RST:
+	case Op::HALT:
+	case Op::STOP:
+	case Op::EI:
+	case Op::DI:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static uint8_t ImmediateSize(const CPU::Operand& operand)
+{
+	switch (operand.mode)
+	{
+	case CPU::IMM8:
+	case CPU::IND_IMM8:
+		return 1;
+	case CPU::IMM16:
+	case CPU::IND_IMM16:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+// first address past the region pc is in, a block can never cross into a differently mapped region.
+// 0 means the code isnt cached (VRAM, cart RAM, echo, OAM, IO)
+static uint32_t GetRegionEnd(uint16_t pc)
+{
+	if (pc < 0x4000) return 0x4000;
+	if (pc < 0x8000) return 0x8000;
+	if (pc >= 0xC000 && pc < 0xE000) return 0xE000;
+	if (pc >= 0xFF80 && pc < 0xFFFF) return 0xFFFF;
+	return 0;
+}
+
+BlockCache::BlockCache()
+{
+	Clear();
+}
+
+void BlockCache::ConnectMemoryMap(MemoryMap* memoryMap)
+{
+	m_MemoryMap = memoryMap;
+}
+
+void BlockCache::Clear()
+{
+	if (m_MemoryMap)
+	{
+		for (int page = 0; page < 256; page++)
+			if (m_CodePages[page]) m_MemoryMap->UnwatchWrites(page);
+	}
+
+	m_Blocks.clear();
+	m_Jit.Reset();
+	m_CodePages.fill(false);
+
+	for (auto& keys : m_PageBlocks)
+		keys.clear();
+
+	m_PageInvalidations.fill(0);
+
+	m_DirtyPages.clear();
+	m_StopRequested = false;
+
+	m_Mismatches = 0;
+}
+
+void BlockCache::DiscardRAMBlocks()
+{
+	for (int page = 0; page < 256; page++)
+	{
+		if (!m_CodePages[page]) continue;
+
+		m_CodePages[page] = false;
+		m_DirtyPages.push_back((uint8_t)page);
+
+		if (m_MemoryMap) m_MemoryMap->UnwatchWrites(page);
+	}
+
+	FlushInvalidations();
+	m_StopRequested = false;
+}
+
+uint32_t BlockCache::MakeKey(uint16_t pc, uint16_t romBank)
+{
+	// bank 0 is always mapped at 0x0000 and RAM has no bank so only the switchable area needs it
+	if (pc < 0x4000 || IsInRAM(pc)) romBank = 0;
+
+	return ((uint32_t)romBank << 16) | pc;
+}
+
+const BlockCache::Block* BlockCache::Find(uint16_t pc, uint16_t romBank) const
+{
+	auto it = m_Blocks.find(MakeKey(pc, romBank));
+	if (it == m_Blocks.end()) return nullptr;
+
+	return &it->second;
+}
+
+const BlockCache::Block* BlockCache::Compile(Emulator& emu, uint16_t pc)
+{
+	uint32_t regionEnd = GetRegionEnd(pc);
+	if (regionEnd == 0) return nullptr;
+
+	if (m_PageInvalidations[pc >> 8] >= SELF_MODIFYING_THRESHOLD) return nullptr;
+
+	Block block;
+	block.startPC = pc;
+	block.maxCycles = 0;
+
+	uint32_t address = pc;
+
+	while (block.instructions.size() < MAX_BLOCK_LENGTH)
+	{
+		uint8_t opcode = emu.read(address);
+
+		const CPU::Instruction* instruction = &CPU::m_JumpTable[opcode];
+		const CPU::InstructionInfo* info = &CPU::m_JumpTableInfo[opcode];
+		uint8_t length = 1;
+
+		if (opcode == 0xCB)
+		{
+			if (address + 1 >= regionEnd) break;
+
+			uint8_t cbOpcode = emu.read(address + 1);
+			instruction = &CPU::m_CBPrefixJumpTable[cbOpcode];
+			info = &CPU::m_CBPrefixJumpTableInfo[cbOpcode];
+			length = 2;
+		}
+
+		uint8_t immediateSize = ImmediateSize(instruction->operand1) + ImmediateSize(instruction->operand2);
+
+		// leave instructions that straddle the end of the region to Step()
+		if (address + length + immediateSize > regionEnd) break;
+
+		uint16_t immediate = 0;
+		if (immediateSize == 1) immediate = emu.read(address + length);
+		else if (immediateSize == 2) immediate = emu.read16(address + length);
+
+		length += immediateSize;
+
+		block.instructions.push_back({ instruction, immediate, length });
+		block.maxCycles += instruction->cycles + 3; // a taken branch costs at most 3 extra
+
+		address += length;
+
+		if (EndsBlock(info->op)) break;
+	}
+
+	if (block.instructions.empty()) return nullptr;
+
+	block.endPC = (uint16_t)address;
+
+	uint32_t key = MakeKey(pc, emu.GetROMBank());
+
+	if (IsInRAM(pc))
+	{
+		for (uint32_t page = pc >> 8; page <= ((address - 1) >> 8); page++)
+		{
+			m_CodePages[page] = true;
+			m_PageBlocks[page].push_back(key);
+
+			if (m_MemoryMap) m_MemoryMap->WatchWrites(page);
+		}
+	}
+
+	auto [it, inserted] = m_Blocks.insert_or_assign(key, std::move(block));
+	return &it->second;
+}
+
+CPU::NativeBlock BlockCache::GetNativeCode(CPU& cpu, const Block& block)
+{
+	if (block.runs > JIT_THRESHOLD) return block.native; // compiled already, or tried and there is no JIT
+	if (++block.runs <= JIT_THRESHOLD) return nullptr;
+
+	block.native = m_Jit.Compile(cpu, block.startPC, block.instructions);
+
+	if (block.native == nullptr && m_Jit.GetCodeSize() > 0)
+	{
+		// out of room. code for blocks that got thrown away is still in there so start over, whatever is still hot
+		// gets compiled again
+		for (auto& [key, cached] : m_Blocks)
+		{
+			cached.runs = 0;
+			cached.native = nullptr;
+		}
+
+		m_Jit.Reset();
+
+		block.runs = JIT_THRESHOLD + 1;
+		block.native = m_Jit.Compile(cpu, block.startPC, block.instructions);
+	}
+
+	return block.native;
+}
+
+void BlockCache::InvalidatePage(uint8_t page)
+{
+	m_CodePages[page] = false;
+	m_DirtyPages.push_back(page);
+
+	if (m_MemoryMap) m_MemoryMap->UnwatchWrites(page);
+
+	if (m_PageInvalidations[page] < SELF_MODIFYING_THRESHOLD)
+		m_PageInvalidations[page]++;
+
+	// the block that is running might be the one that just got written over
+	m_StopRequested = true;
+}
+
+void BlockCache::FlushInvalidations()
+{
+	for (uint8_t page : m_DirtyPages)
+	{
+		for (uint32_t key : m_PageBlocks[page])
+			m_Blocks.erase(key);
+
+		m_PageBlocks[page].clear();
+	}
+
+	m_DirtyPages.clear();
+}
+
+bool BlockCache::Verify(Emulator& emu, uint16_t pc, const CPU::DecodedInstruction& decoded)
+{
+	// decode the same way Step() does
+	uint8_t opcode = emu.read(pc);
+	const CPU::Instruction* instruction = &CPU::m_JumpTable[opcode];
+	uint8_t length = 1;
+
+	if (opcode == 0xCB)
+	{
+		instruction = &CPU::m_CBPrefixJumpTable[emu.read(pc + 1)];
+		length = 2;
+	}
+
+	uint8_t immediateSize = ImmediateSize(instruction->operand1) + ImmediateSize(instruction->operand2);
+
+	uint16_t immediate = 0;
+	if (immediateSize == 1) immediate = emu.read(pc + length);
+	else if (immediateSize == 2) immediate = emu.read16(pc + length);
+
+	length += immediateSize;
+
+	if (instruction == decoded.instruction && immediate == decoded.immediate && length == decoded.length)
+		return true;
+
+	m_Mismatches++;
+	return false;
+}
+
+void BlockCache::Discard(uint16_t pc, uint16_t romBank)
+{
+	m_Blocks.erase(MakeKey(pc, romBank));
+}
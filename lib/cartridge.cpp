@@ -1,42 +1,55 @@
 #include "cartridge.h"
 
-#include <fstream>
+#include <cstring>
 #include <iostream>
 
-Cartridge::Cartridge(const std::string& filename)
+Cartridge::Cartridge(const std::string& filename, const SaveOptions& saveOptions)
 {
-	std::ifstream ifs(filename, std::ios::binary);
-
-	if(!ifs.good()) std::runtime_error("ERROR LOADING FILE");
+	// mapped read only and shared with anything else that has the same ROM loaded, throws if its unusable
+	m_ROM = ROM::Load(filename);
 
 	// 0x4F, is the size of the header
-	ifs.seekg(0x100);
-	ifs.read((char*)&m_Header, 0x4F);
+	memcpy(&m_Header, m_ROM->GetData() + 0x100, 0x4F);
 
+	m_ROM_size = (uint32_t)m_ROM->GetSize();
+	m_CartData = m_ROM->GetData();
 
-	m_ROM_size = 32768 * (1 << m_Header.romSize);
-	
-	m_CartData = (uint8_t*)malloc(m_ROM_size);
+	CreateMBCByType(m_MemoryBankController, m_Header, m_CartData, saveOptions);
 
-	ifs.seekg(0);
-	ifs.read((char*)m_CartData, m_ROM_size);
+	std::clog << "ROM SIZE: " << (int)m_ROM_size << std::endl;
+}
 
-	ifs.close();
 
+static constexpr uint32_t CARTRIDGE_STATE_ID = MakeChunkID("CART");
+static constexpr uint32_t CARTRIDGE_STATE_VERSION = 1;
 
-	m_MemoryBankController = CreateMBCByType(m_Header, m_CartData);
+void Cartridge::SaveState(StateWriter& writer)
+{
+	writer.BeginChunk(CARTRIDGE_STATE_ID, CARTRIDGE_STATE_VERSION);
+	writer.Write(m_ROM->GetHash());
+	writer.EndChunk();
 
-	std::cout << "ROM SIZE: " << (int)m_ROM_size << std::endl;
+	VisitMBC([&](auto& mbc) { mbc.SaveState(writer); });
 }
 
+void Cartridge::LoadState(StateReader& reader)
+{
+	uint64_t hash;
 
+	reader.OpenChunk(CARTRIDGE_STATE_ID, CARTRIDGE_STATE_VERSION);
+	reader.Read(hash);
 
-uint8_t Cartridge::ReadCart(uint16_t address)
-{
-	return m_MemoryBankController->read(address);
+	if (hash != m_ROM->GetHash())
+		throw std::runtime_error("Save state is for a different ROM");
+
+	VisitMBC([&](auto& mbc)
+	{
+		mbc.LoadState(reader);
+		mbc.MapPages();
+	});
 }
 
-void Cartridge::WriteCart(uint16_t address, uint8_t data)
+void Cartridge::ConnectMemoryMap(MemoryMap* memoryMap)
 {
-	m_MemoryBankController->write(address, data);
+	VisitMBC([&](auto& mbc) { mbc.ConnectMemoryMap(memoryMap, m_ROM_size); });
 }
@@ -3,25 +3,15 @@
 #include <iostream>
 
 #include "emulator.h"
+#include "savestate.h"
+#include "jit.h"
 #include <sstream>
-#include <format>
+#include <tuple>
+#include <utility>
+#include <algorithm>
 
 CPU::CPU()
 {
-	debug_file.open("log2.txt");
-	
-	for(int opcode = 0; opcode <= 0xFF; opcode++)
-	{
-		if (opcode == 0xCB) continue;
-		m_JumpTable[opcode] = InstructionByOpcode(opcode);
-	}
-
-	for (int opcode = 0; opcode <= 0xFF; opcode++)
-	{
-		m_CBPrefixJumpTable[opcode] = HandleCBInstruction(opcode);
-	}
-
-
 	Reset();
 
 }
@@ -68,7 +58,7 @@ std::string_view CondTypeToString(const CPU::CondType cond)
 	}
 }
 
-void WriteOp(CPU::Operand& op, std::stringstream& ss)
+void WriteOp(const CPU::Operand& op, std::stringstream& ss)
 {
 		switch(op.mode)
 		{
@@ -99,11 +89,11 @@ void WriteOp(CPU::Operand& op, std::stringstream& ss)
 }
 
 
-std::string dissassembleInstr(CPU::Instruction ins, int opcode )
+std::string dissassembleInstr(const CPU::Instruction& ins, const CPU::InstructionInfo& info, int opcode )
 {
 	std::stringstream ss;
 
-	ss << "		" <<  std::hex << (int)opcode << " " << ins.name;
+	ss << "		" <<  std::hex << (int)opcode << " " << info.name;
 	
 	WriteOp(ins.operand1, ss);
 	WriteOp(ins.operand2, ss);
@@ -117,6 +107,7 @@ void CPU::Reset()
 {
 	
 	AF.reg = 0x01B0;
+	SetFlagsRegister(AF.lo);
 	BC.reg = 0x0013;
 	DE.reg = 0x00D8;
 	HL.reg = 0x014D;
@@ -135,78 +126,520 @@ void CPU::Reset()
 
 	m_Cycles = 0;
 
+	m_IdleLoops.clear();
+	m_IdleWatch = {};
+	idleLoopStats = {};
+	m_RunLimit = 0;
+}
+
+
+
+struct CPUState
+{
+	uint16_t AF, BC, DE, HL;
+	uint16_t PC, SP;
+
+	bool halted;
+	bool int_master_enabled;
+	bool ime_enabling;
+
+	uint8_t int_enable;
+	uint8_t int_flag;
+	uint8_t unused = 0;
+};
+
+static constexpr uint32_t CPU_STATE_ID = MakeChunkID("CPU ");
+static constexpr uint32_t CPU_STATE_VERSION = 1;
+
+void CPU::SaveState(StateWriter& writer)
+{
+	CPUState state;
+	state.AF = (AF.hi << 8) | GetFlagsRegister();
+	state.BC = BC.reg;
+	state.DE = DE.reg;
+	state.HL = HL.reg;
+	state.PC = PC;
+	state.SP = SP;
+	state.halted = halted;
+	state.int_master_enabled = int_master_enabled;
+	state.ime_enabling = ime_enabling;
+	state.int_enable = int_enable;
+	state.int_flag = int_flag;
+
+	writer.BeginChunk(CPU_STATE_ID, CPU_STATE_VERSION);
+	writer.Write(state);
+	writer.EndChunk();
 }
 
+void CPU::LoadState(StateReader& reader)
+{
+	CPUState state;
+
+	reader.OpenChunk(CPU_STATE_ID, CPU_STATE_VERSION);
+	reader.Read(state);
+
+	AF.reg = state.AF;
+	SetFlagsRegister(AF.lo);
+	BC.reg = state.BC;
+	DE.reg = state.DE;
+	HL.reg = state.HL;
+	PC = state.PC;
+	SP = state.SP;
+	halted = state.halted;
+	int_master_enabled = state.int_master_enabled;
+	ime_enabling = state.ime_enabling;
+	int_enable = state.int_enable;
+	int_flag = state.int_flag;
 
+	// whatever loop was being watched belongs to a different point in time. analysed ROM loops are still valid
+	m_IdleWatch = {};
+	m_RAMIdleLoop = {};
+	m_CurrentDecoded = nullptr;
+	m_RunLimit = 0;
+}
 
-void CPU::Clock()
+uint8_t CPU::Step()
 {	
+	m_CurrentDecoded = nullptr;
 
 	// Wake up from HALT if any interrupt is pending (even if IME is off)
-    if (halted && (int_enable & int_flag)) {
-        halted = false;
-        // But don't service the interrupt this frame unless IME is enabled
-    }
-
-    // If IME is enabled and not halted, service interrupts
-    if (!halted && int_master_enabled) {
-        if (CheckInterrupt(VBLANK, 0x40)) return;
-        if (CheckInterrupt(STAT,    0x48)) return;
-        if (CheckInterrupt(TIMER,  0x50)) return;
-        if (CheckInterrupt(SERIAL, 0x58)) return;
-        if (CheckInterrupt(JOYPAD, 0x60)) return;
-    }
-
-	if(!halted)
+	if (halted)
 	{
-		
-		if (m_Cycles == 0)
+		if (!(int_enable & int_flag)) return 1;
+		halted = false;
+		// But don't service the interrupt this frame unless IME is enabled
+	}
+
+	// If IME is enabled, service interrupts. pushing PC and jumping takes 5 M-cycles
+	if (int_master_enabled) {
+		if (CheckInterrupt(VBLANK, 0x40)) return 5;
+		if (CheckInterrupt(STAT,    0x48)) return 5;
+		if (CheckInterrupt(TIMER,  0x50)) return 5;
+		if (CheckInterrupt(SERIAL, 0x58)) return 5;
+		if (CheckInterrupt(JOYPAD, 0x60)) return 5;
+	}
+
+	if (ime_enabling) {
+		int_master_enabled = true;
+		ime_enabling = false;
+	}
+
+	//if(PC == 0xC06C) __debugbreak();
+
+	uint8_t opcode = emu->read(PC++);
+
+	if (opcode == 0xCB)
+	{
+		uint8_t cbOpcode = emu->read(PC++);
+		m_CurrentInstruction = &m_CBPrefixJumpTable[cbOpcode];
+	}
+	else
+		m_CurrentInstruction = &m_JumpTable[opcode];
+
+	// instructions add to this when a branch is taken
+	m_Cycles = m_CurrentInstruction->cycles;
+
+	// might change to std::function
+	(this->*m_CurrentInstruction->execute)();
+
+	return m_Cycles;
+}
+
+
+void CPU::Execute(uint64_t limit)
+{
+	if (SkipHalt(limit)) return;
+
+	m_RunLimit = limit;
+
+	switch (executionMode)
+	{
+	case ExecutionMode::BlockCache:
+	case ExecutionMode::Lockstep:
+		RunBlock(limit);
+		break;
+	case ExecutionMode::Threaded:
+		RunThreaded(limit);
+		break;
+	case ExecutionMode::JIT:
+		if (Jit::IsSupported()) RunBlock(limit);
+		else emu->m_SystemTicks += Step() * 4;
+		break;
+	default:
+		emu->m_SystemTicks += Step() * 4;
+		break;
+	}
+
+	m_RunLimit = 0;
+}
+
+bool CPU::SkipHalt(uint64_t limit)
+{
+	if (!halted || (int_enable & int_flag)) return false;
+
+	// only an event can request an interrupt while halted so nothing happens until then.
+	// Step() would burn one M-cycle at a time, this gets to the same M-cycle in one go
+	uint64_t& ticks = emu->m_SystemTicks;
+	uint64_t wakeUp = std::min(limit, emu->scheduler.NextEventTime());
+
+	if (ticks < wakeUp)
+		ticks += (wakeUp - ticks + 3) & ~(uint64_t)3;
+
+	return true;
+}
+
+bool CPU::IsIdleReadAddress(uint16_t address)
+{
+	// anything here can only change when an event or interrupt handler runs. the timer and cart RAM (RTC) are not
+	if (address < 0xA000) return true;				// ROM, VRAM
+	if (address >= 0xC000 && address < 0xE000) return true;	// WRAM
+	if (address >= 0xFE00 && address < 0xFEA0) return true;	// OAM
+	if (address == 0xFF00 || address == 0xFF0F) return true;	// joypad only changes between frames, IF
+	if (address >= 0xFF40 && address <= 0xFF4B) return true;	// LCD, LY and STAT only change on ppu events
+	if (address >= 0xFF80) return true;				// HRAM, IE
+	return false;
+}
+
+std::array<uint16_t, 5> CPU::GetLoopRegisters()
+{
+	return { (uint16_t)((AF.hi << 8) | GetFlagsRegister()), BC.reg, DE.reg, HL.reg, SP };
+}
+
+CPU::IdleLoop CPU::AnalyzeIdleLoop(uint16_t head, uint16_t branchPC)
+{
+	IdleLoop loop;
+
+	uint16_t written = 0; // bit per RegType
+	auto write = [&](RegType reg)
+	{
+		written |= 1 << (int)reg;
+
+		// writing half of a pair changes the pair and the other way round
+		switch (reg)
 		{
-			
-			if (ime_enabling) {
-        		int_master_enabled = true;
-        		ime_enabling = false;
-  			}
-
-			//if(PC == 0xC06C) __debugbreak();
-
-			// debug_file << std::format("A:{:02X} F:{:02X} B:{:02X} C:{:02X} D:{:02X} E:{:02X} H:{:02X} L:{:02X} SP:{:04X} PC:{:04X} PCMEM:{:02X},{:02X},{:02X},{:02X}\n"
-			// 	, AF.hi, AF.lo, BC.hi, BC.lo, DE.hi, DE.lo, HL.hi, HL.lo, SP, PC, emu->read(PC), emu->read(PC + 1), emu->read(PC + 2), emu->read(PC + 3));
-			//std::vector<std::string> d = Application::dissassemble(*emu, PC, PC + 5); // this is wrong???
-			uint8_t opcode = emu->read(PC++);			
-			/* debug_file << d[0] <<
-			  " Z: " << (int)GetFlag(Flag::Z) << " C: " << (int)GetFlag(Flag::C) << " N: " <<  (int)GetFlag(Flag::N) << " H: " <<  (int)GetFlag(Flag::H) 
-			  << " AF: 0x" << std::hex << (int)AF.reg << " BC: 0x" << std::hex << (int)BC.reg << " DE: 0x" << std::hex << (int)DE.reg << " HL: 0x" << std::hex << (int)HL.reg 
-			  << " SP: 0x" << std::hex << (int)SP 
-			  << "\n";
-			*/
-			
+		case RegType::B: case RegType::C: written |= 1 << (int)RegType::BC; break;
+		case RegType::D: case RegType::E: written |= 1 << (int)RegType::DE; break;
+		case RegType::H: case RegType::L: written |= 1 << (int)RegType::HL; break;
+		case RegType::BC: written |= (1 << (int)RegType::B) | (1 << (int)RegType::C); break;
+		case RegType::DE: written |= (1 << (int)RegType::D) | (1 << (int)RegType::E); break;
+		case RegType::HL: written |= (1 << (int)RegType::H) | (1 << (int)RegType::L); break;
+		default: break;
+		}
+	};
+
+	// memory reads have to come from somewhere that only events can change
+	auto read = [&](const Operand& operand, uint16_t immediate)
+	{
+		switch (operand.mode)
+		{
+		case IND_IMM8: return IsIdleReadAddress(0xFF00 | immediate);
+		case IND_IMM16: return IsIdleReadAddress(immediate);
+		case IND:
+		case IND_REG8:
+			if (operand.reg == RegType::HLI || operand.reg == RegType::HLD) return false;
+			if (loop.addressRegCount == loop.addressRegs.size()) return false;
+
+			loop.addressRegs[loop.addressRegCount++] = operand.reg;
+			return true;
+		default:
+			return true;
+		}
+	};
 
-			if (opcode == 0xCB)
+	uint16_t address = head;
+
+	for (int count = 0; address != branchPC; count++)
+	{
+		if (count == MAX_IDLE_LOOP_LENGTH || address > branchPC) return {};
+
+		uint8_t opcode = emu->read(address);
+		const Instruction* instruction = &m_JumpTable[opcode];
+		const InstructionInfo* info = &m_JumpTableInfo[opcode];
+		uint8_t length = 1;
+
+		if (opcode == 0xCB)
+		{
+			instruction = &m_CBPrefixJumpTable[emu->read(address + 1)];
+			info = &m_CBPrefixJumpTableInfo[emu->read(address + 1)];
+			length = 2;
+		}
+
+		const Operand& op1 = instruction->operand1;
+		const Operand& op2 = instruction->operand2;
+
+		uint16_t immediate = 0;
+		if (op1.mode == IMM16 || op1.mode == IND_IMM16 || op2.mode == IMM16 || op2.mode == IND_IMM16)
+		{
+			immediate = emu->read16(address + length);
+			length += 2;
+		}
+		else if (op1.mode == IMM8 || op1.mode == IND_IMM8 || op2.mode == IMM8 || op2.mode == IND_IMM8)
+		{
+			immediate = emu->read(address + length);
+			length += 1;
+		}
+
+		switch (info->op)
+		{
+		case Op::NOP:
+		case Op::SCF:
+		case Op::CCF:
+			break;
+		case Op::CP:
+			if (!read(op1, immediate)) return {};
+			break;
+		case Op::BIT:
+			if (!read(op2, immediate)) return {};
+			break;
+		case Op::AND: case Op::OR: case Op::XOR: case Op::SUB:
+			if (!read(op1, immediate)) return {};
+			write(RegType::A);
+			break;
+		case Op::ADD: case Op::ADC: case Op::SBC:
+			if (op1.mode != REG8 && op1.mode != REG16) return {};
+			if (!read(op2, immediate)) return {};
+			write(op1.reg);
+			break;
+		case Op::CPL: case Op::RLCA: case Op::RRCA: case Op::RLA: case Op::RRA:
+			write(RegType::A);
+			break;
+		case Op::LD:
+			if (op1.mode != REG8) return {}; // only loads into registers, never stores
+			if (!read(op2, immediate)) return {};
+			write(op1.reg);
+			break;
+		case Op::INC:
+		case Op::DEC:
+			if (op1.mode != REG8 && op1.mode != REG16) return {};
+			write(op1.reg);
+			break;
+		default:
+			return {};
+		}
+
+		address += length;
+	}
+
+	// the registers reads go through have to stay the same or the addresses could move
+	for (int i = 0; i < loop.addressRegCount; i++)
+	{
+		RegType reg = loop.addressRegs[i];
+		if (written & (1 << (int)reg)) return {};
+	}
+
+	loop.idle = true;
+	return loop;
+}
+
+void CPU::OnBackwardBranch(uint16_t branchPC)
+{
+	if (!idleLoopDetection || m_RunLimit == 0) return;
+
+	bool inROM = PC < 0x8000;
+	bool inRAM = (PC >= 0xC000 && PC < 0xE000) || (PC >= 0xFF80 && branchPC < 0xFFFF);
+	if (!inROM && !inRAM) return;
+
+	uint16_t bank = PC >= 0x4000 && inROM ? emu->GetROMBank() : 0;
+
+	// tick the head gets reached at once this branch is done
+	uint64_t arrival = emu->m_SystemTicks + m_Cycles * 4;
+
+	// code in RAM can be rewritten by anything that runs after an event so it isnt cached
+	bool stale = inRAM && m_IdleWatch.events != emu->m_EventsDispatched;
+
+	if (m_IdleWatch.loop == nullptr || m_IdleWatch.head != PC || m_IdleWatch.bank != bank || stale)
+	{
+		if (inROM)
+		{
+			uint32_t key = ((uint32_t)bank << 16) | PC;
+
+			auto it = m_IdleLoops.find(key);
+			if (it == m_IdleLoops.end())
+				it = m_IdleLoops.emplace(key, AnalyzeIdleLoop(PC, branchPC)).first;
+
+			m_IdleWatch.loop = &it->second;
+		}
+		else
+		{
+			m_RAMIdleLoop = AnalyzeIdleLoop(PC, branchPC);
+			m_IdleWatch.loop = &m_RAMIdleLoop;
+		}
+
+		m_IdleWatch.head = PC;
+		m_IdleWatch.bank = bank;
+		m_IdleWatch.events = emu->m_EventsDispatched;
+	}
+	else if (m_IdleWatch.loop->idle && m_IdleWatch.events == emu->m_EventsDispatched && !ime_enabling
+		&& !(int_master_enabled && (int_enable & int_flag)) && m_IdleWatch.registers == GetLoopRegisters())
+	{
+		bool readsAllowed = true;
+		for (int i = 0; i < m_IdleWatch.loop->addressRegCount; i++)
+		{
+			RegType reg = m_IdleWatch.loop->addressRegs[i];
+			uint16_t address = 0;
+
+			switch (reg)
 			{
-				uint8_t cbOpcode = emu->read(PC++);
-				m_CurrentInstruction = m_CBPrefixJumpTable[cbOpcode];
+			case RegType::C: address = 0xFF00 | BC.lo; break;
+			case RegType::BC: address = BC.reg; break;
+			case RegType::DE: address = DE.reg; break;
+			case RegType::HL: address = HL.reg; break;
+			default: break;
 			}
-			else
-				m_CurrentInstruction = m_JumpTable[opcode];
-			
-			
 
-			
-			m_Cycles = m_CurrentInstruction.cycles;
+			readsAllowed &= IsIdleReadAddress(address);
+		}
 
-			// might change to std::function
-			(this->*m_CurrentInstruction.execute)();
-			
+		// the last iteration ended exactly like it started so the next ones will too, until an event changes something
+		uint64_t iteration = arrival - m_IdleWatch.arrival;
+		uint64_t wakeUp = std::min(m_RunLimit, emu->scheduler.NextEventTime());
+
+		if (readsAllowed && iteration > 0 && wakeUp > arrival)
+		{
+			uint64_t skipped = (wakeUp - arrival) / iteration * iteration;
+
+			emu->m_SystemTicks += skipped;
+			arrival += skipped;
+
+			if (skipped > 0)
+			{
+				idleLoopStats.loopsSkipped++;
+				idleLoopStats.cyclesSkipped += skipped;
+			}
 		}
+	}
 
-		m_Cycles--;
+	if (!m_IdleWatch.loop->idle) return;
 
-		
+	m_IdleWatch.arrival = arrival;
+	m_IdleWatch.events = emu->m_EventsDispatched;
+	m_IdleWatch.registers = GetLoopRegisters();
+}
+
+void CPU::RunBlock(uint64_t limit)
+{
+	BlockCache& cache = emu->blockCache;
+
+	// anything that has to happen at an instruction boundary goes through the normal path
+	if (halted || ime_enabling || (int_master_enabled && (int_enable & int_flag)))
+	{
+		emu->m_SystemTicks += Step() * 4;
+		return;
+	}
+
+	cache.FlushInvalidations();
+
+	const BlockCache::Block* block = cache.Find(PC, emu->GetROMBank());
+	if (block == nullptr)
+		block = cache.Compile(*emu, PC);
+
+	if (block == nullptr) // not somewhere that can be cached
+	{
+		emu->m_SystemTicks += Step() * 4;
+		return;
 	}
 
+	cache.ClearStopRequest();
+
+	bool verify = executionMode == ExecutionMode::Lockstep;
+
+	if (executionMode != ExecutionMode::BlockCache)
+	{
+		if (NativeBlock code = cache.GetNativeCode(*this, *block))
+		{
+			if (verify) RunNativeLockstep(code, limit, block->startPC);
+			else code(this, std::min(limit, emu->scheduler.NextEventTime()));
+
+			m_CurrentDecoded = nullptr;
+			return;
+		}
+	}
+
+	uint64_t blockStart = emu->m_SystemTicks;
+	uint64_t skippedBefore = idleLoopStats.cyclesSkipped;
+
+	for (const DecodedInstruction& decoded : block->instructions)
+	{
+		if (verify && !cache.Verify(*emu, PC, decoded))
+		{
+			// the interpreter picks up from here and the block gets decoded again next time
+			cache.Discard(block->startPC, emu->GetROMBank());
+			block = nullptr;
+			break;
+		}
+
+		m_CurrentDecoded = &decoded;
+		m_CurrentInstruction = decoded.instruction;
+
+		PC += decoded.length;
+		m_Cycles = decoded.instruction->cycles;
+
+		(this->*decoded.instruction->execute)();
+
+		emu->m_SystemTicks += m_Cycles * 4;
+
+		// stop early if something else needs to run or the block might not be valid anymore
+		if (emu->m_SystemTicks >= std::min(limit, emu->scheduler.NextEventTime())) break;
+		if (cache.StopRequested()) break;
+		if (int_master_enabled && (int_enable & int_flag)) break;
+	}
+
+	m_CurrentDecoded = nullptr;
+
+	// an idle loop fast forward happens in the branch at the end of the block, the ticks it skipped werent run by it
+	uint64_t blockTicks = emu->m_SystemTicks - blockStart - (idleLoopStats.cyclesSkipped - skippedBefore);
+	if (verify && block && blockTicks > block->maxCycles * 4u) cache.CountMismatch();
+}
+
+void CPU::RunNativeLockstep(NativeBlock code, uint64_t limit, uint16_t startPC)
+{
+	BlockCache& cache = emu->blockCache;
+	uint16_t bank = emu->GetROMBank();
+
+	emu->SaveState(m_LockstepState, false);
+
+	// not in the state but the block can skip an idle loop, Step() has to see the same loop history to skip the same one
+	IdleLoopWatch watch = m_IdleWatch;
+	IdleLoop ramLoop = m_RAMIdleLoop;
+	IdleLoopStats stats = idleLoopStats;
+	uint64_t events = emu->m_EventsDispatched;
+
+	auto snapshot = [this]()
+	{
+		return std::tuple(GetLoopRegisters(), PC, halted, int_master_enabled, ime_enabling, int_enable, int_flag, emu->m_SystemTicks);
+	};
+
+	uint32_t count = code(this, std::min(limit, emu->scheduler.NextEventTime()));
+	m_CurrentDecoded = nullptr;
+
+	auto result = snapshot();
+
+	emu->RestoreState(m_LockstepState, true);
+
+	m_IdleWatch = watch;
+	m_RAMIdleLoop = ramLoop;
+	idleLoopStats = stats;
+	emu->m_EventsDispatched = events;
+	m_RunLimit = limit;
+
+	for (uint32_t i = 0; i < count; i++)
+		emu->m_SystemTicks += Step() * 4;
+
+	if (snapshot() != result)
+	{
+		// compiled again from scratch once it is hot again
+		cache.CountMismatch();
+		cache.Discard(startPC, bank);
+	}
 }
 
+uint64_t CPU::NativeStopTime(CPU* cpu)
+{
+	if (cpu->emu->blockCache.StopRequested()) return 0;
+	if (cpu->int_master_enabled && (cpu->int_enable & cpu->int_flag)) return 0;
+
+	return std::min(cpu->m_RunLimit, cpu->emu->scheduler.NextEventTime());
+}
 
 bool CPU::CheckInterrupt(CPU::Interrupt interupt_type, uint16_t address)
 {
@@ -231,211 +664,194 @@ void CPU::RequestInterrupt(CPU::Interrupt interrupt_type)
 
 uint8_t CPU::GetFlag(Flag flag)
 {
-	return (AF.lo & (1 << flag)) != 0;
+	switch (flag)
+	{
+	case Flag::Z: return m_ZeroResult == 0;
+	case Flag::N: return m_FlagN;
+	case Flag::H: return GetHalfCarry();
+	case Flag::C: return m_FlagC;
+	}
+	return 0;
 }
 
-
 void CPU::SetFlag(Flag flag, uint8_t value)
 {
-	if (value == 1)
+	switch (flag)
 	{
-		AF.lo |= (1 << flag); 
+	case Flag::Z: m_ZeroResult = !value; break;
+	case Flag::N: m_FlagN = value; break;
+	case Flag::H: m_HalfCarryMode = value ? HalfCarryMode::Set : HalfCarryMode::Clear; break;
+	case Flag::C: m_FlagC = value; break;
 	}
-	else
+}
+
+bool CPU::GetHalfCarry() const
+{
+	switch (m_HalfCarryMode)
 	{
-		AF.lo &= ~(1 << flag);
+	case HalfCarryMode::Set: return true;
+	case HalfCarryMode::Add: return (m_HalfA & 0xF) + (m_HalfB & 0xF) + m_HalfCarryIn > 0xF;
+	case HalfCarryMode::Sub: return (m_HalfA & 0xF) < (m_HalfB & 0xF) + m_HalfCarryIn;
+	default: return false;
 	}
 }
 
+uint8_t CPU::GetFlagsRegister()
+{
+	return (GetFlag(Flag::Z) << Flag::Z) | (GetFlag(Flag::N) << Flag::N) | (GetFlag(Flag::H) << Flag::H) | (GetFlag(Flag::C) << Flag::C);
+}
+
+void CPU::SetFlagsRegister(uint8_t value)
+{
+	AF.lo = value & 0xF0;
+
+	SetFlag(Flag::Z, (value >> Flag::Z) & 1);
+	SetFlag(Flag::N, (value >> Flag::N) & 1);
+	SetFlag(Flag::H, (value >> Flag::H) & 1);
+	SetFlag(Flag::C, (value >> Flag::C) & 1);
+}
 
-void CPU::writeRegister8(RegType reg, uint8_t value)
+void CPU::MaterializeFlags()
 {
-	switch (reg) {
-		case RegType::A:
-			AF.hi = value;
-			break;
-		case RegType::B:
-			BC.hi = value;
-			break;
-		case RegType::C:
-			BC.lo = value;
-			break;
-		case RegType::D:
-			DE.hi = value;
-			break;
-		case RegType::E:
-			DE.lo = value;
-			break;
-		case RegType::H:
-			HL.hi = value;
-			break;
-		case RegType::L:
-			HL.lo = value;
-			break;
-		default:
-			std::cout << "INVALID REG 8 WRITE OPERATION" << std::endl;
-	}
+	AF.lo = GetFlagsRegister();
 }
 
-void CPU::writeRegister16(RegType reg, uint16_t value)
+
+// cached blocks already read the immediates and moved PC past the instruction
+uint8_t CPU::FetchImmediate8()
 {
-	switch (reg)
-	{
-	case RegType::AF:
-		AF.reg = value;
-		break;
-	case RegType::BC:
-		BC.reg = value;
-		break;
-	case RegType::DE:
-		DE.reg = value;
-		break;
-	case RegType::HL:
-		HL.reg = value;
-		break;
-	case RegType::SP:
-		SP = value;
-		break;
-	default:
-		std::cout << "INVALID REG 16 WRITE OPERATION" << std::endl;
-		break;
-	}
+	if (m_CurrentDecoded) return (uint8_t)m_CurrentDecoded->immediate;
+	return emu->read(PC++);
 }
 
-void CPU::writeOperand8(Operand& op, uint8_t value)
+uint16_t CPU::FetchImmediate16()
 {
-	switch (op.mode)
-	{
-	case REG8:
+	if (m_CurrentDecoded) return m_CurrentDecoded->immediate;
 
-		writeRegister8(op.reg, value);
-		break;
-	case IND: // pretty sure we can only indirectly write a single byte so this part isnt in writeoperand16
+	uint16_t value = emu->read16(PC);
+	PC += 2;
+	return value;
+}
 
+template<auto>
+constexpr bool always_false = false;
 
-		emu->write(getRegisterValue(op.reg), value);
+template<CPU::RegType Reg>
+uint8_t& CPU::Register8()
+{
+	if constexpr (Reg == RegType::A) return AF.hi;
+	else if constexpr (Reg == RegType::B) return BC.hi;
+	else if constexpr (Reg == RegType::C) return BC.lo;
+	else if constexpr (Reg == RegType::D) return DE.hi;
+	else if constexpr (Reg == RegType::E) return DE.lo;
+	else if constexpr (Reg == RegType::H) return HL.hi;
+	else if constexpr (Reg == RegType::L) return HL.lo;
+	else static_assert(always_false<Reg>, "INVALID REG 8");
+}
 
-		if(op.reg == RegType::HLI) HL.reg++;
-		else if (op.reg == RegType::HLD) HL.reg--;
+template<CPU::RegType Reg>
+uint16_t& CPU::Register16()
+{
+	if constexpr (Reg == RegType::AF) return AF.reg;
+	else if constexpr (Reg == RegType::BC) return BC.reg;
+	else if constexpr (Reg == RegType::DE) return DE.reg;
+	else if constexpr (Reg == RegType::HL || Reg == RegType::HLI || Reg == RegType::HLD) return HL.reg;
+	else if constexpr (Reg == RegType::SP) return SP;
+	else static_assert(always_false<Reg>, "INVALID REG 16");
+}
 
-		break;
-	case IND_IMM8: // only used for LD (a8), A. see for more info
+template<CPU::Operand Op>
+void CPU::writeOperand8(uint8_t value)
+{
+	if constexpr (Op.mode == REG8)
 	{
-		uint16_t address = 0xFF00 | emu->read(PC++);
-		emu->write(address, value);
+		Register8<Op.reg>() = value;
 	}
-		break;
-	case IND_IMM16: // used for LD (a16), A
+	else if constexpr (Op.mode == IND) // pretty sure we can only indirectly write a single byte so this part isnt in writeoperand16
 	{
-		uint16_t address = emu->read16(PC);
-		PC += 2;
+		emu->write(Register16<Op.reg>(), value);
+
+		if constexpr (Op.reg == RegType::HLI) HL.reg++;
+		else if constexpr (Op.reg == RegType::HLD) HL.reg--;
+	}
+	else if constexpr (Op.mode == IND_IMM8) // only used for LD (a8), A. see for more info
+	{
+		uint16_t address = 0xFF00 | FetchImmediate8();
 		emu->write(address, value);
 	}
-		break;
-	case IND_REG8:
+	else if constexpr (Op.mode == IND_IMM16) // used for LD (a16), A
 	{
-		uint16_t address = 0xFF00 | getRegisterValue(op.reg);
+		uint16_t address = FetchImmediate16();
 		emu->write(address, value);
 	}
-	break;
-	default:
-		std::cout << "INVALID WRITE 8" << std::endl;
-		break;
+	else if constexpr (Op.mode == IND_REG8)
+	{
+		uint16_t address = 0xFF00 | Register8<Op.reg>();
+		emu->write(address, value);
 	}
+	else static_assert(always_false<Op>, "INVALID WRITE 8");
 }
 
-void CPU::writeOperand16(Operand& op, uint16_t value)
+template<CPU::Operand Op>
+void CPU::writeOperand16(uint16_t value)
 {
-	switch (op.mode)
+	if constexpr (Op.mode == REG16)
 	{
-	case REG16:
-		writeRegister16(op.reg, value);
-		break;
-	case IND_IMM16: // used for LD (a16), SP
+		Register16<Op.reg>() = value;
+	}
+	else if constexpr (Op.mode == IND_IMM16) // used for LD (a16), SP
 	{
-		uint16_t address = emu->read16(PC);
-		PC += 2;
+		uint16_t address = FetchImmediate16();
 		emu->write16(address, value);
 	}
-		break;
-	default:
-		std::cout << "INVALID WRITE 16" << std::endl;
-		break;
-	}
+	else static_assert(always_false<Op>, "INVALID WRITE 16");
 }
 
-
-uint16_t CPU::getRegisterValue(RegType type)
+template<CPU::Operand Op>
+uint16_t CPU::fetch()
 {
-	switch (type)
+	if constexpr (Op.mode == REG8)
 	{
-	case RegType::A: return AF.hi;
-	case RegType::B: return BC.hi;
-	case RegType::C: return BC.lo;
-	case RegType::D: return DE.hi;
-	case RegType::E: return DE.lo;
-	case RegType::H: return HL.hi;
-	case RegType::L: return HL.lo;
-	case RegType::AF: return AF.reg;
-	case RegType::BC: return BC.reg;
-	case RegType::DE: return DE.reg;
-	case RegType::HLI:
-	case RegType::HLD:
-	case RegType::HL: return HL.reg;
-	case RegType::SP: return SP;			
-	default:
-		std::cout << "INVALID REG TYPE" << std::endl;
-		return -1;
+		return Register8<Op.reg>();
 	}
-}
-
-uint16_t CPU::fetch(const Operand& operand)
-{
-	switch (operand.mode)
+	else if constexpr (Op.mode == REG16)
 	{
-	case REG8:
-		return getRegisterValue(operand.reg) & 0Xff;
-	case REG16:
-		return getRegisterValue(operand.reg);
-	case IND:
+		return Register16<Op.reg>();
+	}
+	else if constexpr (Op.mode == IND)
 	{
-		uint8_t result = emu->read(getRegisterValue(operand.reg));
+		uint8_t result = emu->read(Register16<Op.reg>());
 
-		if(operand.reg == RegType::HLI) HL.reg++;
-		else if (operand.reg == RegType::HLD) HL.reg--;
+		if constexpr (Op.reg == RegType::HLI) HL.reg++;
+		else if constexpr (Op.reg == RegType::HLD) HL.reg--;
 		
 		return result;
 	}
-	break;
-	case IMM8:
-		return emu->read(PC++);
-	case IMM16:
+	else if constexpr (Op.mode == IMM8)
 	{
-		uint16_t value = emu->read16(PC);
-		PC += 2;
-		return value;
+		return FetchImmediate8();
 	}
-	case IND_IMM8:
+	else if constexpr (Op.mode == IMM16)
 	{
-		uint16_t address = 0xFF00 | emu->read(PC++);
+		return FetchImmediate16();
+	}
+	else if constexpr (Op.mode == IND_IMM8)
+	{
+		uint16_t address = 0xFF00 | FetchImmediate8();
 		return emu->read(address);
 	}
-	case IND_IMM16:
+	else if constexpr (Op.mode == IND_IMM16)
 	{
-		uint16_t address = emu->read16(PC);
-		PC += 2;
+		uint16_t address = FetchImmediate16();
 		uint8_t value = emu->read(address);
 		return value;
 	}
-	case IND_REG8:
+	else if constexpr (Op.mode == IND_REG8)
 	{
-		uint16_t address = 0xFF00 | getRegisterValue(operand.reg);
+		uint16_t address = 0xFF00 | Register8<Op.reg>();
 		return emu->read(address);
 	}
-	default:
-		std::cout << "INVALID ADDRESSING MODE" << std::endl;
-		return -1;
-	}
+	else static_assert(always_false<Op>, "INVALID ADDRESSING MODE");
 }
 
 // FULL DESCENDING STACK
@@ -476,121 +892,128 @@ void CPU::HALT()
 	halted = true;
 }
 
-void CPU::LD() 
+template<CPU::Operand Dst, CPU::Operand Src>
+void CPU::LD()
 {
-	uint16_t value = fetch(m_CurrentInstruction.operand2);
+	uint16_t value = fetch<Src>();
 
 
-	if(Is16Bit(m_CurrentInstruction.operand2))
-		writeOperand16(m_CurrentInstruction.operand1, value);
+	if constexpr (Is16Bit(Src))
+		writeOperand16<Dst>(value);
 	else
-		writeOperand8(m_CurrentInstruction.operand1, (uint8_t)value);
+		writeOperand8<Dst>((uint8_t)value);
 }
 
+template<CPU::Operand Src>
 void CPU::LD_HL_SP()
 {
 	// this is specific no need to use the abstracted functions
 
-	int8_t value = fetch(m_CurrentInstruction.operand1) & 0xFF;
+	int8_t value = fetch<Src>() & 0xFF;
 	HL.reg = SP + value;
 
 	SetFlag(Flag::Z, 0);
 	SetFlag(Flag::N, 0);
-	SetFlag(Flag::H, ((SP & 0xF) + (value & 0xF)) > 0xF);
+	SetHalfCarryAdd(SP & 0xFF, (uint8_t)value);
     SetFlag(Flag::C, ((SP & 0xFF) + (value & 0xFF)) > 0xFF);
 }
 
+template<CPU::Operand Dst>
 void CPU::INC()
 {
-	uint16_t value = fetch(m_CurrentInstruction.operand1);
+	uint16_t value = fetch<Dst>();
 
-	if(Is16Bit(m_CurrentInstruction.operand1))
+	if constexpr (Is16Bit(Dst))
 	{
 		value++;
-		writeOperand16(m_CurrentInstruction.operand1, value);
+		writeOperand16<Dst>(value);
 
 	}
 	else
 	{
 		uint8_t result = value + 1;
-		writeOperand8(m_CurrentInstruction.operand1, (uint8_t)result);
+		writeOperand8<Dst>((uint8_t)result);
 
-		SetFlag(Flag::Z, (uint8_t)result == 0);
+		SetZeroFrom(result);
 		SetFlag(Flag::N, 0);
-		SetFlag(Flag::H, (((uint8_t)value & 0x0F) + 1) > 0xF);
+		SetHalfCarryAdd((uint8_t)value, 1);
 	}
 
 }
+template<CPU::Operand Dst>
 void CPU::DEC()
 {
-	uint16_t value = fetch(m_CurrentInstruction.operand1);
+	uint16_t value = fetch<Dst>();
 
-	if(Is16Bit(m_CurrentInstruction.operand1))
+	if constexpr (Is16Bit(Dst))
 	{
 		value--;
-		writeOperand16(m_CurrentInstruction.operand1, value);
+		writeOperand16<Dst>(value);
 	}
 		
 	else
 	{
 		uint8_t result = value - 1;
-		writeOperand8(m_CurrentInstruction.operand1, (uint8_t)result);
-		SetFlag(Flag::Z, (uint8_t)result == 0);
+		writeOperand8<Dst>((uint8_t)result);
+		SetZeroFrom(result);
 		SetFlag(Flag::N, 1);
-		SetFlag(Flag::H, ((uint8_t)value & 0x0F) == 0);
+		SetHalfCarrySub((uint8_t)value, 1);
 	}
 
 	
 }
 
-void CPU::ADD() 
+template<CPU::Operand Dst, CPU::Operand Src>
+void CPU::ADD()
 {
-	uint16_t value1 = fetch(m_CurrentInstruction.operand1);
-	uint16_t value2 = fetch(m_CurrentInstruction.operand2);
+	uint16_t value1 = fetch<Dst>();
+	uint16_t value2 = fetch<Src>();
 	
-	if(Is16Bit(m_CurrentInstruction.operand1))
+	if constexpr (Is16Bit(Dst))
 	{
 		uint32_t temp = (uint32_t)value1 + (uint32_t)value2;
 		uint16_t result = (uint16_t)temp;
 		SetFlag(Flag::C, temp > 0xFFFF);
 		SetFlag(Flag::N, 0);
 		SetFlag(Flag::H, ((value1 & 0xFFF) + (value2 & 0xFFF)) > 0xFFF);
-		writeOperand16(m_CurrentInstruction.operand1, result);
+		writeOperand16<Dst>(result);
 	}
 	else
 	{
 		uint16_t temp = value1 + value2;
 		uint8_t result = (uint8_t)temp;
 		SetFlag(Flag::C, temp > 0xFF);
-		SetFlag(Flag::Z, result == 0);
+		SetZeroFrom(result);
 		SetFlag(Flag::N, 0);
-		SetFlag(Flag::H, ((value1 & 0xF) + (value2 & 0xF)) > 0xF);
-		writeOperand8(m_CurrentInstruction.operand1, result);
+		SetHalfCarryAdd((uint8_t)value1, (uint8_t)value2);
+		writeOperand8<Dst>(result);
 	}
 }
 
+template<CPU::Operand Src>
 void CPU::ADD_SP()
 {
-	int8_t value = fetch(m_CurrentInstruction.operand1); // signed 8-bit
+	int8_t value = fetch<Src>(); // signed 8-bit
 	uint16_t sp = SP;
 	uint16_t result = sp + value;
 
 	SetFlag(Flag::Z, 0); // Always cleared
 	SetFlag(Flag::N, 0); // Always cleared
 
-	SetFlag(Flag::H, ((sp & 0xF) + (value & 0xF)) > 0xF);
+	SetHalfCarryAdd(sp & 0xFF, (uint8_t)value);
 	SetFlag(Flag::C, ((sp & 0xFF) + (value & 0xFF)) > 0xFF);
 
 	SP = result;
 }
 
+template<CPU::Operand Dst, CPU::Operand Src>
 void CPU::ADC()
 {
-	uint16_t value1 = fetch(m_CurrentInstruction.operand1);
-	uint16_t value2 = fetch(m_CurrentInstruction.operand2);
+	uint16_t value1 = fetch<Dst>();
+	uint16_t value2 = fetch<Src>();
 	uint8_t carry = GetFlag(Flag::C);
 	
-	if(Is16Bit(m_CurrentInstruction.operand1))
+	if constexpr (Is16Bit(Dst))
 	{
 		uint32_t temp = (uint32_t)value1 + (uint32_t)value2 + (uint32_t)carry;
 		uint16_t result = temp & 0xFFFF;
@@ -599,97 +1022,104 @@ void CPU::ADC()
 		SetFlag(Flag::N, 0);
 		SetFlag(Flag::H, ((value1 & 0xFFF) + (value2 & 0xFFF) + carry) > 0xFFF);
 
-		writeOperand16(m_CurrentInstruction.operand1, result);
+		writeOperand16<Dst>(result);
 	}
 	else
 	{
 		uint16_t temp = value1 + value2 + carry;
 		uint8_t result = temp & 0xFF;
 		SetFlag(Flag::C, temp > 0xFF);
-		SetFlag(Flag::Z, result == 0);
+		SetZeroFrom(result);
 		SetFlag(Flag::N, 0);
-		SetFlag(Flag::H, ((value1 & 0xF) + (value2 & 0xF) + carry > 0xF));
-		writeOperand8(m_CurrentInstruction.operand1, result);
+		SetHalfCarryAdd((uint8_t)value1, (uint8_t)value2, carry);
+		writeOperand8<Dst>(result);
 	}
 }
 
+template<CPU::Operand Src>
 void CPU::SUB()
 {
-	uint8_t value = fetch(m_CurrentInstruction.operand1);
+	uint8_t value = fetch<Src>();
 	
 	uint16_t temp = (uint16_t)AF.hi - (uint16_t)value;
 	uint8_t result = (uint8_t)temp;
 	SetFlag(Flag::C, AF.hi < value);
-	SetFlag(Flag::Z, result == 0);
+	SetZeroFrom(result);
 	SetFlag(Flag::N, 1);
-	SetFlag(Flag::H, (AF.hi & 0xF) < (value & 0xF));
+	SetHalfCarrySub(AF.hi, value);
 
-	//writeOperand8(m_CurrentInstruction.operand1, result);
+	//writeOperand8<Src>(result);
 	AF.hi = result;
 }
 
+template<CPU::Operand Dst, CPU::Operand Src>
 void CPU::SBC()
 {
-	uint8_t value1 = fetch(m_CurrentInstruction.operand1);
-	uint8_t value2 = fetch(m_CurrentInstruction.operand2);
+	uint8_t value1 = fetch<Dst>();
+	uint8_t value2 = fetch<Src>();
 	uint8_t carry = GetFlag(Flag::C);
 	
 	uint16_t temp = value1 - value2 - carry;
 	uint8_t result = temp & 0xFF;
 
 	SetFlag(Flag::C, (int16_t)temp < 0);
-	SetFlag(Flag::Z, result == 0);
+	SetZeroFrom(result);
 	SetFlag(Flag::N, 1);
-	SetFlag(Flag::H, (value1 & 0xF) - (value2 & 0xF) - carry < 0);
-	writeOperand8(m_CurrentInstruction.operand1, result);
+	SetHalfCarrySub(value1, value2, carry);
+	writeOperand8<Dst>(result);
 
 }
 
+template<CPU::Operand Src>
 void CPU::AND()
 {
-	uint8_t value = fetch(m_CurrentInstruction.operand1);
+	uint8_t value = fetch<Src>();
 	AF.hi &= value;
-	SetFlag(Flag::Z, AF.hi == 0);
+	SetZeroFrom(AF.hi);
 	SetFlag(Flag::N, 0);
 	SetFlag(Flag::H, 1);
 	SetFlag(Flag::C, 0);
 }
 
+template<CPU::Operand Src>
 void CPU::XOR()
 {
-	uint8_t value = fetch(m_CurrentInstruction.operand1);
+	uint8_t value = fetch<Src>();
 	AF.hi ^= value;
-	SetFlag(Flag::Z, AF.hi == 0);
+	SetZeroFrom(AF.hi);
 	SetFlag(Flag::N, 0);
 	SetFlag(Flag::H, 0);
 	SetFlag(Flag::C, 0); 
 }
 
 
+template<CPU::Operand Src>
 void CPU::OR()
 {
-	uint8_t value = fetch(m_CurrentInstruction.operand1);
+	uint8_t value = fetch<Src>();
 	AF.hi |= value;
-	SetFlag(Flag::Z, AF.hi == 0);
+	SetZeroFrom(AF.hi);
 	SetFlag(Flag::N, 0);
 	SetFlag(Flag::H, 0);
 	SetFlag(Flag::C, 0); 
 }
 
+template<CPU::Operand Src>
 void CPU::CP()
 {
-	uint8_t value = fetch(m_CurrentInstruction.operand1);
+	uint8_t value = fetch<Src>();
 	uint8_t result = AF.hi - value;
-	SetFlag(Flag::Z, result == 0);
+	SetZeroFrom(result);
 	SetFlag(Flag::N, 1);
 	SetFlag(Flag::C, AF.hi < value);
-	SetFlag(Flag::H, (AF.hi & 0xF) < (value & 0xF));
+	SetHalfCarrySub(AF.hi, value);
 }
 
 
+template<CPU::Operand Cond>
 void CPU::RET()
 {
-	if(checkCond(m_CurrentInstruction.operand1.cond))
+	if(checkCond<Cond.cond>())
 	{
 		m_Cycles += 3; // 5 total cycles if we return
 
@@ -697,37 +1127,50 @@ void CPU::RET()
 	}
 }
 
+template<CPU::Operand Dst>
 void CPU::POP()
 {
 
 	uint16_t value = cpu_pop16();
 
-	if(m_CurrentInstruction.operand1.reg == RegType::AF) value &= 0xFFF0;
+	if constexpr (Dst.reg == RegType::AF) value &= 0xFFF0;
+
+	Register16<Dst.reg>() = value; // always will be a register
 
-	writeRegister16(m_CurrentInstruction.operand1.reg, value); // always will be a register
+	if constexpr (Dst.reg == RegType::AF) SetFlagsRegister(AF.lo);
 }
 
+template<CPU::Operand Src>
 void CPU::PUSH()
 {
-	uint16_t value = fetch(m_CurrentInstruction.operand1);
+	if constexpr (Src.reg == RegType::AF) MaterializeFlags();
+
+	uint16_t value = fetch<Src>();
 
 	cpu_push16(value);
 }
 
+template<CPU::Operand Cond, CPU::Operand Src>
 void CPU::JP()
 {
-	uint16_t jumpAddress = fetch(m_CurrentInstruction.operand2);
-	if(checkCond(m_CurrentInstruction.operand1.cond))
+	uint16_t jumpAddress = fetch<Src>();
+	if(checkCond<Cond.cond>())
 	{
 		m_Cycles++;
+
+		uint16_t branchPC = PC - 3;
 		PC = jumpAddress;
+
+		if constexpr (Src.mode == IMM16)
+			if (jumpAddress <= branchPC) OnBackwardBranch(branchPC);
 	}
 }
 
+template<CPU::Operand Cond, CPU::Operand Src>
 void CPU::CALL()
 {
-	uint16_t address = fetch(m_CurrentInstruction.operand2);
-	if(checkCond(m_CurrentInstruction.operand1.cond))
+	uint16_t address = fetch<Src>();
+	if(checkCond<Cond.cond>())
 	{
 		m_Cycles += 3;
 
@@ -784,13 +1227,16 @@ void CPU::RRA()
 	SetFlag(Flag::Z, 0); // Always cleared by RRA
 }
 
+template<CPU::Operand Cond, CPU::Operand Src>
 void CPU::JR()
 {
-	int8_t rel_addr = fetch(m_CurrentInstruction.operand2);
-	if(checkCond(m_CurrentInstruction.operand1.cond))
+	int8_t rel_addr = fetch<Src>();
+	if(checkCond<Cond.cond>())
 	{
 		m_Cycles++;
 		PC += rel_addr;
+
+		if (rel_addr <= -2) OnBackwardBranch(PC - rel_addr - 2);
 	}
 }
 
@@ -841,9 +1287,10 @@ void CPU::EI()
 	ime_enabling = true;
 }
 
+template<CPU::Operand Target>
 void CPU::RST()
 {
-	uint8_t target = m_CurrentInstruction.operand1.meta;
+	uint8_t target = Target.meta;
 	cpu_push16(PC);
 
 	uint16_t newAddress = target * 8;
@@ -874,7 +1321,7 @@ void CPU::DAA()
 
 	AF.hi = static_cast<uint8_t>(a);
 
-	SetFlag(Flag::Z, AF.hi == 0);
+	SetZeroFrom(AF.hi);
 	SetFlag(Flag::H, 0);
 	SetFlag(Flag::C, GetFlag(Flag::N) ? GetFlag(Flag::C) : fc);
 
@@ -882,229 +1329,240 @@ void CPU::DAA()
 }
 
 
+template<CPU::Operand Dst>
 void CPU::RLC()
 {
-	uint8_t value = fetch(m_CurrentInstruction.operand1);
+	uint8_t value = fetch<Dst>();
 	bool carryOut = (value & (1 << 7)) ? 1 : 0;
 	uint8_t result = (value << 1) | carryOut;
 
-	writeOperand8(m_CurrentInstruction.operand1, result);
+	writeOperand8<Dst>(result);
 
 	SetFlag(Flag::C, carryOut);
-	SetFlag(Flag::Z, result == 0);
+	SetZeroFrom(result);
 	SetFlag(Flag::H, 0);
 	SetFlag(Flag::N, 0);
 }
 
+template<CPU::Operand Dst>
 void CPU::RRC()
 {
-	uint8_t value = fetch(m_CurrentInstruction.operand1);
+	uint8_t value = fetch<Dst>();
 	uint8_t carryOut = value & 1;
 	uint8_t result = (value >> 1) | (carryOut << 7);
 
-	writeOperand8(m_CurrentInstruction.operand1, result);
+	writeOperand8<Dst>(result);
 
 	SetFlag(Flag::C, carryOut);
-	SetFlag(Flag::Z, result == 0);
+	SetZeroFrom(result);
 	SetFlag(Flag::H, 0);
 	SetFlag(Flag::N, 0);
 }
 
+template<CPU::Operand Dst>
 void CPU::RL()
 {
-	uint8_t value = fetch(m_CurrentInstruction.operand1);
+	uint8_t value = fetch<Dst>();
 	uint8_t carryOut = (value & (1 << 7)) ? 1 : 0;
 	uint8_t result = (value << 1) | GetFlag(Flag::C);
 
-	writeOperand8(m_CurrentInstruction.operand1, result);
+	writeOperand8<Dst>(result);
 
 	SetFlag(Flag::C, carryOut);
-	SetFlag(Flag::Z, result == 0);
+	SetZeroFrom(result);
 	SetFlag(Flag::H, 0);
 	SetFlag(Flag::N, 0);
 }
 
+template<CPU::Operand Dst>
 void CPU::RR()
 {
-	uint8_t value = fetch(m_CurrentInstruction.operand1);
+	uint8_t value = fetch<Dst>();
 	uint8_t carryOut = value & 1;
 	uint8_t result = (value >> 1) | (GetFlag(Flag::C) << 7);
 
-	writeOperand8(m_CurrentInstruction.operand1, result);
+	writeOperand8<Dst>(result);
 
 	SetFlag(Flag::C, carryOut);
-	SetFlag(Flag::Z, result == 0);
+	SetZeroFrom(result);
 	SetFlag(Flag::H, 0);
 	SetFlag(Flag::N, 0);
 }
 
+template<CPU::Operand Dst>
 void CPU::SLA()
 {
-	uint8_t value = fetch(m_CurrentInstruction.operand1);
+	uint8_t value = fetch<Dst>();
 	uint8_t carryOut = (value & (1 << 7)) ? 1 : 0;
 	uint8_t result = value << 1;
 
-	writeOperand8(m_CurrentInstruction.operand1, result);
+	writeOperand8<Dst>(result);
 
 	SetFlag(Flag::C, carryOut);
-	SetFlag(Flag::Z, result == 0);
+	SetZeroFrom(result);
 	SetFlag(Flag::H, 0);
 	SetFlag(Flag::N, 0);
 }
 
+template<CPU::Operand Dst>
 void CPU::SRA()
 {
-	uint8_t value = fetch(m_CurrentInstruction.operand1);
+	uint8_t value = fetch<Dst>();
 	uint8_t carryOut = value & 1;
 	uint8_t result = (value >> 1) | (value & 0x80);
 
-	writeOperand8(m_CurrentInstruction.operand1, result);
+	writeOperand8<Dst>(result);
 
 	SetFlag(Flag::C, carryOut);
-	SetFlag(Flag::Z, result == 0);
+	SetZeroFrom(result);
 	SetFlag(Flag::H, 0);
 	SetFlag(Flag::N, 0);
 }
 
+template<CPU::Operand Dst>
 void CPU::SWAP()
 {
-	uint8_t value = fetch(m_CurrentInstruction.operand1);
+	uint8_t value = fetch<Dst>();
 
 	uint8_t result = ((value & 0xF) << 4) | (value >> 4);
-	writeOperand8(m_CurrentInstruction.operand1, result);
+	writeOperand8<Dst>(result);
 
-	SetFlag(Flag::Z, result == 0);
+	SetZeroFrom(result);
 	SetFlag(Flag::C, 0);
 	SetFlag(Flag::H, 0);
 	SetFlag(Flag::N, 0);
 }
 
+template<CPU::Operand Dst>
 void CPU::SRL()
 {
-	uint8_t value = fetch(m_CurrentInstruction.operand1);
+	uint8_t value = fetch<Dst>();
 	
 	uint8_t carryOut = value & 1;
 	uint8_t result = (value >> 1);
 
-	writeOperand8(m_CurrentInstruction.operand1, result);
+	writeOperand8<Dst>(result);
 
 	SetFlag(Flag::C, carryOut);
-	SetFlag(Flag::Z, result == 0);
+	SetZeroFrom(result);
 	SetFlag(Flag::H, 0);
 	SetFlag(Flag::N, 0);
 
 }
 
+template<CPU::Operand Bit, CPU::Operand Src>
 void CPU::BIT()
 {
-	uint8_t bit = m_CurrentInstruction.operand1.meta;
-	uint8_t value = fetch(m_CurrentInstruction.operand2);
+	uint8_t bit = Bit.meta;
+	uint8_t value = fetch<Src>();
 	uint8_t result = (value & (1 << bit)) ? 1 : 0;
-	SetFlag(Flag::Z, !result);
+	SetZeroFrom(result);
 	SetFlag(Flag::N, 0);
 	SetFlag(Flag::H, 1);
 }
 
+template<CPU::Operand Bit, CPU::Operand Dst>
 void CPU::SET()
 {
-	uint8_t bit = m_CurrentInstruction.operand1.meta;
-	uint8_t value = fetch(m_CurrentInstruction.operand2);
+	uint8_t bit = Bit.meta;
+	uint8_t value = fetch<Dst>();
 	uint8_t result = value | (1 << bit);
-	writeOperand8(m_CurrentInstruction.operand2, result);
+	writeOperand8<Dst>(result);
 }
 
+template<CPU::Operand Bit, CPU::Operand Dst>
 void CPU::RES()
 {
-	uint8_t bit = m_CurrentInstruction.operand1.meta;
-	uint8_t value = fetch(m_CurrentInstruction.operand2);
+	uint8_t bit = Bit.meta;
+	uint8_t value = fetch<Dst>();
 	uint8_t result = value & ~(1 << bit);
-	writeOperand8(m_CurrentInstruction.operand2, result);
+	writeOperand8<Dst>(result);
 
 }
 
 
 // there has to be a better way of doing this
-CPU::Instruction CPU::InstructionByOpcode(uint8_t opcode) 
+constexpr CPU::InstructionDescription CPU::InstructionByOpcode(uint8_t opcode)
 {
 	switch(opcode)
 	{
 	case 0x00:
-		return {"NOP", 1, &CPU::NOP};
+		return {"NOP", 1, Op::NOP};
 	case 0x07:
-		return {"RLCA", 1, &CPU::RLCA};
+		return {"RLCA", 1, Op::RLCA};
 	case 0x08:
 	{
 		// LD (imm16), SP
-		return {"LD", 5, &CPU::LD, {IND_IMM16}, {REG16, RegType::SP}}; // when write operand will call write to IMM16 it will treat it as indirect
+		return {"LD", 5, Op::LD, {IND_IMM16}, {REG16, RegType::SP}}; // when write operand will call write to IMM16 it will treat it as indirect
 	}
 	case 0x10:
-		return {"STOP", 1, &CPU::STOP};
+		return {"STOP", 1, Op::STOP};
 	case 0x17:
-		return {"RLA", 1, &CPU::RLA};
+		return {"RLA", 1, Op::RLA};
 	case 0x27:
-		return {"DAA", 1, &CPU::DAA};
+		return {"DAA", 1, Op::DAA};
 	case 0x76:
- 		return {"HALT", 1, &CPU::HALT };
+ 		return {"HALT", 1, Op::HALT };
 	case 0xC6:
-		return {"ADD", 2, &CPU::ADD, {REG8, RegType::A}, {IMM8}};
+		return {"ADD", 2, Op::ADD, {REG8, RegType::A}, {IMM8}};
 	case 0xD6:
-		return {"SUB", 2, &CPU::SUB, {IMM8}};
+		return {"SUB", 2, Op::SUB, {IMM8}};
 	case 0xE6:
-		return {"AND", 2, &CPU::AND, {IMM8}}; 
+		return {"AND", 2, Op::AND, {IMM8}}; 
 	case 0xEE:
-		return {"XOR", 2, &CPU::XOR, {IMM8}};
+		return {"XOR", 2, Op::XOR, {IMM8}};
 	case 0xF6:
-		return {"OR", 2, &CPU::OR, {IMM8}};
+		return {"OR", 2, Op::OR, {IMM8}};
 	case 0xFE:
-		return {"CP", 2, &CPU::CP, {IMM8}};
+		return {"CP", 2, Op::CP, {IMM8}};
 	case 0xC9:
-		return {"RET", 1, &CPU::RET, {COND, RegType::NONE, CondType::NONE}}; // we already add 3 cycles if we jump, maybe the cycle count should be done like LD byt this is simplier for now
+		return {"RET", 1, Op::RET, {COND, RegType::NONE, CondType::NONE}}; // we already add 3 cycles if we jump, maybe the cycle count should be done like LD byt this is simplier for now
 	case 0xD9:
-		return {"RETI", 4, &CPU::RETI};
+		return {"RETI", 4, Op::RETI};
 	case 0xC3:
-		return {"JP", 3, &CPU::JP, {COND, RegType::NONE, CondType::NONE}, {IMM16}}; // should be 4 but we add 1
+		return {"JP", 3, Op::JP, {COND, RegType::NONE, CondType::NONE}, {IMM16}}; // should be 4 but we add 1
 	case 0xE9:
-		return {"JP", 0, &CPU::JP, {COND}, {REG16, RegType::HL}}; // JP already adds one
+		return {"JP", 0, Op::JP, {COND}, {REG16, RegType::HL}}; // JP already adds one
 	case 0xEA:
-		return {"LD", 4, &CPU::LD, {IND_IMM16}, {REG8, RegType::A}};
+		return {"LD", 4, Op::LD, {IND_IMM16}, {REG8, RegType::A}};
 	case 0xE8:
-		return {"ADD SP", 4, &CPU::ADD_SP, {IMM8}};
+		return {"ADD SP", 4, Op::ADD_SP, {IMM8}};
 	case 0xFA:
-		return {"LD", 4, &CPU::LD, {REG8, RegType::A}, {IND_IMM16}};
+		return {"LD", 4, Op::LD, {REG8, RegType::A}, {IND_IMM16}};
 	case 0xE0:
-		return {"LD", 3, &CPU::LD, {IND_IMM8}, {REG8, RegType::A}};
+		return {"LD", 3, Op::LD, {IND_IMM8}, {REG8, RegType::A}};
 	case 0xF0:
-		return {"LD", 3, &CPU::LD, {REG8, RegType::A}, {IND_IMM8}};
+		return {"LD", 3, Op::LD, {REG8, RegType::A}, {IND_IMM8}};
 	case 0xF2:
-		return {"LD", 2, &CPU::LD, {REG8, RegType::A}, {IND_REG8, RegType::C}};
+		return {"LD", 2, Op::LD, {REG8, RegType::A}, {IND_REG8, RegType::C}};
 	case 0xE2:
-		return {"LD", 2, &CPU::LD, {IND_REG8, RegType::C}, {REG8, RegType::A}};
+		return {"LD", 2, Op::LD, {IND_REG8, RegType::C}, {REG8, RegType::A}};
 	case 0xCD:
-		return {"CALL", 3, &CPU::CALL, {COND, RegType::NONE, CondType::NONE}, {IMM16}};
+		return {"CALL", 3, Op::CALL, {COND, RegType::NONE, CondType::NONE}, {IMM16}};
 	case 0x18:
-		return {"JR", 2, &CPU::JR, {COND, RegType::NONE, CondType::NONE}, {IMM8}};
+		return {"JR", 2, Op::JR, {COND, RegType::NONE, CondType::NONE}, {IMM8}};
 	case 0x0F:
-		return {"RRCA", 1, &CPU::RRCA};
+		return {"RRCA", 1, Op::RRCA};
 	case 0x1F:
-		return {"RRA", 1, &CPU::RRA};
+		return {"RRA", 1, Op::RRA};
 	case 0x37:
-		return {"SCF", 1, &CPU::SCF};
+		return {"SCF", 1, Op::SCF};
 	case 0x2F:
-		return {"CPL", 1, &CPU::CPL};
+		return {"CPL", 1, Op::CPL};
 	case 0x3F:
-		return {"CCF", 1, &CPU::CCF};
+		return {"CCF", 1, Op::CCF};
 	case 0xF3:
-		return {"DI", 1, &CPU::DI};
+		return {"DI", 1, Op::DI};
 	case 0xFB:
-		return {"EI", 1, &CPU::EI};
+		return {"EI", 1, Op::EI};
 	case 0xCE:
-		return {"ADC", 2, &CPU::ADC, {REG8, RegType::A}, {IMM8}};
+		return {"ADC", 2, Op::ADC, {REG8, RegType::A}, {IMM8}};
 	case 0xDE:
-		return {"SBC", 2, &CPU::SBC, {REG8, RegType::A}, {IMM8}};
+		return {"SBC", 2, Op::SBC, {REG8, RegType::A}, {IMM8}};
 	case 0xF8:
-		return {"LD HL, SP+", 3, &CPU::LD_HL_SP, {IMM8}}; // probably add operand for imm8
+		return {"LD HL, SP+", 3, Op::LD_HL_SP, {IMM8}}; // probably add operand for imm8
 	case 0xF9:
-		return {"LD", 2, &CPU::LD, {REG16, RegType::SP}, {REG16, RegType::HL}};
+		return {"LD", 2, Op::LD, {REG16, RegType::SP}, {REG16, RegType::HL}};
 	case 0xCB:
 		//throw std::runtime_error("0xCB instruction, needs to be handled externally, ie. use HandleCBInstruction");
 
@@ -1116,130 +1574,130 @@ CPU::Instruction CPU::InstructionByOpcode(uint8_t opcode)
 			Operand dest = DecodeReg8((opcode & 0b00111000) >> 3);
 			Operand src = DecodeReg8(opcode & 0b00000111);
 			uint8_t cycles = (dest.mode == IND) || (src.mode == IND) ? 2 : 1;
-			return { "LD", cycles, &CPU::LD, dest, src };
+			return { "LD", cycles, Op::LD, dest, src };
 
 		}
 		else if ((opcode & 0b11001111) == 0b00000001) // LD r16, imm16
 		{
 			Operand dest = DecodeReg16((opcode & 0b00110000) >> 4);
 			Operand src = {IMM16};
-			return {"LD", 3, &CPU::LD, dest, src};
+			return {"LD", 3, Op::LD, dest, src};
 		}
 		else if ((opcode & 0b11000111) == 0b00000110) // LD r8, imm8
 		{
 			Operand dest = DecodeReg8((opcode & 0b00111000) >> 3);
 			Operand src = {IMM8};
-			return { "LD", 2, &CPU::LD, dest, src };
+			return { "LD", 2, Op::LD, dest, src };
 		}
 
 		else if ((opcode & 0b11001111) == 0b00000010) // LD r16mem, a
 		{
 			Operand dest = DecodeReg16MEM((opcode & 0b00110000) >> 4);
-			return { "LD", 2, &CPU::LD, dest, {REG8, RegType::A}};
+			return { "LD", 2, Op::LD, dest, {REG8, RegType::A}};
 		}
 		else if ((opcode & 0b11001111) == 0b00001010) // LD a, r16mem
 		{
-			return {"LD", 4, &CPU::LD, {REG8, RegType::A}, DecodeReg16MEM((opcode & 0b00110000) >> 4)};
+			return {"LD", 4, Op::LD, {REG8, RegType::A}, DecodeReg16MEM((opcode & 0b00110000) >> 4)};
 		}
 		else if ((opcode & 0b11000111) == 0b00000100) // INC r8
 		{
 			Operand src = DecodeReg8((opcode & 0b00111000) >> 3);
 			uint8_t cycles = src.mode == IND ? 3 : 1;
-			return {"INC", cycles, &CPU::INC, src};
+			return {"INC", cycles, Op::INC, src};
 		}
 		else if ((opcode & 0b11000111) == 0b00000101) // DEC r8
 		{
 			Operand src = DecodeReg8((opcode & 0b00111000) >> 3);
 			uint8_t cycles = src.mode == IND ? 3 : 1;
-			return {"DEC", cycles, &CPU::DEC, src};
+			return {"DEC", cycles, Op::DEC, src};
 		}
 		else if ((opcode & 0b11001111) == 0b00000011) // INC r16
 		{
-			return {"INC", 2, &CPU::INC, DecodeReg16((opcode & 0b00110000) >> 4)};
+			return {"INC", 2, Op::INC, DecodeReg16((opcode & 0b00110000) >> 4)};
 		}
 		else if ((opcode & 0b11001111) == 0b00001011) // DEC r16
 		{
-			return {"DEC", 2, &CPU::DEC, DecodeReg16((opcode & 0b00110000) >> 4)};
+			return {"DEC", 2, Op::DEC, DecodeReg16((opcode & 0b00110000) >> 4)};
 		}
 		else if ((opcode & 0b11001111) == 0b00001001) // ADD HL, r16
 		{
-			return {"ADD", 2, &CPU::ADD, {REG16, RegType::HL}, DecodeReg16((opcode & 0b00110000) >> 4)};
+			return {"ADD", 2, Op::ADD, {REG16, RegType::HL}, DecodeReg16((opcode & 0b00110000) >> 4)};
 		}
 		else if ((opcode & 0b11111000) == 0b10000000) // ADD A, r8 // TODO: change cycle count when using (HL)
 		{
 			Operand src = DecodeReg8((opcode & 0b00000111));
 			uint8_t cycles = src.mode == IND ? 2 : 1;
-			return {"ADD", cycles, &CPU::ADD, {REG8, RegType::A}, src};
+			return {"ADD", cycles, Op::ADD, {REG8, RegType::A}, src};
 		}
 		else if ((opcode & 0b11111000) == 0b10001000) // ADC A, r8
 		{
 			Operand src = DecodeReg8((opcode & 0b00000111));
 			uint8_t cycles = src.mode == IND ? 2 : 1;
-			return {"ADC", 1, &CPU::ADC, {REG8, RegType::A}, src};
+			return {"ADC", 1, Op::ADC, {REG8, RegType::A}, src};
 		}
 		else if ((opcode & 0b11111000) == 0b10010000) // SUB r8
 		{
 			Operand src = DecodeReg8((opcode & 0b00000111));
 			uint8_t cycles = src.mode == IND ? 2 : 1;
-			return {"SUB", cycles, &CPU::SUB, src};
+			return {"SUB", cycles, Op::SUB, src};
 		}
 		else if ((opcode & 0b11111000) == 0b10011000) // SBC A, r8
 		{
 			Operand src = DecodeReg8((opcode & 0b00000111));
 			uint8_t cycles = src.mode == IND ? 2 : 1;	
-			return {"SBC", cycles, &CPU::SBC, {REG8, RegType::A}, src};
+			return {"SBC", cycles, Op::SBC, {REG8, RegType::A}, src};
 		}
 		else if ((opcode & 0b11111000) == 0b10100000) // AND r8
 		{
 			Operand src = DecodeReg8((opcode & 0b00000111));
 			uint8_t cycles = src.mode == IND ? 2 : 1;	
-			return {"AND", cycles, &CPU::AND, DecodeReg8((opcode & 0b00000111))};
+			return {"AND", cycles, Op::AND, DecodeReg8((opcode & 0b00000111))};
 		}
 		else if ((opcode & 0b11111000) == 0b10110000) // OR r8
 		{
 			Operand src = DecodeReg8((opcode & 0b00000111));
 			uint8_t cycles = src.mode == IND ? 2 : 1;	
-			return {"OR", cycles, &CPU::OR, src};
+			return {"OR", cycles, Op::OR, src};
 		}
 		else if ((opcode & 0b11111000) == 0b10101000) // XOR r8
 		{
 			Operand src = DecodeReg8((opcode & 0b00000111));
 			uint8_t cycles = src.mode == IND ? 2 : 1;	
-			return {"XOR", cycles, &CPU::XOR, src};
+			return {"XOR", cycles, Op::XOR, src};
 		}
 		else if ((opcode & 0b11111000) == 0b10111000) // CP r8
 		{
 			Operand src = DecodeReg8((opcode & 0b00000111));
 			uint8_t cycles = src.mode == IND ? 2 : 1;	
-			return {"CP", cycles, &CPU::CP, src};
+			return {"CP", cycles, Op::CP, src};
 		}
 		else if((opcode & 0b11100111) == 0b11000000) // RET cond
 		{
-			return {"RET", 2, &CPU::RET, DecodeCond((opcode & 0b00011000) >> 3)};
+			return {"RET", 2, Op::RET, DecodeCond((opcode & 0b00011000) >> 3)};
 		}
 		else if((opcode & 0b11001111) == 0b11000001) // POP r16stk
 		{
-			return {"POP", 3, &CPU::POP, DecodeReg16STK((opcode & 0b00110000) >> 4)};
+			return {"POP", 3, Op::POP, DecodeReg16STK((opcode & 0b00110000) >> 4)};
 		}
 		else if((opcode & 0b11001111) == 0b11000101) // PUSH r16stk
 		{
-			return {"PUSH", 4, &CPU::PUSH, DecodeReg16STK((opcode & 0b00110000) >> 4)};
+			return {"PUSH", 4, Op::PUSH, DecodeReg16STK((opcode & 0b00110000) >> 4)};
 		}
 		else if((opcode & 0b111000111) == 0b11000010) // JP cond imm16  +1 cycle if jump
 		{
-			return {"JP", 3, &CPU::JP, DecodeCond((opcode & 0b00011000) >> 3), {IMM16}};
+			return {"JP", 3, Op::JP, DecodeCond((opcode & 0b00011000) >> 3), {IMM16}};
 		}
 		else if((opcode & 0b11100111) == 0b11000100) // CALL cond imm16  +3 cycle if jump
 		{
-			return {"CALL", 3, &CPU::CALL, DecodeCond((opcode & 0b00011000) >> 3), {IMM16}};
+			return {"CALL", 3, Op::CALL, DecodeCond((opcode & 0b00011000) >> 3), {IMM16}};
 		}
 		else if((opcode & 0b11100111) == 0b00100000) // JR cond s8   +1 cycle if jump
 		{
-			return {"JR", 2, &CPU::JR, DecodeCond((opcode & 0b00011000) >> 3), {IMM8}};
+			return {"JR", 2, Op::JR, DecodeCond((opcode & 0b00011000) >> 3), {IMM8}};
 		}
 		else if (((opcode & 0b11000111) == 0b11000111))
 		{
-			return {"RST", 4, &CPU::RST, {IMPL, RegType::NONE, CondType::NONE, (uint8_t)((opcode & 0b00111000) >> 3)}};
+			return {"RST", 4, Op::RST, {IMPL, RegType::NONE, CondType::NONE, (uint8_t)((opcode & 0b00111000) >> 3)}};
 		}
 		else 
 		{
@@ -1249,43 +1707,43 @@ CPU::Instruction CPU::InstructionByOpcode(uint8_t opcode)
 
 	// incase of failure just do nothing
 	// should throw an error
-	return {"XXX", 1, &CPU::NOP};
+	return {"XXX", 1, Op::NOP};
 }
 
-CPU::Instruction CPU::HandleCBInstruction(uint8_t opcode)
+constexpr CPU::InstructionDescription CPU::HandleCBInstruction(uint8_t opcode)
 {
 
 
 	// TODO: change cycle count for HL
 	if((opcode & 0b111111000) == 0b00000000) // rlc r8
-		return {"RLC", 2, &CPU::RLC, DecodeReg8(opcode & 0b111)};
+		return {"RLC", 2, Op::RLC, DecodeReg8(opcode & 0b111)};
 	else if((opcode & 0b111111000) == 0b00001000) // rrc r8
-		return {"RRC", 2, &CPU::RRC, DecodeReg8(opcode & 0b111)};
+		return {"RRC", 2, Op::RRC, DecodeReg8(opcode & 0b111)};
 	else if((opcode & 0b111111000) == 0b00010000) // rl r8
-		return {"RL", 2, &CPU::RL, DecodeReg8(opcode & 0b111)};
+		return {"RL", 2, Op::RL, DecodeReg8(opcode & 0b111)};
 	else if((opcode & 0b111111000) == 0b00011000) // rr sr8
-		return {"RR", 2, &CPU::RR, DecodeReg8(opcode & 0b111)};
+		return {"RR", 2, Op::RR, DecodeReg8(opcode & 0b111)};
 	else if((opcode & 0b111111000) == 0b00100000) // sla r8
-		return {"SLA", 2, &CPU::SLA, DecodeReg8(opcode & 0b111)};
+		return {"SLA", 2, Op::SLA, DecodeReg8(opcode & 0b111)};
 	else if((opcode & 0b111111000) == 0b00101000) // sra r8
-		return {"SRA", 2, &CPU::SRA, DecodeReg8(opcode & 0b111)};
+		return {"SRA", 2, Op::SRA, DecodeReg8(opcode & 0b111)};
 	else if((opcode & 0b111111000) == 0b00110000) // swap r8
-		return {"SWAP", 2, &CPU::SWAP, DecodeReg8(opcode & 0b111)};
+		return {"SWAP", 2, Op::SWAP, DecodeReg8(opcode & 0b111)};
 	else if((opcode & 0b111111000) == 0b00111000) // srl r8
-		return {"SRL", 2, &CPU::SRL, DecodeReg8(opcode & 0b111)};
+		return {"SRL", 2, Op::SRL, DecodeReg8(opcode & 0b111)};
 	else if((opcode & 0b11000000) == 0b01000000) // bit inx r8
-		return {"BIT", 2, &CPU::BIT, {IMPL, RegType::NONE, CondType::NONE, (opcode & 0b00111000) >> 3}, DecodeReg8(opcode & 0b111)};
+		return {"BIT", 2, Op::BIT, {IMPL, RegType::NONE, CondType::NONE, (uint8_t)((opcode & 0b00111000) >> 3)}, DecodeReg8(opcode & 0b111)};
 	else if((opcode & 0b11000000) == 0b10000000) // res inx r8
-		return {"RES", 2, &CPU::RES, {IMPL, RegType::NONE, CondType::NONE, (opcode & 0b00111000) >> 3}, DecodeReg8(opcode & 0b111)};
+		return {"RES", 2, Op::RES, {IMPL, RegType::NONE, CondType::NONE, (uint8_t)((opcode & 0b00111000) >> 3)}, DecodeReg8(opcode & 0b111)};
 	else if((opcode & 0b11000000) == 0b11000000) // bit inx r8
-		return {"SET", 2, &CPU::SET, {IMPL, RegType::NONE, CondType::NONE, (opcode & 0b00111000) >> 3}, DecodeReg8(opcode & 0b111)};
+		return {"SET", 2, Op::SET, {IMPL, RegType::NONE, CondType::NONE, (uint8_t)((opcode & 0b00111000) >> 3)}, DecodeReg8(opcode & 0b111)};
 
 	std::cout << "UNHANDLED CB INSTRUCTION " << (int)opcode << std::endl;
-	return {"XXX", 1, &CPU::NOP};
+	return {"XXX", 1, Op::NOP};
 }
 
 
-CPU::Operand CPU::DecodeReg8(uint8_t bits)
+constexpr CPU::Operand CPU::DecodeReg8(uint8_t bits)
 {
 	switch(bits)
 	{
@@ -1302,7 +1760,7 @@ CPU::Operand CPU::DecodeReg8(uint8_t bits)
 	return {};
 }
 
-CPU::Operand CPU::DecodeReg16(uint8_t bits)
+constexpr CPU::Operand CPU::DecodeReg16(uint8_t bits)
 {
 	switch(bits)
 	{
@@ -1315,7 +1773,7 @@ CPU::Operand CPU::DecodeReg16(uint8_t bits)
 	return {};
 }
 
-CPU::Operand CPU::DecodeReg16STK(uint8_t bits)
+constexpr CPU::Operand CPU::DecodeReg16STK(uint8_t bits)
 {
 	switch(bits)
 	{
@@ -1328,7 +1786,7 @@ CPU::Operand CPU::DecodeReg16STK(uint8_t bits)
 	return {};
 }
 
-CPU::Operand CPU::DecodeReg16MEM(uint8_t bits)
+constexpr CPU::Operand CPU::DecodeReg16MEM(uint8_t bits)
 {
 	switch(bits)
 	{
@@ -1341,7 +1799,7 @@ CPU::Operand CPU::DecodeReg16MEM(uint8_t bits)
 	return {};
 }
 
-CPU::Operand CPU::DecodeCond(uint8_t bits)
+constexpr CPU::Operand CPU::DecodeCond(uint8_t bits)
 {
 	switch (bits)
 	{
@@ -1355,17 +1813,256 @@ CPU::Operand CPU::DecodeCond(uint8_t bits)
 	return {};
 }
 
-bool CPU::checkCond(CondType cond)
+template<CPU::CondType Cond>
+bool CPU::checkCond()
+{
+	if constexpr (Cond == CondType::NONE) return true;
+	else if constexpr (Cond == CondType::NZ) return !GetFlag(Flag::Z);
+	else if constexpr (Cond == CondType::Z) return GetFlag(Flag::Z);
+	else if constexpr (Cond == CondType::NC) return !GetFlag(Flag::C);
+	else if constexpr (Cond == CondType::C) return GetFlag(Flag::C);
+	else static_assert(always_false<Cond>, "Invalid condition!!");
+}
+
+
+// Everything below builds the jump tables at compile time. Each opcode gets decoded by the functions above
+// and then pointed at the handler specialised for exactly its operands.
+
+template<CPU::Op Type, CPU::Operand Op1, CPU::Operand Op2>
+constexpr CPU::Handler GetHandler()
+{
+	using Op = CPU::Op;
+
+	if constexpr (Type == Op::NOP) return &CPU::NOP;
+	else if constexpr (Type == Op::HALT) return &CPU::HALT;
+	else if constexpr (Type == Op::LD) return &CPU::LD<Op1, Op2>;
+	else if constexpr (Type == Op::LD_HL_SP) return &CPU::LD_HL_SP<Op1>;
+	else if constexpr (Type == Op::INC) return &CPU::INC<Op1>;
+	else if constexpr (Type == Op::DEC) return &CPU::DEC<Op1>;
+	else if constexpr (Type == Op::ADD) return &CPU::ADD<Op1, Op2>;
+	else if constexpr (Type == Op::ADD_SP) return &CPU::ADD_SP<Op1>;
+	else if constexpr (Type == Op::SUB) return &CPU::SUB<Op1>;
+	else if constexpr (Type == Op::ADC) return &CPU::ADC<Op1, Op2>;
+	else if constexpr (Type == Op::SBC) return &CPU::SBC<Op1, Op2>;
+	else if constexpr (Type == Op::AND) return &CPU::AND<Op1>;
+	else if constexpr (Type == Op::XOR) return &CPU::XOR<Op1>;
+	else if constexpr (Type == Op::OR) return &CPU::OR<Op1>;
+	else if constexpr (Type == Op::CP) return &CPU::CP<Op1>;
+	else if constexpr (Type == Op::RET) return &CPU::RET<Op1>;
+	else if constexpr (Type == Op::PUSH) return &CPU::PUSH<Op1>;
+	else if constexpr (Type == Op::POP) return &CPU::POP<Op1>;
+	else if constexpr (Type == Op::JP) return &CPU::JP<Op1, Op2>;
+	else if constexpr (Type == Op::JR) return &CPU::JR<Op1, Op2>;
+	else if constexpr (Type == Op::CALL) return &CPU::CALL<Op1, Op2>;
+	else if constexpr (Type == Op::RLCA) return &CPU::RLCA;
+	else if constexpr (Type == Op::RLA) return &CPU::RLA;
+	else if constexpr (Type == Op::RRCA) return &CPU::RRCA;
+	else if constexpr (Type == Op::RRA) return &CPU::RRA;
+	else if constexpr (Type == Op::SCF) return &CPU::SCF;
+	else if constexpr (Type == Op::CPL) return &CPU::CPL;
+	else if constexpr (Type == Op::CCF) return &CPU::CCF;
+	else if constexpr (Type == Op::STOP) return &CPU::STOP;
+	else if constexpr (Type == Op::RETI) return &CPU::RETI;
+	else if constexpr (Type == Op::DI) return &CPU::DI;
+	else if constexpr (Type == Op::EI) return &CPU::EI;
+	else if constexpr (Type == Op::RST) return &CPU::RST<Op1>;
+	else if constexpr (Type == Op::DAA) return &CPU::DAA;
+	else if constexpr (Type == Op::RLC) return &CPU::RLC<Op1>;
+	else if constexpr (Type == Op::RRC) return &CPU::RRC<Op1>;
+	else if constexpr (Type == Op::RL) return &CPU::RL<Op1>;
+	else if constexpr (Type == Op::RR) return &CPU::RR<Op1>;
+	else if constexpr (Type == Op::SLA) return &CPU::SLA<Op1>;
+	else if constexpr (Type == Op::SRA) return &CPU::SRA<Op1>;
+	else if constexpr (Type == Op::SWAP) return &CPU::SWAP<Op1>;
+	else if constexpr (Type == Op::SRL) return &CPU::SRL<Op1>;
+	else if constexpr (Type == Op::BIT) return &CPU::BIT<Op1, Op2>;
+	else if constexpr (Type == Op::SET) return &CPU::SET<Op1, Op2>;
+	else if constexpr (Type == Op::RES) return &CPU::RES<Op1, Op2>;
+	else static_assert(always_false<Type>, "missing handler");
+}
+
+template<bool CBPrefix, uint8_t Opcode>
+constexpr CPU::Instruction MakeInstruction()
+{
+	constexpr CPU::InstructionDescription desc = CBPrefix ? CPU::HandleCBInstruction(Opcode) : CPU::InstructionByOpcode(Opcode);
+	return { GetHandler<desc.op, desc.operand1, desc.operand2>(), desc.cycles, desc.operand1, desc.operand2 };
+}
+
+template<bool CBPrefix, size_t... Opcodes>
+constexpr std::array<CPU::Instruction, 256> MakeJumpTable(std::index_sequence<Opcodes...>)
+{
+	return { MakeInstruction<CBPrefix, (uint8_t)Opcodes>()... };
+}
+
+template<bool CBPrefix, size_t... Opcodes>
+constexpr std::array<CPU::InstructionInfo, 256> MakeInfoTable(std::index_sequence<Opcodes...>)
+{
+	constexpr auto info = [](uint8_t opcode)
+	{
+		CPU::InstructionDescription desc = CBPrefix ? CPU::HandleCBInstruction(opcode) : CPU::InstructionByOpcode(opcode);
+		return CPU::InstructionInfo{ desc.name, desc.op };
+	};
+
+	return { info(Opcodes)... };
+}
+
+const std::array<CPU::Instruction, 256> CPU::m_JumpTable = MakeJumpTable<false>(std::make_index_sequence<256>{});
+const std::array<CPU::Instruction, 256> CPU::m_CBPrefixJumpTable = MakeJumpTable<true>(std::make_index_sequence<256>{});
+
+const std::array<CPU::InstructionInfo, 256> CPU::m_JumpTableInfo = MakeInfoTable<false>(std::make_index_sequence<256>{});
+const std::array<CPU::InstructionInfo, 256> CPU::m_CBPrefixJumpTableInfo = MakeInfoTable<true>(std::make_index_sequence<256>{});
+
+
+// Threaded core
+//
+// Same behaviour as calling Step() in a loop but every opcode gets its own label in one function, and each label
+// ends with its own jump to the next opcode. The branch predictor then gets history per opcode instead of one shared
+// indirect call, and the handlers get inlined since which one runs is known at compile time.
+// Compilers without computed goto (msvc) get a switch instead, define GB_COMPUTED_GOTO=0 to force it.
+
+#ifndef GB_COMPUTED_GOTO
+#if defined(__GNUC__) || defined(__clang__)
+#define GB_COMPUTED_GOTO 1
+#else
+#define GB_COMPUTED_GOTO 0
+#endif
+#endif
+
+#define GB_OPCODE_ROW(X, hi) \
+	X(0x##hi##0) X(0x##hi##1) X(0x##hi##2) X(0x##hi##3) X(0x##hi##4) X(0x##hi##5) X(0x##hi##6) X(0x##hi##7) \
+	X(0x##hi##8) X(0x##hi##9) X(0x##hi##A) X(0x##hi##B) X(0x##hi##C) X(0x##hi##D) X(0x##hi##E) X(0x##hi##F)
+
+#define GB_OPCODES(X) \
+	GB_OPCODE_ROW(X, 0) \
+	GB_OPCODE_ROW(X, 1) \
+	GB_OPCODE_ROW(X, 2) \
+	GB_OPCODE_ROW(X, 3) \
+	GB_OPCODE_ROW(X, 4) \
+	GB_OPCODE_ROW(X, 5) \
+	GB_OPCODE_ROW(X, 6) \
+	GB_OPCODE_ROW(X, 7) \
+	GB_OPCODE_ROW(X, 8) \
+	GB_OPCODE_ROW(X, 9) \
+	GB_OPCODE_ROW(X, A) \
+	GB_OPCODE_ROW(X, B) \
+	GB_OPCODE_ROW(X, C) \
+	GB_OPCODE_ROW(X, D) \
+	GB_OPCODE_ROW(X, E) \
+	GB_OPCODE_ROW(X, F)
+
+template<bool CBPrefix, uint8_t Opcode>
+inline void CPU::ExecuteOpcode()
 {
-	switch (cond)
+	constexpr InstructionDescription desc = CBPrefix ? HandleCBInstruction(Opcode) : InstructionByOpcode(Opcode);
+	constexpr Handler handler = GetHandler<desc.op, desc.operand1, desc.operand2>();
+
+	m_Cycles = desc.cycles;
+	(this->*handler)();
+}
+
+template<bool CBPrefix, uint8_t Opcode>
+void CPU::RunOpcode(CPU* cpu)
+{
+	cpu->ExecuteOpcode<CBPrefix, Opcode>();
+}
+
+#define GB_OPCODE_FUNCTION(n) &CPU::RunOpcode<false, n>,
+#define GB_CB_OPCODE_FUNCTION(n) &CPU::RunOpcode<true, n>,
+
+const std::array<CPU::OpcodeFunction, 256> CPU::m_OpcodeFunctions = { GB_OPCODES(GB_OPCODE_FUNCTION) };
+const std::array<CPU::OpcodeFunction, 256> CPU::m_CBOpcodeFunctions = { GB_OPCODES(GB_CB_OPCODE_FUNCTION) };
+
+#undef GB_OPCODE_FUNCTION
+#undef GB_CB_OPCODE_FUNCTION
+
+void CPU::RunThreaded(uint64_t limit)
+{
+	uint64_t& ticks = emu->m_SystemTicks;
+	m_CurrentDecoded = nullptr;
+
+#if GB_COMPUTED_GOTO
+
+#define GB_LABEL_ADDRESS(n) &&op_##n,
+#define GB_CB_LABEL_ADDRESS(n) &&cb_##n,
+
+	static void* const labels[256] = { GB_OPCODES(GB_LABEL_ADDRESS) };
+	static void* const cbLabels[256] = { GB_OPCODES(GB_CB_LABEL_ADDRESS) };
+
+	// interrupts, halt and EI only matter at instruction boundaries so those go through Step()
+#define GB_DISPATCH() \
+	do { \
+		if (ticks >= std::min(limit, emu->scheduler.NextEventTime())) return; \
+		if (halted || ime_enabling || (int_master_enabled && (int_enable & int_flag))) goto slow_path; \
+		goto *labels[emu->read(PC++)]; \
+	} while (0)
+
+#define GB_LABEL(n) \
+	op_##n: \
+		if (n == 0xCB) goto *cbLabels[emu->read(PC++)]; \
+		ExecuteOpcode<false, n>(); \
+		ticks += m_Cycles * 4; \
+		GB_DISPATCH();
+
+#define GB_CB_LABEL(n) \
+	cb_##n: \
+		ExecuteOpcode<true, n>(); \
+		ticks += m_Cycles * 4; \
+		GB_DISPATCH();
+
+	GB_DISPATCH();
+
+slow_path:
+	if (SkipHalt(limit)) return;
+
+	ticks += Step() * 4;
+	GB_DISPATCH();
+
+	GB_OPCODES(GB_LABEL)
+	GB_OPCODES(GB_CB_LABEL)
+
+#undef GB_LABEL_ADDRESS
+#undef GB_CB_LABEL_ADDRESS
+#undef GB_DISPATCH
+#undef GB_LABEL
+#undef GB_CB_LABEL
+
+#else
+
+#define GB_CASE(n) case n: ExecuteOpcode<false, n>(); break;
+#define GB_CB_CASE(n) case n: ExecuteOpcode<true, n>(); break;
+
+	while (ticks < std::min(limit, emu->scheduler.NextEventTime()))
 	{
-		case CondType::NONE: return true;
-		case CondType::NZ: return !GetFlag(Flag::Z);
-		case CondType::Z: return GetFlag(Flag::Z);
-		case CondType::NC: return !GetFlag(Flag::C);
-		case CondType::C: return GetFlag(Flag::C);
+		if (halted || ime_enabling || (int_master_enabled && (int_enable & int_flag)))
+		{
+			if (SkipHalt(limit)) return;
+
+			ticks += Step() * 4;
+			continue;
+		}
+
+		uint8_t opcode = emu->read(PC++);
+
+		if (opcode == 0xCB)
+		{
+			switch (emu->read(PC++))
+			{
+				GB_OPCODES(GB_CB_CASE)
+			}
+		}
+		else
+		{
+			switch (opcode)
+			{
+				GB_OPCODES(GB_CASE)
+			}
+		}
+
+		ticks += m_Cycles * 4;
 	}
 
-	std::cout << "Invalid condition!!" << std::endl;
-	return false;
-}
\ No newline at end of file
+#undef GB_CASE
+#undef GB_CB_CASE
+
+#endif
+}
@@ -1,18 +1,27 @@
 #include "emulator.h"
+#include "savestate.h"
 #include <iostream>
+#include <algorithm>
 
 Emulator::Emulator()
 {
-	cpu.Reset();
 	cpu.ConnectCPUToBus(this);
 
 	timer.ConnectTimerToCPU(&cpu);
+	timer.ConnectToEmulator(this);
 	dma.ConnectToEmulator(this);
 	ppu.ConnectLCD(&lcd);
 	ppu.ConnectCPU(&cpu);
 	ppu.ConnectToEmulator(this);
 	lcd.ConnectToEmulator(this);
 
+	blockCache.ConnectMemoryMap(&memoryMap);
+	rewind.ConnectToEmulator(this);
+
+	// VRAM writes have to sync the ppu first so only reads go straight through
+	memoryMap.Map(0x8000, 0x2000, ppu.GetVRAM(), false);
+	memoryMap.Map(0xC000, 0x2000, wram.data(), true);
+
 	Reset();
 
 }
@@ -20,105 +29,259 @@ Emulator::Emulator()
 void Emulator::Reset()
 {
 	m_SystemTicks = 0;
+	rewind.Clear();
+	scheduler.Reset();
+	blockCache.Clear();
 	cpu.Reset();
 	lcd.Reset();
 	ppu.Reset();
 	timer.Reset();
 	dma.Reset();
 
-	memory.fill(0);
 	wram.fill(0);
 	hram.fill(0);
 
 	serial_data[0] = 0;
 	serial_data[1] = 0;
+}
+
+void Emulator::CaptureResetPoint(uint64_t warmupFrames, const InputScript& input)
+{
+	if (!romLoaded) throw std::runtime_error("No ROM loaded");
+
+	Reset();
+
+	size_t inputCursor = 0;
+	for (uint64_t frame = 0; frame < warmupFrames; frame++)
+	{
+		buttonState.SetHeld(input.GetButtons(frame, inputCursor));
+		UpdateFrame();
+	}
+
+	buttonState.SetHeld(0);
+	SaveState(m_ResetPoint);
+}
+
+void Emulator::FastReset()
+{
+	if (m_ResetPoint.empty())
+	{
+		Reset();
+		return;
+	}
+
+	LoadState(m_ResetPoint);
+	buttonState.SetHeld(0);
+}
+
+struct SystemState
+{
+	uint64_t systemTicks;
+	uint8_t serialData[2];
+	bool selectDpad;
+	bool selectButtons;
+	uint8_t unused[4] = {};
+};
+
+static constexpr uint32_t SYSTEM_STATE_ID = MakeChunkID("SYS ");
+static constexpr uint32_t SYSTEM_STATE_VERSION = 1;
+
+void Emulator::SaveState(std::vector<uint8_t>& state, bool includeFrame)
+{
+	if (!romLoaded) throw std::runtime_error("No ROM loaded");
+
+	StateWriter writer(state);
 
-	memory[0xFF05] = 0x00; // TIMA
-	memory[0xFF06] = 0x00; // TMA
-	memory[0xFF07] = 0x00; // TAC
-	memory[0xFF10] = 0x80; // NR10
-	memory[0xFF11] = 0xBF;
-	memory[0xFF12] = 0xF3;
-	memory[0xFF14] = 0xBF;
-	memory[0xFF16] = 0x3F;
-	memory[0xFF17] = 0x00;
-	memory[0xFF19] = 0xBF;
-	memory[0xFF1A] = 0x7F;
-	memory[0xFF1B] = 0xFF;
-	memory[0xFF1C] = 0x9F;
-	memory[0xFF1E] = 0xBF;
-	memory[0xFF20] = 0xFF;
-	memory[0xFF21] = 0x00;
-	memory[0xFF22] = 0x00;
-	memory[0xFF23] = 0xBF;
-	memory[0xFF24] = 0x77;
-	memory[0xFF25] = 0xF3;
-	memory[0xFF26] = 0xF1; // Enable sound
-	memory[0xFF40] = 0x91; // LCDC
-	memory[0xFF42] = 0x00;
-	memory[0xFF43] = 0x00;
-	memory[0xFF45] = 0x00;
-	memory[0xFF47] = 0xFC;
-	memory[0xFF48] = 0xFF;
-	memory[0xFF49] = 0xFF;
-	memory[0xFF4A] = 0x00;
-	memory[0xFF4B] = 0x00;
-	memory[0xFFFF] = 0x00; // IE
+	SystemState system = { m_SystemTicks, { serial_data[0], serial_data[1] }, buttonState.sel_dpad, buttonState.sel_button };
+
+	writer.BeginChunk(SYSTEM_STATE_ID, SYSTEM_STATE_VERSION);
+	writer.Write(system);
+	writer.WriteBytes(wram.data(), wram.size());
+	writer.WriteBytes(hram.data(), hram.size());
+	writer.EndChunk();
+
+	cartridge->SaveState(writer);
+	scheduler.SaveState(writer);
+	cpu.SaveState(writer);
+	timer.SaveState(writer);
+	lcd.SaveState(writer);
+	ppu.SaveState(writer);
+	dma.SaveState(writer);
+
+	if (includeFrame) ppu.SaveFrame(writer);
+}
+
+void Emulator::LoadState(std::span<const uint8_t> state)
+{
+	// chunks are loaded one after another so a broken one is only found once everything before it is overwritten,
+	// whatever was there before gets put back then
+	SaveState(m_LoadBackup);
+
+	try
+	{
+		RestoreState(state);
+	}
+	catch (std::exception&)
+	{
+		RestoreState(m_LoadBackup);
+		throw;
+	}
+
+	rewind.Clear();
+}
+
+void Emulator::RestoreState(std::span<const uint8_t> state, bool keepRAMBlocks)
+{
+	if (!romLoaded) throw std::runtime_error("No ROM loaded");
+
+	StateReader reader(state);
+
+	// first so a state for another game gets turned away before anything is overwritten
+	cartridge->LoadState(reader);
+
+	SystemState system;
+
+	reader.OpenChunk(SYSTEM_STATE_ID, SYSTEM_STATE_VERSION);
+	reader.Read(system);
+
+	m_SystemTicks = system.systemTicks;
+	serial_data[0] = system.serialData[0];
+	serial_data[1] = system.serialData[1];
+	buttonState.sel_dpad = system.selectDpad;
+	buttonState.sel_button = system.selectButtons;
+
+	reader.ReadBytes(wram.data(), wram.size());
+	reader.ReadBytes(hram.data(), hram.size());
+
+	scheduler.LoadState(reader);
+	cpu.LoadState(reader);
+	timer.LoadState(reader);
+	lcd.LoadState(reader);
+	ppu.LoadState(reader);
+	dma.LoadState(reader);
+
+	ppu.LoadFrame(reader);
+
+	// ROM blocks are still good, anything cached from RAM might not be
+	if (!keepRAMBlocks) blockCache.DiscardRAMBlocks();
+
+	// everything the cpu remembered about loops is from a different point in time
+	m_EventsDispatched++;
 }
 
 void Emulator::UpdateFrame()
 {
 	if (!romLoaded) return;
 
+	if (runAheadFrames <= 0)
+	{
+		RunFrame();
+		rewind.OnFrame();
+		return;
+	}
+
+	// the real frame, nobody sees it since the frames after it get shown instead
+	ppu.renderVideo = false;
+	RunFrame();
+	rewind.OnFrame();
+
+	SaveState(m_RunAheadState, false);
+
+	// the frames ahead get run again for real later, anything they send over the link cable would come out twice
+	std::ostream* output = serialOutput;
+	serialOutput = nullptr;
+
+	for (int i = 0; i < runAheadFrames; i++)
+	{
+		// the ppu only draws the last one, which still covers every visible line since a frame is nearly 154 lines long
+		ppu.renderVideo = i == runAheadFrames - 1;
+		RunFrame();
+	}
+
+	// the screen is kept since the state was saved without it
+	ppu.renderVideo = true;
+	serialOutput = output;
+	RestoreState(m_RunAheadState);
+}
+
+void Emulator::RunFrame()
+{
+	if (!romLoaded) return;
+
 	// system clocks MAX_CYCLES amount of times before drawing the screen.
 	// clock speed = 4.194304MHz; 4194304 clocks a second
 	// if we are doing 60fps 1 frame takes 1/60s that means we need to do 4194304/60 (69905) clocks before we draw the screen
 
 	const static int MAX_CYCLES = 69905;
 
-	static std::string msg;
+	RunUntil(m_SystemTicks + MAX_CYCLES);
+}
 
+void Emulator::RunUntil(uint64_t targetTick)
+{
+	// input and anything else the host touches can change between calls
+	m_EventsDispatched++;
 
-	for (int i = 0; i < MAX_CYCLES; i++)
+	// using T-cycles
+	while (m_SystemTicks < targetTick)
 	{
-
-
-		clock();
-
-		if(read(0xFF02) == 0x81) // serial reading
+		// nothing else can change state until the next event so the cpu doesnt need to stop.
+		// a write during an instruction can schedule something sooner which is why this gets checked every time
+		while (true)
 		{
-			char c = read(0xFF01);
-			msg += c;
-			std::cout << c << std::flush;
-			write(0xFF02, 0);
-			
+			uint64_t limit = std::min(scheduler.NextEventTime(), targetTick);
+			if (m_SystemTicks >= limit) break;
+
+			cpu.Execute(limit);
 		}
-	}
 
-	
+		DispatchEvents();
+	}
 }
 
 void Emulator::clock()
 {
-	// using T-cycles	
+	m_SystemTicks += cpu.Step() * 4;
+	DispatchEvents();
+}
 
+void Emulator::DispatchEvents()
+{
+	Scheduler::EventType type;
+	uint64_t when;
 
-	if (m_SystemTicks % 4 == 0)
+	while (scheduler.PopDue(m_SystemTicks, type, when))
 	{
-		cpu.Clock();
+		m_EventsDispatched++;
 
-		
+		switch (type)
+		{
+		case Scheduler::EventType::PPU:
+			ppu.OnEvent(when);
+			break;
+		case Scheduler::EventType::Timer:
+			timer.OnOverflow(when);
+			break;
+		case Scheduler::EventType::DMA:
+			dma.Complete();
+			break;
+		case Scheduler::EventType::Serial:
+			CompleteSerialTransfer();
+			break;
+		default:
+			break;
+		}
 	}
-	timer.tick(); // maybe pass in cpu to timer tick?
-	
-	if (dma.isTransferring())
-		dma.Tick();
-
-	ppu.tick();
-
+}
 
+void Emulator::CompleteSerialTransfer()
+{
+	// nothing is plugged in so all 1s get shifted in
+	if (serialOutput) *serialOutput << (char)serial_data[0] << std::flush;
 
-	m_SystemTicks++;
+	serial_data[0] = 0xFF;
+	serial_data[1] &= ~0x80;
+	cpu.RequestInterrupt(CPU::Interrupt::SERIAL);
 }
 
 
@@ -156,10 +319,14 @@ uint8_t Emulator::read(uint16_t address)
 {
 	//std::cout << "READ: " <<  (int)address << std::endl;
 
+	if (const uint8_t* page = memoryMap.GetReadPage(address))
+		return page[address & 0xFF];
+
 	if (address < 0x8000) {
 		return cartridge->ReadCart(address);
 	} else if (address < 0xA000) {
 		//PPU/VRAM
+		ppu.Sync(m_SystemTicks);
 		return ppu.VRAM_read(address);
     } else if (address < 0xC000) {
         //Cartridge RAM
@@ -199,7 +366,10 @@ uint8_t Emulator::read(uint16_t address)
 			return cpu.int_flag;
 
 		if (address >= 0xFF40 && address <= 0xFF4B)
+		{
+			ppu.Sync(m_SystemTicks);
 			return lcd.read(address);
+		}
 		
 		
 
@@ -220,10 +390,18 @@ void Emulator::write(uint16_t address, uint8_t data)
 {
 	//std::cout << "WRITE: " <<  (int)address << std::endl;
 
+	if (uint8_t* page = memoryMap.GetWritePage(address))
+	{
+		page[address & 0xFF] = data;
+		return;
+	}
+
 	if (address < 0x8000) {
         //ROM Data
         cartridge->WriteCart(address, data);
+		blockCache.RequestStop();
     } else if (address < 0xA000) {
+		ppu.Sync(m_SystemTicks);
 		ppu.VRAM_write(address, data);
     } else if (address < 0xC000) {
         //EXT-RAM
@@ -232,30 +410,47 @@ void Emulator::write(uint16_t address, uint8_t data)
     } else if (address < 0xE000) {
         //WRAM
         wram[address - 0xC000] = data;
+		blockCache.OnWrite(address);
     } else if (address < 0xFE00) {
         //reserved echo ram
     } else if (address < 0xFEA0) {
 		//OAM
 		if(dma.isTransferring()) return;
 		
+		ppu.Sync(m_SystemTicks);
 		ppu.OAM_write(address, data);
     } else if (address < 0xFF00) {
         //unusable reserved
     } else if (address < 0xFF80) {
         //IO Registers...
+		blockCache.RequestStop();
+
 		if (address == 0xFF00)
 			SetButtonState(data);
 		else if (address == 0xFF01)  serial_data[0] = data;
-		else if (address == 0xFF02) serial_data[1] = data;
+		else if (address == 0xFF02)
+		{
+			serial_data[1] = data;
+
+			// only the internal clock is emulated, 8 bits at 8192Hz
+			if ((data & 0x81) == 0x81)
+				scheduler.Schedule(Scheduler::EventType::Serial, m_SystemTicks + 8 * 512);
+		}
 		else if (address >= 0xFF04 && address <= 0xFF07) timer.write(address, data);
 		else if (address == 0xFF0F) cpu.int_flag = data;
-		else if (address >= 0xFF40 && address <= 0xFF4B) lcd.write(address, data);
+		else if (address >= 0xFF40 && address <= 0xFF4B)
+		{
+			ppu.Sync(m_SystemTicks);
+			lcd.write(address, data);
+		}
 
         
     } else if (address == 0xFFFF) {        
         cpu.int_enable = data;
+		blockCache.RequestStop();
     } else {
         hram[address - 0xFF80] = data;
+		blockCache.OnWrite(address);
     }
 }
 
@@ -279,7 +474,26 @@ void Emulator::write16(uint16_t address, uint16_t data)
 
 void Emulator::LoadROM(const std::string& filepath)
 {
-	cartridge = std::make_unique<Cartridge>(filepath);
+	// the new cart might be the same game and read the .sav back in
+	FlushSave();
+
+	cartridge = std::make_unique<Cartridge>(filepath, saveOptions);
+	cartridge->ConnectMemoryMap(&memoryMap);
+	cartridge->ConnectSystemClock(&m_SystemTicks);
 	romLoaded = true;
 
+	blockCache.Clear();
+	rewind.Clear();
+	m_ResetPoint.clear();
+}
+
+uint16_t Emulator::GetROMBank() const
+{
+	return cartridge->GetROMBank();
+
+}
+
+void Emulator::FlushSave()
+{
+	if (cartridge) cartridge->FlushSave();
 }
@@ -0,0 +1,59 @@
+#include "inputscript.h"
+
+#include <array>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+InputScript InputScript::Parse(std::istream& in)
+{
+	// in the order of Emulator::ButtonState::GetHeld
+	static constexpr std::array<const char*, 8> BUTTON_NAMES = { "a", "b", "select", "start", "right", "left", "up", "down" };
+
+	InputScript script;
+	std::string line;
+	int lineNumber = 0;
+
+	while (std::getline(in, line))
+	{
+		lineNumber++;
+
+		if (size_t comment = line.find('#'); comment != std::string::npos) line.resize(comment);
+
+		std::istringstream words(line);
+		Change change = {};
+		if (!(words >> change.frame))
+		{
+			// blank and comment only lines are fine, anything else is a mistake
+			std::string word;
+			words.clear();
+			if (words >> word) throw std::runtime_error("Input script line " + std::to_string(lineNumber) + " doesnt start with a frame");
+			continue;
+		}
+
+		std::string button;
+		while (words >> button)
+		{
+			int bit = 0;
+			while (bit < 8 && button != BUTTON_NAMES[bit]) bit++;
+
+			if (bit == 8) throw std::runtime_error("Unknown button \"" + button + "\" on input script line " + std::to_string(lineNumber));
+			change.buttons |= 1 << bit;
+		}
+
+		if (!script.changes.empty() && change.frame < script.changes.back().frame)
+			throw std::runtime_error("Input script goes back in time on line " + std::to_string(lineNumber));
+
+		script.changes.push_back(change);
+	}
+
+	return script;
+}
+
+InputScript InputScript::Load(const std::string& path)
+{
+	std::ifstream file(path);
+	if (!file.good()) throw std::runtime_error("Could not open input script " + path);
+
+	return Parse(file);
+}
@@ -0,0 +1,449 @@
+#include "jit.h"
+
+#include "emulator.h"
+
+#include <cstring>
+#include <functional>
+#include <vector>
+#include <initializer_list>
+
+#if GB_JIT_X64
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+using Op = CPU::Op;
+using RegType = CPU::RegType;
+
+// Compiled code keeps the cpu in rbx, a pointer to the system tick in r15, the tick it has to stop at in r12 and the
+// number of instructions run in r14. all callee saved so calling into handlers leaves them alone
+#ifdef _WIN32
+static constexpr uint8_t ARG0 = 1; // rcx
+static constexpr uint8_t ARG1 = 2; // rdx
+#else
+static constexpr uint8_t ARG0 = 7; // rdi
+static constexpr uint8_t ARG1 = 6; // rsi
+#endif
+
+static constexpr uint8_t RAX = 0;
+static constexpr uint8_t RCX = 1;
+static constexpr uint8_t RBX = 3;
+
+static constexpr uint32_t NO_OFFSET = UINT32_MAX;
+
+// where everything compiled code touches lives, relative to the cpu
+struct CPULayout
+{
+	std::array<uint32_t, 16> registers; // by RegType, NO_OFFSET for anything that isnt a plain register
+
+	uint32_t pc;
+	uint32_t cycles;
+	uint32_t currentDecoded;
+
+	uint32_t zeroResult;
+	uint32_t flagN;
+	uint32_t flagC;
+	uint32_t halfCarryMode;
+	uint32_t halfA;
+	uint32_t halfB;
+	uint32_t halfCarryIn;
+
+	uint8_t halfClear, halfSet, halfAdd, halfSub;
+
+	uint32_t emu;
+	uint32_t ticks; // relative to the emulator
+};
+
+// just the instructions compiled blocks need
+class X64Emitter
+{
+public:
+	std::vector<uint8_t> code;
+
+	void Bytes(std::initializer_list<uint8_t> bytes) { code.insert(code.end(), bytes); }
+
+	template<typename T>
+	void Value(T value)
+	{
+		uint8_t bytes[sizeof(T)];
+		memcpy(bytes, &value, sizeof(T));
+		code.insert(code.end(), bytes, bytes + sizeof(T));
+	}
+
+	// opcode with a [rbx + offset] operand, reg is the register in the other operand or the opcode extension
+	void CPUOperand(std::initializer_list<uint8_t> opcode, uint8_t reg, uint32_t offset)
+	{
+		Bytes(opcode);
+		Bytes({ (uint8_t)(0x80 | (reg << 3) | RBX) });
+		Value(offset);
+	}
+
+	void LoadByte(uint8_t reg, uint32_t offset) { CPUOperand({ 0x0F, 0xB6 }, reg, offset); }	// movzx reg, byte [rbx + offset]
+	void StoreByte(uint8_t reg, uint32_t offset) { CPUOperand({ 0x88 }, reg, offset); }		// mov [rbx + offset], reg
+
+	void StoreImm8(uint32_t offset, uint8_t value)
+	{
+		CPUOperand({ 0xC6 }, 0, offset);
+		Value(value);
+	}
+
+	void StoreImm16(uint32_t offset, uint16_t value)
+	{
+		CPUOperand({ 0x66, 0xC7 }, 0, offset);
+		Value(value);
+	}
+
+	void StorePointer(uint32_t offset, const void* pointer)
+	{
+		Bytes({ 0x48, 0xB8 });	// mov rax, pointer
+		Value(reinterpret_cast<uint64_t>(pointer));
+		CPUOperand({ 0x48, 0x89 }, RAX, offset);
+	}
+
+	// calls function with the cpu as its only argument
+	template<typename Function>
+	void Call(Function* function)
+	{
+		Bytes({ 0x48, 0x89, (uint8_t)(0xD8 | ARG0) });	// mov arg0, rbx
+		Bytes({ 0x48, 0xB8 });				// mov rax, function
+		Value(reinterpret_cast<uint64_t>(function));
+		Bytes({ 0xFF, 0xD0 });				// call rax
+	}
+
+	void AddTicks(uint8_t ticks) { Bytes({ 0x49, 0x83, 0x07, ticks }); } // add qword [r15], ticks
+
+	// what the handler left in m_Cycles
+	void AddCycleTicks(uint32_t cycles)
+	{
+		LoadByte(RAX, cycles);
+		Bytes({ 0xC1, 0xE0, 0x02 });	// shl eax, 2
+		Bytes({ 0x49, 0x01, 0x07 });	// add [r15], rax
+	}
+
+	void CountInstruction() { Bytes({ 0x41, 0xFF, 0xC6 }); }	// inc r14d
+	void SetStopFromResult() { Bytes({ 0x49, 0x89, 0xC4 }); }	// mov r12, rax
+
+	// cmp [r15], r12 then jae, returns where the jump offset is so it can be pointed at an exit once that exists
+	size_t ExitIfDue()
+	{
+		Bytes({ 0x4D, 0x39, 0x27, 0x0F, 0x83 });
+		size_t at = code.size();
+		Value<uint32_t>(0);
+		return at;
+	}
+
+	size_t Jump()
+	{
+		Bytes({ 0xE9 });
+		size_t at = code.size();
+		Value<uint32_t>(0);
+		return at;
+	}
+
+	void PatchJump(size_t at, size_t target)
+	{
+		int32_t offset = (int32_t)(target - (at + 4));
+		memcpy(&code[at], &offset, sizeof(offset));
+	}
+};
+
+// A, the 8-bit ALU op and the lazy flags the same way the handler would leave them
+static void EmitALU(X64Emitter& e, const CPULayout& cpu, Op op, const CPU::Operand& src, uint16_t immediate)
+{
+	bool arithmetic = op == Op::ADD || op == Op::SUB || op == Op::CP;
+	uint32_t a = cpu.registers[(int)RegType::A];
+	uint32_t source = src.mode == CPU::REG8 ? cpu.registers[(int)src.reg] : NO_OFFSET;
+
+	e.LoadByte(RAX, a);
+
+	if (arithmetic)
+	{
+		e.StoreByte(RAX, cpu.halfA);
+
+		if (source != NO_OFFSET)
+		{
+			e.LoadByte(RCX, source);
+			e.StoreByte(RCX, cpu.halfB);
+		}
+		else
+			e.StoreImm8(cpu.halfB, (uint8_t)immediate);
+
+		e.StoreImm8(cpu.halfCarryIn, 0);
+		e.StoreImm8(cpu.halfCarryMode, op == Op::ADD ? cpu.halfAdd : cpu.halfSub);
+	}
+
+	// x86 has the same op with al for each of them, +2 takes a byte in memory and +4 an immediate.
+	// CP is a SUB that doesnt keep the result in A, Z still comes from the result
+	uint8_t base = 0;
+	switch (op)
+	{
+	case Op::ADD: base = 0x00; break;
+	case Op::AND: base = 0x20; break;
+	case Op::XOR: base = 0x30; break;
+	case Op::OR: base = 0x08; break;
+	default: base = 0x28; break; // SUB, CP
+	}
+
+	if (source != NO_OFFSET)
+		e.CPUOperand({ (uint8_t)(base + 2) }, RAX, source);
+	else
+		e.Bytes({ (uint8_t)(base + 4), (uint8_t)immediate });
+
+	if (arithmetic)
+		e.CPUOperand({ 0x0F, 0x92 }, 0, cpu.flagC); // setb, the borrow for SUB and CP is A < value just like the handler
+	else
+		e.StoreImm8(cpu.flagC, 0);
+
+	if (op != Op::CP) e.StoreByte(RAX, a);
+	e.StoreByte(RAX, cpu.zeroResult);
+	e.StoreImm8(cpu.flagN, op == Op::SUB || op == Op::CP);
+
+	if (!arithmetic) e.StoreImm8(cpu.halfCarryMode, op == Op::AND ? cpu.halfSet : cpu.halfClear);
+}
+
+// returns false for anything that has to go through its handler.
+// RunNativeLockstep only compares registers, flags, interrupt state and the tick afterwards. that is enough because
+// nothing emitted here touches memory, an inline load or store needs that comparison extended to memory first
+static bool EmitInline(X64Emitter& e, const CPULayout& cpu, Op op, const CPU::Instruction& instruction, uint16_t immediate)
+{
+	const CPU::Operand& op1 = instruction.operand1;
+	const CPU::Operand& op2 = instruction.operand2;
+
+	auto isRegister = [&cpu](const CPU::Operand& operand, CPU::AddressingMode mode)
+	{
+		return operand.mode == mode && cpu.registers[(int)operand.reg] != NO_OFFSET;
+	};
+
+	switch (op)
+	{
+	case Op::NOP:
+		return true;
+
+	case Op::LD:
+		if (isRegister(op1, CPU::REG8) && isRegister(op2, CPU::REG8))
+		{
+			e.LoadByte(RAX, cpu.registers[(int)op2.reg]);
+			e.StoreByte(RAX, cpu.registers[(int)op1.reg]);
+			return true;
+		}
+		if (isRegister(op1, CPU::REG8) && op2.mode == CPU::IMM8)
+		{
+			e.StoreImm8(cpu.registers[(int)op1.reg], (uint8_t)immediate);
+			return true;
+		}
+		if (isRegister(op1, CPU::REG16) && op2.mode == CPU::IMM16)
+		{
+			e.StoreImm16(cpu.registers[(int)op1.reg], immediate);
+			return true;
+		}
+		return false;
+
+	case Op::INC:
+	case Op::DEC:
+	{
+		bool inc = op == Op::INC;
+
+		if (isRegister(op1, CPU::REG16))
+		{
+			e.CPUOperand({ 0x66, 0xFF }, inc ? 0 : 1, cpu.registers[(int)op1.reg]); // inc/dec word [rbx + offset]
+			return true;
+		}
+		if (!isRegister(op1, CPU::REG8)) return false;
+
+		uint32_t reg = cpu.registers[(int)op1.reg];
+
+		e.LoadByte(RAX, reg);
+		e.StoreByte(RAX, cpu.halfA);
+		e.StoreImm8(cpu.halfB, 1);
+		e.StoreImm8(cpu.halfCarryIn, 0);
+		e.StoreImm8(cpu.halfCarryMode, inc ? cpu.halfAdd : cpu.halfSub);
+		e.Bytes({ 0xFE, (uint8_t)(inc ? 0xC0 : 0xC8) }); // inc/dec al
+		e.StoreByte(RAX, reg);
+		e.StoreByte(RAX, cpu.zeroResult);
+		e.StoreImm8(cpu.flagN, !inc);
+		return true;
+	}
+
+	case Op::ADD:
+		// ADD HL,r16 is 16-bit
+		if (op1.mode != CPU::REG8 || !(isRegister(op2, CPU::REG8) || op2.mode == CPU::IMM8)) return false;
+		EmitALU(e, cpu, op, op2, immediate);
+		return true;
+
+	case Op::SUB:
+	case Op::AND:
+	case Op::XOR:
+	case Op::OR:
+	case Op::CP:
+		if (!(isRegister(op1, CPU::REG8) || op1.mode == CPU::IMM8)) return false;
+		EmitALU(e, cpu, op, op1, immediate);
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static bool IsCBInstruction(const CPU::Instruction* instruction)
+{
+	const CPU::Instruction* table = CPU::m_CBPrefixJumpTable.data();
+	return !std::less<>()(instruction, table) && std::less<>()(instruction, table + CPU::m_CBPrefixJumpTable.size());
+}
+
+Jit::~Jit()
+{
+	if (m_Buffer == nullptr) return;
+
+#ifdef _WIN32
+	VirtualFree(m_Buffer, 0, MEM_RELEASE);
+#else
+	munmap(m_Buffer, BUFFER_SIZE);
+#endif
+}
+
+CPU::NativeBlock Jit::Compile(CPU& cpu, uint16_t startPC, std::span<const CPU::DecodedInstruction> instructions)
+{
+	if (m_Buffer == nullptr)
+	{
+#ifdef _WIN32
+		void* memory = VirtualAlloc(nullptr, BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+		if (memory == nullptr) return nullptr;
+#else
+		void* memory = mmap(nullptr, BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED) return nullptr;
+#endif
+		m_Buffer = (uint8_t*)memory;
+	}
+
+	auto offset = [&cpu](const void* member) { return (uint32_t)((const uint8_t*)member - (const uint8_t*)&cpu); };
+
+	CPULayout layout;
+	layout.registers.fill(NO_OFFSET);
+	layout.registers[(int)RegType::A] = offset(&cpu.AF.hi);
+	layout.registers[(int)RegType::B] = offset(&cpu.BC.hi);
+	layout.registers[(int)RegType::C] = offset(&cpu.BC.lo);
+	layout.registers[(int)RegType::D] = offset(&cpu.DE.hi);
+	layout.registers[(int)RegType::E] = offset(&cpu.DE.lo);
+	layout.registers[(int)RegType::H] = offset(&cpu.HL.hi);
+	layout.registers[(int)RegType::L] = offset(&cpu.HL.lo);
+	layout.registers[(int)RegType::BC] = offset(&cpu.BC.reg);
+	layout.registers[(int)RegType::DE] = offset(&cpu.DE.reg);
+	layout.registers[(int)RegType::HL] = offset(&cpu.HL.reg);
+	layout.registers[(int)RegType::SP] = offset(&cpu.SP);
+
+	layout.pc = offset(&cpu.PC);
+	layout.cycles = offset(&cpu.m_Cycles);
+	layout.currentDecoded = offset(&cpu.m_CurrentDecoded);
+
+	layout.zeroResult = offset(&cpu.m_ZeroResult);
+	layout.flagN = offset(&cpu.m_FlagN);
+	layout.flagC = offset(&cpu.m_FlagC);
+	layout.halfCarryMode = offset(&cpu.m_HalfCarryMode);
+	layout.halfA = offset(&cpu.m_HalfA);
+	layout.halfB = offset(&cpu.m_HalfB);
+	layout.halfCarryIn = offset(&cpu.m_HalfCarryIn);
+
+	layout.halfClear = (uint8_t)CPU::HalfCarryMode::Clear;
+	layout.halfSet = (uint8_t)CPU::HalfCarryMode::Set;
+	layout.halfAdd = (uint8_t)CPU::HalfCarryMode::Add;
+	layout.halfSub = (uint8_t)CPU::HalfCarryMode::Sub;
+
+	layout.emu = offset(&cpu.emu);
+	layout.ticks = (uint32_t)((const uint8_t*)&cpu.emu->m_SystemTicks - (const uint8_t*)cpu.emu);
+
+	X64Emitter e;
+
+	e.Bytes({ 0x53, 0x41, 0x54, 0x41, 0x56, 0x41, 0x57 });	// push rbx, r12, r14, r15
+	e.Bytes({ 0x48, 0x83, 0xEC, 0x28 });				// sub rsp, 40 keeps the stack aligned and is the shadow space on windows
+	e.Bytes({ 0x48, 0x89, (uint8_t)(0xC3 | (ARG0 << 3)) });		// mov rbx, arg0
+	e.Bytes({ 0x49, 0x89, (uint8_t)(0xC4 | (ARG1 << 3)) });		// mov r12, arg1
+	e.CPUOperand({ 0x4C, 0x8B }, 7, layout.emu);			// mov r15, [rbx + emu]
+	e.Bytes({ 0x49, 0x81, 0xC7 });					// add r15, ticks
+	e.Value(layout.ticks);
+	e.Bytes({ 0x45, 0x31, 0xF6 });					// xor r14d, r14d
+
+	// every place the block can stop early and the PC it stops at
+	std::vector<std::pair<size_t, uint16_t>> exits;
+
+	uint16_t pc = startPC;
+	bool lastInline = false;
+
+	for (size_t i = 0; i < instructions.size(); i++)
+	{
+		const CPU::DecodedInstruction& decoded = instructions[i];
+		bool cb = IsCBInstruction(decoded.instruction);
+		size_t index = decoded.instruction - (cb ? CPU::m_CBPrefixJumpTable.data() : CPU::m_JumpTable.data());
+		Op op = (cb ? CPU::m_CBPrefixJumpTableInfo : CPU::m_JumpTableInfo)[index].op;
+
+		pc += decoded.length;
+		bool last = i + 1 == instructions.size();
+
+		lastInline = !cb && EmitInline(e, layout, op, *decoded.instruction, decoded.immediate);
+
+		if (lastInline)
+		{
+			e.AddTicks(decoded.instruction->cycles * 4);
+			e.CountInstruction();
+
+			// nothing inline can raise an interrupt or write memory so only the tick needs checking
+			if (!last) exits.push_back({ e.ExitIfDue(), pc });
+			continue;
+		}
+
+		// the handler sees the same PC and immediate it would in RunBlock
+		e.StoreImm16(layout.pc, pc);
+		e.StorePointer(layout.currentDecoded, &decoded);
+		e.Call((cb ? CPU::m_CBOpcodeFunctions : CPU::m_OpcodeFunctions)[index]);
+		e.AddCycleTicks(layout.cycles);
+		e.CountInstruction();
+
+		if (!last)
+		{
+			e.Call(&CPU::NativeStopTime);
+			e.SetStopFromResult();
+			exits.push_back({ e.ExitIfDue(), pc });
+		}
+	}
+
+	// a handler at the end might have jumped, PC is already where it should be then
+	if (lastInline) e.StoreImm16(layout.pc, pc);
+
+	size_t epilogue = e.code.size();
+	e.Bytes({ 0x44, 0x89, 0xF0 });					// mov eax, r14d
+	e.Bytes({ 0x48, 0x83, 0xC4, 0x28 });				// add rsp, 40
+	e.Bytes({ 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5C, 0x5B });	// pop r15, r14, r12, rbx
+	e.Bytes({ 0xC3 });						// ret
+
+	for (auto [at, exitPC] : exits)
+	{
+		e.PatchJump(at, e.code.size());
+		e.StoreImm16(layout.pc, exitPC);
+		e.PatchJump(e.Jump(), epilogue);
+	}
+
+	if (m_Used + e.code.size() > BUFFER_SIZE) return nullptr;
+
+	uint8_t* code = m_Buffer + m_Used;
+	memcpy(code, e.code.data(), e.code.size());
+	m_Used = (m_Used + e.code.size() + 15) & ~(size_t)15;
+
+	return reinterpret_cast<CPU::NativeBlock>(code);
+}
+
+#else
+
+Jit::~Jit()
+{
+}
+
+CPU::NativeBlock Jit::Compile(CPU& cpu, uint16_t startPC, std::span<const CPU::DecodedInstruction> instructions)
+{
+	return nullptr;
+}
+
+#endif
@@ -0,0 +1,111 @@
+#include "mappedsave.h"
+
+#include <iostream>
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+std::unique_ptr<MappedSave> MappedSave::Open(const std::string& fileName, size_t size, std::chrono::milliseconds syncInterval)
+{
+	std::unique_ptr<MappedSave> save(new MappedSave());
+	save->m_Size = size;
+	save->m_SyncInterval = syncInterval;
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return nullptr;
+	save->m_File = file;
+
+	// the mapping grows the file if it is too small, a bigger file is left as is and only the start is mapped
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx(file, &fileSize);
+	uint64_t mappingSize = std::max<uint64_t>(fileSize.QuadPart, size);
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, (DWORD)(mappingSize >> 32), (DWORD)mappingSize, nullptr);
+	if (!mapping) return nullptr;
+	save->m_Mapping = mapping;
+
+	save->m_Data = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+	if (!save->m_Data) return nullptr;
+#else
+	int file = open(fileName.c_str(), O_RDWR | O_CREAT, 0644);
+	if (file < 0) return nullptr;
+	save->m_File = file;
+
+	// new files (and short ones from older versions) are zero filled up to the RAM size
+	struct stat info;
+	if (fstat(file, &info) != 0) return nullptr;
+	if ((size_t)info.st_size < size && ftruncate(file, size) != 0) return nullptr;
+
+	void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+	if (data == MAP_FAILED) return nullptr;
+	save->m_Data = (uint8_t*)data;
+#endif
+
+	if (syncInterval.count() > 0)
+		save->m_Thread = std::thread(&MappedSave::Run, save.get());
+
+	return save;
+}
+
+MappedSave::~MappedSave()
+{
+	if (m_Thread.joinable())
+	{
+		{
+			std::lock_guard lock(m_Mutex);
+			m_Stopping = true;
+		}
+
+		m_Wake.notify_one();
+		m_Thread.join();
+	}
+
+#ifdef _WIN32
+	if (m_Data)
+	{
+		FlushViewOfFile(m_Data, m_Size);
+		UnmapViewOfFile(m_Data);
+	}
+	if (m_Mapping) CloseHandle(m_Mapping);
+	if (m_File) CloseHandle(m_File);
+#else
+	if (m_Data)
+	{
+		msync(m_Data, m_Size, MS_SYNC);
+		munmap(m_Data, m_Size);
+	}
+	if (m_File >= 0) close(m_File);
+#endif
+}
+
+void MappedSave::Flush()
+{
+#ifdef _WIN32
+	if (!FlushViewOfFile(m_Data, m_Size))
+#else
+	if (msync(m_Data, m_Size, MS_SYNC) != 0)
+#endif
+		std::cerr << "Failed to sync save file" << std::endl;
+}
+
+void MappedSave::Run()
+{
+	std::unique_lock lock(m_Mutex);
+
+	while (!m_Wake.wait_for(lock, m_SyncInterval, [this] { return m_Stopping; }))
+	{
+		lock.unlock();
+		Flush();
+		lock.lock();
+	}
+}
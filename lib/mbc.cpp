@@ -2,6 +2,7 @@
 #include "cartridge.h"
 
 #include <cassert>
+#include <algorithm>
 #include <stdexcept>
 #include <cstring>
 #include <iostream>
@@ -22,100 +23,166 @@ static uint32_t GetRAMSize(uint8_t ramByte)
 	case 4: return 128 * 1024;
 	case 5: return 64 * 1024;
 	}
+	return 0;
 }
 
 
-MBC::MBC(uint8_t* cartData)
+MBC::MBC(const uint8_t* cartData)
 {
 	this->cartData = cartData;
 }
 
-MBC0::MBC0(uint8_t* cartData)
-	: MBC(cartData)
+void MBC::ConnectMemoryMap(MemoryMap* memoryMap, size_t romSize)
 {
-	memset(externalRam.data(), 0, 0x2000);
-}
+	this->memoryMap = memoryMap;
+	this->romSize = romSize;
 
-uint8_t MBC0::read(uint16_t address)
-{
-	if (address < 0x8000)
-		return cartData[address];
-	else
-		return externalRam[address - 0xA000];
+	// whatever the previous cartridge left mapped
+	memoryMap->Unmap(0x0000, 0x8000);
+	memoryMap->Unmap(0xA000, 0x2000);
+
+	MapPages();
 }
 
-void MBC0::write(uint16_t address, uint8_t data)
+void MBC::MapPages()
 {
-	if (address >= 0xA000)
-		externalRam[address - 0xA000] = data;
-}
+	if (!memoryMap) return;
 
+	MapROMBank(1);
+}
 
-MBC1::MBC1(uint8_t* cartData, const CartridgeHeader& header)
-	: MBC(cartData)
+void MBC::MapROMBank(uint32_t bank)
 {
-	// MBC1 only supports up to 32KiB of external RAM
-	assert(header.ramSize <= 3);
+	memoryMap->Map(0x0000, 0x4000, cartData);
 
-	size_t ramSize = 0;
-	if (header.ramSize == 2) ramSize = 8 * 1024;
-	else if (header.ramSize == 3) ramSize = 32 * 1024;
+	// banks past the end of the ROM are left to read()
+	uint32_t offset = bank * 0x4000;
+	if (offset + 0x4000 <= romSize)
+		memoryMap->Map(0x4000, 0x4000, cartData + offset);
+	else
+		memoryMap->Unmap(0x4000, 0x4000);
+}
 
-	externalRAM = new uint8_t[ramSize];
-	externalRAMSize = ramSize;
+void MBC::MapRAMBank(uint8_t* ram, size_t ramSize, uint32_t bank, bool enabled)
+{
+	uint32_t offset = bank * 0x2000;
+	if (enabled && offset + 0x2000 <= ramSize)
+		memoryMap->Map(0xA000, 0x2000, ram + offset, !saveManager);
+	else
+		memoryMap->Unmap(0xA000, 0x2000);
+}
 
-	title = header.title;
+uint8_t* MBC::OpenRAM(const std::string& title, size_t ramSize, bool requiresSave, const SaveOptions& saveOptions, std::span<uint8_t> footer)
+{
+	std::string fileName = title + ".sav";
+	size_t saveSize = ramSize + footer.size();
 
+	savedRAMSize = ramSize;
+	std::fill(footer.begin(), footer.end(), 0);
 
-	requiresSave = header.cartridgeType != 1;
+	if (requiresSave && saveSize > 0 && saveOptions.mode == SaveOptions::Mode::Mapped)
+	{
+		mappedSave = MappedSave::Open(fileName, saveSize, saveOptions.syncInterval);
+		if (mappedSave)
+		{
+			memcpy(footer.data(), mappedSave->GetData() + ramSize, footer.size());
+			return mappedSave->GetData();
+		}
 
+		std::cerr << "Could not map " << fileName << ", saving through the writer instead" << std::endl;
+	}
 
-	std::string fileName = title + ".sav";
+	ramStorage = std::make_unique<uint8_t[]>(ramSize);
+	uint8_t* ram = ramStorage.get();
 
-	if (std::filesystem::exists(fileName))
+	if (saveOptions.mode != SaveOptions::Mode::None && std::filesystem::exists(fileName))
 	{
-		std::ifstream ifs(fileName);
+		std::ifstream ifs(fileName, std::ios::binary);
 
-		ifs.read((char*)externalRAM, ramSize);
+		ifs.read((char*)ram, ramSize);
+		ifs.read((char*)footer.data(), footer.size());
 	}
 	else
-		memset((char*)externalRAM, 0, ramSize);
+		memset((char*)ram, 0, ramSize);
 
+	if (requiresSave && saveSize > 0 && saveOptions.mode != SaveOptions::Mode::None)
+		saveManager = std::make_unique<SaveManager>(fileName, ram, ramSize);
+
+	return ram;
+}
 
-	if (requiresSave)
-		ofs.open(fileName);
+void MBC::LoadRAM(StateReader& reader, uint8_t* ram, size_t size)
+{
+	const uint8_t* saved = reader.ReadView(size);
 
+	// going back and forth between states usually doesnt touch the RAM, and then the .sav doesnt need rewriting
+	if (memcmp(ram, saved, size) == 0) return;
 
-	cartDataSize = 32768 * (1 << header.romSize);
-	
+	if (saveManager) saveManager->WriteBlock(0, saved, size);
+	else memcpy(ram, saved, size);
 }
 
-MBC1::~MBC1()
+void MBC::WriteFooter(std::span<const uint8_t> footer)
 {
-	save();
-	delete[] externalRAM;
+	if (saveManager) saveManager->SetFooter(footer.data(), footer.size());
+	if (mappedSave) memcpy(mappedSave->GetData() + savedRAMSize, footer.data(), footer.size());
 }
 
-uint8_t MBC1::read(uint16_t address)
+MBC0::MBC0(const uint8_t* cartData)
+	: MBC(cartData)
 {
-	if (address < 0x4000)
-		return cartData[address];
-	
-	if ((address & 0xE000) == 0xA000)
-	{
-		if (!ramEnabled) return 0xFF;
+	memset(externalRam.data(), 0, 0x2000);
+}
 
-		uint8_t ramBank = bankingMode == 0 ? 0 : ramBankNumber;
-		int effectiveAddress = (address - 0xA000) + ramBank * 0x2000;
+void MBC0::write(uint16_t address, uint8_t data)
+{
+	if (address >= 0xA000)
+		externalRam[address - 0xA000] = data;
+}
+
+void MBC0::SaveState(StateWriter& writer)
+{
+	writer.BeginChunk(STATE_ID, STATE_VERSION);
+	SaveRAM(writer, externalRam.data(), externalRam.size());
+	writer.EndChunk();
+}
+
+void MBC0::LoadState(StateReader& reader)
+{
+	reader.OpenChunk(STATE_ID, STATE_VERSION);
+	LoadRAM(reader, externalRam.data(), externalRam.size());
+}
+
+void MBC0::MapPages()
+{
+	if (!memoryMap) return;
+
+	MapROMBank(1);
+	memoryMap->Map(0xA000, 0x2000, externalRam.data(), true); // nothing to save so writes can go straight in
+}
+
+
+MBC1::MBC1(const uint8_t* cartData, const CartridgeHeader& header, const SaveOptions& saveOptions)
+	: MBC(cartData)
+{
+	// MBC1 only supports up to 32KiB of external RAM
+	assert(header.ramSize <= 3);
+
+	size_t ramSize = 0;
+	if (header.ramSize == 2) ramSize = 8 * 1024;
+	else if (header.ramSize == 3) ramSize = 32 * 1024;
+
+	externalRAMSize = ramSize;
+
+	title = header.title;
 
-		return externalRAM[effectiveAddress];
-	}
 
-	int effectiveAddress1 = (address - 0x4000) + romBankNumber * 0x4000;
+	requiresSave = header.cartridgeType != 1;
 
-	assert(effectiveAddress1 < cartDataSize);
+	externalRAM = OpenRAM(title, ramSize, requiresSave, saveOptions);
 
-	return cartData[effectiveAddress1];
+	cartDataSize = 32768 * (1 << header.romSize);
+	SetROMBankMask(header.romSize);
 }
 
 void MBC1::write(uint16_t address, uint8_t data)
@@ -127,7 +194,7 @@ void MBC1::write(uint16_t address, uint8_t data)
 	{
 		if (data == 0) data = 1;
 		data &= 0b11111;
-		romBankNumber = data;
+		romBankNumber = data & romBankMask;
 	}
 
 	else if ((address & 0xE000) == 0x4000)
@@ -147,79 +214,93 @@ void MBC1::write(uint16_t address, uint8_t data)
 			uint8_t ramBank = bankingMode == 0 ? 0 : ramBankNumber;
 			int effectiveAddress = (address - 0xA000) + ramBank * 0x2000;
 
-			externalRAM[effectiveAddress] = data;
-			save();
+			WriteRAM(externalRAM, effectiveAddress, data);
 		}
 	}
 }
 
-void MBC1::save()
+struct MBC1State
 {
-	if (!requiresSave) return;
-
-
-	if (!ofs.is_open()) throw std::runtime_error("Save file could not be open");
+	bool ramEnabled;
+	uint8_t romBankNumber;
+	uint8_t ramBankNumber;
+	uint8_t bankingMode;
+};
 
-	ofs.write((char*)externalRAM, externalRAMSize);
+void MBC1::SaveState(StateWriter& writer)
+{
+	MBC1State state = { ramEnabled, romBankNumber, ramBankNumber, bankingMode };
 
+	writer.BeginChunk(STATE_ID, STATE_VERSION);
+	writer.Write(state);
+	SaveRAM(writer, externalRAM, externalRAMSize);
+	writer.EndChunk();
 }
 
-
-MBC2::MBC2(uint8_t* cartData, const CartridgeHeader& header)
-	: MBC(cartData), ram({})
+void MBC1::LoadState(StateReader& reader)
 {
-	requiresSave = header.cartridgeType == 6;
-	title = header.title;
+	MBC1State state;
 
+	reader.OpenChunk(STATE_ID, STATE_VERSION);
+	reader.Read(state);
 
+	ramEnabled = state.ramEnabled;
+	romBankNumber = state.romBankNumber & romBankMask;
+	ramBankNumber = state.ramBankNumber & 0b11;
+	bankingMode = state.bankingMode & 0b1;
 
-	std::string fileName = title + ".sav";
+	LoadRAM(reader, externalRAM, externalRAMSize);
+}
 
-	if (std::filesystem::exists(fileName))
-	{
-		std::ifstream ifs(fileName);
+void MBC1::MapPages()
+{
+	if (!memoryMap) return;
 
-		ifs.read((char*)ram.data(), ram.size());
-	}
-	else
-		memset((char*)ram.data(), 0, ram.size());
+	MapROMBank(romBankNumber);
+	MapRAMBank(externalRAM, externalRAMSize, bankingMode == 0 ? 0 : ramBankNumber, ramEnabled);
+}
 
 
-	if (requiresSave)
-		ofs.open(fileName);
+MBC2::MBC2(const uint8_t* cartData, const CartridgeHeader& header, const SaveOptions& saveOptions)
+	: MBC(cartData)
+{
+	requiresSave = header.cartridgeType == 6;
+	title = header.title;
 
+	SetROMBankMask(header.romSize);
 
+	ram = OpenRAM(title, RAM_SIZE, requiresSave, saveOptions);
 }
 
-MBC2::~MBC2()
+
+struct MBC2State
 {
-	save();
-}
+	uint8_t romBankNumber;
+	bool ramEnabled;
+};
 
-uint8_t MBC2::read(uint16_t address)
+void MBC2::SaveState(StateWriter& writer)
 {
-	if (address < 0x4000)
-		return cartData[address];
-	else if (address < 0x8000)
-	{
-		int effectiveAddress = (address - 0x4000) + romBankNumber * 0x4000;
-		assert(effectiveAddress < 262144);
-		return cartData[effectiveAddress];
-	}
+	MBC2State state = { (uint8_t)romBankNumber, ramEnabled };
 
-	else if (address >= 0xA000 && address < 0xA200)
-	{
-		if (!ramEnabled) return 0xBB;
-		return (ram[address - 0xA000] & 0xF) | 0xF0;
-	}
-	else if (address >= 0xA200 && address < 0xC000)
-	{
-		if (!ramEnabled) return 0xBB;
-		return (ram[address & 0x1FF] & 0xF) | 0xF0; // lower 9 bits only
-	}
-	__debugbreak();
+	writer.BeginChunk(STATE_ID, STATE_VERSION);
+	writer.Write(state);
+	SaveRAM(writer, ram, RAM_SIZE);
+	writer.EndChunk();
 }
 
+void MBC2::LoadState(StateReader& reader)
+{
+	MBC2State state;
+
+	reader.OpenChunk(STATE_ID, STATE_VERSION);
+	reader.Read(state);
+
+	romBankNumber = state.romBankNumber & romBankMask;
+	ramEnabled = state.ramEnabled;
+
+	LoadRAM(reader, ram, RAM_SIZE);
+}
 
 void MBC2::write(uint16_t address, uint8_t data)
 {
@@ -236,6 +317,7 @@ void MBC2::write(uint16_t address, uint8_t data)
 		{
 			romBankNumber = data & 0xF;
 			if (romBankNumber == 0) romBankNumber = 1;
+			romBankNumber &= romBankMask;
 		}
 	}
 
@@ -243,160 +325,356 @@ void MBC2::write(uint16_t address, uint8_t data)
 	{
 		if (!ramEnabled) return;
 		int effectiveAddress = address - 0xA000;
-		ram[effectiveAddress] = data;
-		save();
+		WriteRAM(ram, effectiveAddress, data);
 	}
 	else if (address >= 0xA200 && address < 0xC000)
 	{
 		if (!ramEnabled) return;
-		ram[address & 0x1FF] = data & 0xF;
-		save();
+		WriteRAM(ram, address & 0x1FF, data & 0xF);
 	}
 
 }
 
-void MBC2::save()
+
+void RTC::ConnectSystemClock(const uint64_t* systemTicks)
+{
+	this->systemTicks = systemTicks;
+	lastSync = *systemTicks;
+}
+
+void RTC::Sync()
 {
-	if (!requiresSave) return;
+	if (!systemTicks) return;
 
-	if (!ofs.is_open()) throw std::runtime_error("Save file could not be open");
+	uint64_t now = *systemTicks;
 
-	ofs.write((char*)ram.data(), ram.size());
+	// the emulator got reset, nothing to catch up on
+	if (now < lastSync)
+	{
+		lastSync = now;
+		return;
+	}
 
+	uint64_t elapsed = now - lastSync;
+	lastSync = now;
+
+	if (IsHalted()) return;
+
+	subSecondCycles += elapsed;
+	uint64_t seconds = subSecondCycles / CYCLES_PER_SECOND;
+	subSecondCycles %= CYCLES_PER_SECOND;
+
+	AdvanceSeconds(seconds);
 }
 
+void RTC::Tick()
+{
+	// each counter only carries when it hits its normal limit, a value written out of range counts up to the
+	// top of its bits and wraps to 0 without carrying
+	live.S = (live.S + 1) & 0x3F;
+	if (live.S != 60) return;
+	live.S = 0;
+
+	live.M = (live.M + 1) & 0x3F;
+	if (live.M != 60) return;
+	live.M = 0;
+
+	live.H = (live.H + 1) & 0x1F;
+	if (live.H != 24) return;
+	live.H = 0;
+
+	uint16_t days = live.DL | ((live.DH & 1) << 8);
+	days = (days + 1) & 0x1FF;
+	if (days == 0) live.DH |= (1 << 7);
+
+	live.DL = days & 0xFF;
+	live.DH = (live.DH & ~1) | (days >> 8);
+}
 
-void RTC::SetActive(uint8_t reg)
+void RTC::AdvanceSeconds(uint64_t seconds)
 {
-	switch (reg)
+	if (IsHalted()) return;
+
+	while (seconds > 0 && (live.S >= 60 || live.M >= 60 || live.H >= 24))
 	{
-	case 0x08: active = &S; break;
-	case 0x09: active = &M; break;
-	case 0x0A: active = &H; break;
-	case 0x0B: active = &DL; break;
-	case 0x0C: active = &DH; break;
-	//default: active = nullptr;
+		Tick();
+		seconds--;
 	}
+
+	if (seconds == 0) return;
+
+	uint64_t days = live.DL | ((live.DH & 1) << 8);
+	uint64_t total = live.S + live.M * 60 + live.H * 3600 + days * 86400 + seconds;
+
+	live.S = total % 60;
+	live.M = (total / 60) % 60;
+	live.H = (total / 3600) % 24;
+
+	days = total / 86400;
+	if (days >= 512) live.DH |= (1 << 7);
+	days %= 512;
+
+	live.DL = days & 0xFF;
+	live.DH = (live.DH & ~1) | (uint8_t)(days >> 8);
 }
 
-void RTC::WriteActive(uint8_t data)
+uint8_t RTC::Read(uint8_t reg) const
 {
-	if (IsHalted()) return;
-	*active = data;
+	switch (reg)
+	{
+	case 0x08: return latched.S;
+	case 0x09: return latched.M;
+	case 0x0A: return latched.H;
+	case 0x0B: return latched.DL;
+	case 0x0C: return latched.DH;
+	}
+	return 0xFF;
 }
 
-uint8_t RTC::GetActive()
+void RTC::Write(uint8_t reg, uint8_t data)
 {
-	return *active;
+	// time up to now counts with the old values (and the old halt bit)
+	Sync();
+
+	switch (reg)
+	{
+	case 0x08:
+		live.S = data & 0x3F;
+		subSecondCycles = 0; // writing the seconds restarts the current second
+		break;
+	case 0x09: live.M = data & 0x3F; break;
+	case 0x0A: live.H = data & 0x1F; break;
+	case 0x0B: live.DL = data; break;
+	case 0x0C: live.DH = data & 0xC1; break;
+	}
 }
 
-void RTC::LatchRegisters(uint8_t data)
+void RTC::WriteLatch(uint8_t data)
 {
 	if (latchRegister == 0 && data == 1)
 	{
-		using namespace std::chrono;
-		auto currentTime = std::chrono::system_clock::now();
+		Sync();
+		latched = live;
+	}
 
-		S = time_point_cast<seconds>(currentTime).time_since_epoch().count() % 60;
-		M = time_point_cast<minutes>(currentTime).time_since_epoch().count() % 60;
-		H = time_point_cast<hours>(currentTime).time_since_epoch().count() % 24;
+	latchRegister = data;
+}
 
-		uint16_t dayCounter = time_point_cast<days>(currentTime).time_since_epoch().count() % 512;
+struct RTCState
+{
+	uint8_t live[5];
+	uint8_t latched[5];
+	uint8_t latchRegister;
+	uint8_t unused[5] = {};
+	uint64_t subSecondCycles;
+	uint64_t lastSync;
+};
+
+void RTC::SaveState(StateWriter& writer)
+{
+	RTCState state;
+	memcpy(state.live, &live, 5);
+	memcpy(state.latched, &latched, 5);
+	state.latchRegister = latchRegister;
+	state.subSecondCycles = subSecondCycles;
+	state.lastSync = lastSync;
+
+	writer.Write(state);
+}
 
-		DL = dayCounter & 0xFF;
-		uint8_t dhUpperBit = !!(dayCounter & (1 << 8));
-		
-		if (dhUpperBit) DH |= 1;
-		else DH &= ~(1);
+void RTC::LoadState(StateReader& reader)
+{
+	RTCState state;
+	reader.Read(state);
+
+	memcpy(&live, state.live, 5);
+	memcpy(&latched, state.latched, 5);
+	latchRegister = state.latchRegister;
+	subSecondCycles = state.subSecondCycles % CYCLES_PER_SECOND;
+	lastSync = state.lastSync;
+}
 
-		if (dayCounter == 0) // wrapped from 511 -> 0
-			DH |= (1 << 7);
-	}
+static void WriteLE(uint8_t* out, uint64_t value, int bytes)
+{
+	for (int i = 0; i < bytes; i++)
+		out[i] = (uint8_t)(value >> (i * 8));
+}
 
-	latchRegister = data;
-	
+static uint64_t ReadLE(const uint8_t* in, int bytes)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < bytes; i++)
+		value |= (uint64_t)in[i] << (i * 8);
+	return value;
 }
 
-bool RTC::IsHalted()
+void RTC::SaveFooter(uint8_t* footer)
 {
-	return !!(DH & (1 << 6));
+	SaveFooterRegisters(footer);
+	StampFooter(footer);
 }
 
-uint8_t RTC::GetDayCounterCarry()
+void RTC::SaveFooterRegisters(uint8_t* footer)
 {
-	return DH & (1 << 7);
+	Sync();
+
+	const Registers* sets[] = { &live, &latched };
+	for (int set = 0; set < 2; set++)
+	{
+		const Registers& r = *sets[set];
+		uint8_t* out = footer + set * 20;
+
+		WriteLE(out + 0, r.S, 4);
+		WriteLE(out + 4, r.M, 4);
+		WriteLE(out + 8, r.H, 4);
+		WriteLE(out + 12, r.DL, 4);
+		WriteLE(out + 16, r.DH, 4);
+	}
 }
 
+void RTC::StampFooter(uint8_t* footer)
+{
+	int64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	WriteLE(footer + 40, (uint64_t)now, 8);
+}
+
+void RTC::LoadFooter(const uint8_t* footer, bool catchUp)
+{
+	// some emulators only write a 32 bit timestamp (44 bytes), the top half is zero then which reads the same
+	uint64_t savedAt = ReadLE(footer + 40, 8);
+	int64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+	if (savedAt == 0)
+	{
+		// no clock saved yet, start it at the hosts time of day if it is allowed to look at it
+		if (catchUp)
+		{
+			live.S = now % 60;
+			live.M = (now / 60) % 60;
+			live.H = (now / 3600) % 24;
+			latched = live;
+		}
+		return;
+	}
 
-MBC3::MBC3(uint8_t* cartData, const CartridgeHeader header, bool requiresSave = false)
+	Registers* sets[] = { &live, &latched };
+	for (int set = 0; set < 2; set++)
+	{
+		Registers& r = *sets[set];
+		const uint8_t* in = footer + set * 20;
+
+		r.S = ReadLE(in + 0, 4) & 0x3F;
+		r.M = ReadLE(in + 4, 4) & 0x3F;
+		r.H = ReadLE(in + 8, 4) & 0x1F;
+		r.DL = ReadLE(in + 12, 4) & 0xFF;
+		r.DH = ReadLE(in + 16, 4) & 0xC1;
+	}
+
+	if (catchUp && now > (int64_t)savedAt)
+		AdvanceSeconds(now - savedAt);
+}
+
+
+MBC3::MBC3(const uint8_t* cartData, const CartridgeHeader header, bool requiresSave, const SaveOptions& saveOptions)
 	: MBC(cartData), requiresSave(requiresSave)
 {
 	ramSize = GetRAMSize(header.ramSize);
-	ram = new uint8_t[ramSize];
+	SetROMBankMask(header.romSize);
 
 	title = header.title;
-	
-	std::string fileName = title + ".sav";
 
+	hasTimer = header.cartridgeType == 0x0F || header.cartridgeType == 0x10;
 
-	if (std::filesystem::exists(fileName))
+	std::array<uint8_t, RTC::SAVE_FOOTER_SIZE> footer = {};
+	ram = OpenRAM(title, ramSize, requiresSave, saveOptions, hasTimer ? std::span<uint8_t>(footer) : std::span<uint8_t>());
+
+	if (hasTimer)
 	{
-		std::ifstream ifs(fileName);
+		rtc.LoadFooter(footer.data(), saveOptions.rtcCatchUp);
 
-		ifs.read((char*)ram, ramSize);
+		// the timestamp is put on by the writer thread when it actually writes, the host clock stays off the bus
+		if (saveManager) saveManager->SetFooterStamp([](std::vector<uint8_t>& footer) { RTC::StampFooter(footer.data()); });
+
+		// the writer has to have the clock before the first RAM write goes out or the .sav loses it
+		SaveRTC();
 	}
-	else
-		memset((char*)ram, 0, ramSize);
+}
 
+MBC3::~MBC3()
+{
+	// before the base class stops the save writer
+	SaveRTC();
+}
 
-	if (requiresSave)
-		ofs.open(fileName);
+void MBC3::SaveRTC()
+{
+	if (!hasTimer) return;
 
-		
+	std::array<uint8_t, RTC::SAVE_FOOTER_SIZE> footer;
+	rtc.SaveFooter(footer.data());
+	WriteFooter(footer);
 }
 
-MBC3::~MBC3()
+void MBC3::RefreshRTCFooter()
 {
-	save();
-	delete[] ram;
+	std::array<uint8_t, RTC::SAVE_FOOTER_SIZE> footer = {};
+	rtc.SaveFooterRegisters(footer.data());
+
+	if (footer == writerFooter) return;
+
+	writerFooter = footer;
+	WriteFooter(footer);
 }
 
-void MBC3::save()
+void MBC3::FlushSave()
 {
+	SaveRTC();
+	MBC::FlushSave();
+}
 
-	if (!requiresSave) return;
 
-	if (!ofs.is_open()) throw std::runtime_error("Save file could not be open");
-	ofs.seekp(0);
-	ofs.write((char*)ram, ramSize);
 
-	if (!ofs.good()) throw std::runtime_error("Failed to write");
-}
+struct MBC3State
+{
+	uint8_t romBankNumber;
+	uint8_t ramBankNumber;
+	uint8_t registerSelect;
+	bool ramAndTimerEnable;
+};
+
+void MBC3::SaveState(StateWriter& writer)
+{
+	MBC3State state = { romBankNumber, ramBankNumber, registerSelect, ramAndTimerEnable };
 
+	writer.BeginChunk(STATE_ID, STATE_VERSION);
+	writer.Write(state);
+	rtc.SaveState(writer);
+	SaveRAM(writer, ram, ramSize);
+	writer.EndChunk();
+}
 
-uint8_t MBC3::read(uint16_t address)
+void MBC3::LoadState(StateReader& reader)
 {
-	if (address < 0x4000)
-		return cartData[address];
-	else if (address < 0x8000)
-	{
-		int effectiveAddress = (address - 0x4000) + romBankNumber * 0x4000;
-		return cartData[effectiveAddress];
-	}
-	else if (address >= 0xA000 && address <= 0xBFFF)
-	{
-		if (!ramAndTimerEnable) return 0xFF;
+	MBC3State state;
 
-		if (registerSelect < 8)
-		{
-			int effectiveAddress = (address - 0xA000) + ramBankNumber * 0x2000;
-			return ram[effectiveAddress];
-		}
+	reader.OpenChunk(STATE_ID, STATE_VERSION);
+	reader.Read(state);
 
-		return rtc.GetActive();
-	}
+	romBankNumber = state.romBankNumber & romBankMask;
+	ramBankNumber = state.ramBankNumber % std::max<uint32_t>(1, ramSize / 0x2000);
+	registerSelect = state.registerSelect & 0xF;
+	ramAndTimerEnable = state.ramAndTimerEnable;
 
-	return 0xFF;
+	rtc.LoadState(reader);
+	LoadRAM(reader, ram, ramSize);
+}
+
+void MBC3::MapPages()
+{
+	if (!memoryMap) return;
+
+	MapROMBank(romBankNumber);
+	MapRAMBank(ram, ramSize, ramBankNumber, ramAndTimerEnable && registerSelect < 8); // RTC registers need read()
 }
 
 void MBC3::write(uint16_t address, uint8_t data)
@@ -407,22 +685,23 @@ void MBC3::write(uint16_t address, uint8_t data)
 	{
 		romBankNumber = data & 0x7F;
 		if (romBankNumber == 0) romBankNumber = 1;
+		romBankNumber &= romBankMask;
 	}
 	else if (address < 0x6000)
 	{
 		registerSelect = data & 0xF;
 		if (registerSelect < 8)
 		{
-			ramBankNumber = data & 0xF;
+			// banks past the end of the RAM wrap around
+			ramBankNumber = (data & 0x7) % std::max<uint32_t>(1, ramSize / 0x2000);
 			return;
 		}
 
-		rtc.SetActive(registerSelect);
-		
 	}
 	else if (address < 0x8000)
 	{
-		rtc.LatchRegisters(data);
+		// games latch every frame, the clock only goes in the .sav on FlushSave and when the cart is unloaded
+		rtc.WriteLatch(data);
 	}
 	else if (address >= 0xA000 && address <= 0xC000)
 	{
@@ -430,33 +709,132 @@ void MBC3::write(uint16_t address, uint8_t data)
 
 		if (registerSelect < 8)
 		{
+			if (ramSize == 0) return;
+
 			int effectiveAddress = (address - 0xA000) + ramBankNumber * 0x2000;
-			ram[effectiveAddress] = data;
-			save();
+			WriteRAM(ram, effectiveAddress, data);
+			if (hasTimer && saveManager) RefreshRTCFooter();
 			return;
 		}
 
-		rtc.WriteActive(data);
+		if (registerSelect <= 0x0C) rtc.Write(registerSelect, data);
 	}
 }
 
-std::unique_ptr<MBC> CreateMBCByType(const CartridgeHeader& header, uint8_t* cartData)
+MBC5::MBC5(const uint8_t* cartData, const CartridgeHeader& header, const SaveOptions& saveOptions)
+	: MBC(cartData)
+{
+	hasRumble = header.cartridgeType >= 0x1C;
+	bool requiresSave = header.cartridgeType == 0x1B || header.cartridgeType == 0x1E;
+
+	SetROMBankMask(header.romSize);
+	for (uint32_t bank = 0; bank < romBanks.size(); bank++)
+		romBanks[bank] = cartData + (bank & romBankMask) * 0x4000;
+
+	ramSize = GetRAMSize(header.ramSize);
+	title = header.title;
+
+	ram = OpenRAM(title, ramSize, requiresSave, saveOptions);
+
+	uint32_t ramBankCount = std::max<uint32_t>(1, ramSize / 0x2000);
+	for (uint32_t bank = 0; bank < ramBanks.size(); bank++)
+		ramBanks[bank] = ram + (bank % ramBankCount) * 0x2000;
+
+	romBank = romBanks[romBankNumber];
+	ramBank = ramBanks[ramBankNumber];
+}
+
+void MBC5::write(uint16_t address, uint8_t data)
 {
-	std::cout << "Cart Type: " << (int)header.cartridgeType << std::endl;
+	if (address < 0x2000)
+		ramEnabled = (data & 0xF) == 0xA;
+	else if (address < 0x3000)
+	{
+		romBankNumber = (romBankNumber & 0x100) | data;
+		romBank = romBanks[romBankNumber];
+	}
+	else if (address < 0x4000)
+	{
+		romBankNumber = (romBankNumber & 0xFF) | ((data & 1) << 8);
+		romBank = romBanks[romBankNumber];
+	}
+	else if (address < 0x6000)
+	{
+		// on rumble carts bit 3 drives the motor instead of selecting a bank
+		ramBankNumber = data & (hasRumble ? 0x7 : 0xF);
+		ramBank = ramBanks[ramBankNumber];
+	}
+	else if (address >= 0xA000 && address < 0xC000)
+	{
+		if (!ramEnabled || ramSize == 0) return;
+		WriteRAM(ram, (ramBank - ram) + (address - 0xA000), data);
+	}
+}
+
+struct MBC5State
+{
+	uint16_t romBankNumber;
+	uint8_t ramBankNumber;
+	bool ramEnabled;
+};
+
+void MBC5::SaveState(StateWriter& writer)
+{
+	MBC5State state = { romBankNumber, ramBankNumber, ramEnabled };
+
+	writer.BeginChunk(STATE_ID, STATE_VERSION);
+	writer.Write(state);
+	SaveRAM(writer, ram, ramSize);
+	writer.EndChunk();
+}
+
+void MBC5::LoadState(StateReader& reader)
+{
+	MBC5State state;
+
+	reader.OpenChunk(STATE_ID, STATE_VERSION);
+	reader.Read(state);
+
+	romBankNumber = state.romBankNumber & 0x1FF;
+	ramBankNumber = state.ramBankNumber & (hasRumble ? 0x7 : 0xF); // the same as write, bit 3 is the motor on rumble carts
+	ramEnabled = state.ramEnabled;
+
+	romBank = romBanks[romBankNumber];
+	ramBank = ramBanks[ramBankNumber];
+
+	LoadRAM(reader, ram, ramSize);
+}
+
+void MBC5::MapPages()
+{
+	if (!memoryMap) return;
+
+	MapROMBank(romBankNumber & romBankMask);
+	MapRAMBank(ram, ramSize, (uint32_t)((ramBank - ram) / 0x2000), ramEnabled);
+}
+
+void CreateMBCByType(MBCVariant& mbc, const CartridgeHeader& header, const uint8_t* cartData, const SaveOptions& saveOptions)
+{
+	std::clog << "Cart Type: " << (int)header.cartridgeType << std::endl;
 	switch (header.cartridgeType)
 	{
-	case 0: return std::make_unique<MBC0>(cartData);
-	case 1: return std::make_unique<MBC1>(cartData, header);
-	case 2: return std::make_unique<MBC1>(cartData, header);
-	case 3: return std::make_unique<MBC1>(cartData, header);
-	case 5: return std::make_unique<MBC2>(cartData, header);
-	case 6: return std::make_unique<MBC2>(cartData, header);
-	case 0xF: return std::make_unique<MBC3>(cartData, header, true);
-	case 0x10: return std::make_unique<MBC3>(cartData, header, true);
-	case 0x11: return std::make_unique<MBC3>(cartData, header);
-	case 0x12: return std::make_unique<MBC3>(cartData, header);
-	case 0x13: return std::make_unique<MBC3>(cartData, header, true);
+	case 0: mbc.emplace<MBC0>(cartData); break;
+	case 1: mbc.emplace<MBC1>(cartData, header, saveOptions); break;
+	case 2: mbc.emplace<MBC1>(cartData, header, saveOptions); break;
+	case 3: mbc.emplace<MBC1>(cartData, header, saveOptions); break;
+	case 5: mbc.emplace<MBC2>(cartData, header, saveOptions); break;
+	case 6: mbc.emplace<MBC2>(cartData, header, saveOptions); break;
+	case 0xF: mbc.emplace<MBC3>(cartData, header, true, saveOptions); break;
+	case 0x10: mbc.emplace<MBC3>(cartData, header, true, saveOptions); break;
+	case 0x11: mbc.emplace<MBC3>(cartData, header, false, saveOptions); break;
+	case 0x12: mbc.emplace<MBC3>(cartData, header, false, saveOptions); break;
+	case 0x13: mbc.emplace<MBC3>(cartData, header, true, saveOptions); break;
+	case 0x19: mbc.emplace<MBC5>(cartData, header, saveOptions); break;
+	case 0x1A: mbc.emplace<MBC5>(cartData, header, saveOptions); break;
+	case 0x1B: mbc.emplace<MBC5>(cartData, header, saveOptions); break;
+	case 0x1C: mbc.emplace<MBC5>(cartData, header, saveOptions); break;
+	case 0x1D: mbc.emplace<MBC5>(cartData, header, saveOptions); break;
+	case 0x1E: mbc.emplace<MBC5>(cartData, header, saveOptions); break;
 	default: throw std::runtime_error("ROM TYPE NOT SUPPORTED");
 	}
 }
-
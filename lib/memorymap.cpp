@@ -0,0 +1,62 @@
+#include "memorymap.h"
+
+MemoryMap::MemoryMap()
+{
+	Clear();
+	m_Watched.fill(false);
+}
+
+void MemoryMap::Clear()
+{
+	m_ReadPages.fill(nullptr);
+	m_WritePages.fill(nullptr);
+	m_MappedWrites.fill(nullptr);
+}
+
+void MemoryMap::Map(uint16_t start, uint32_t size, uint8_t* data, bool writable)
+{
+	for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE)
+	{
+		int page = (start + offset) >> 8;
+
+		m_ReadPages[page] = data + offset;
+		m_MappedWrites[page] = writable ? data + offset : nullptr;
+		m_WritePages[page] = m_Watched[page] ? nullptr : m_MappedWrites[page];
+	}
+}
+
+void MemoryMap::Map(uint16_t start, uint32_t size, const uint8_t* data)
+{
+	for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE)
+	{
+		int page = (start + offset) >> 8;
+
+		m_ReadPages[page] = data + offset;
+		m_MappedWrites[page] = nullptr;
+		m_WritePages[page] = nullptr;
+	}
+}
+
+void MemoryMap::Unmap(uint16_t start, uint32_t size)
+{
+	for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE)
+	{
+		int page = (start + offset) >> 8;
+
+		m_ReadPages[page] = nullptr;
+		m_WritePages[page] = nullptr;
+		m_MappedWrites[page] = nullptr;
+	}
+}
+
+void MemoryMap::WatchWrites(uint8_t page)
+{
+	m_Watched[page] = true;
+	m_WritePages[page] = nullptr;
+}
+
+void MemoryMap::UnwatchWrites(uint8_t page)
+{
+	m_Watched[page] = false;
+	m_WritePages[page] = m_MappedWrites[page];
+}
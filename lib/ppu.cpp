@@ -1,21 +1,18 @@
 #include "ppu.h"
 
 #include "emulator.h"
+#include "savestate.h"
 #include <iostream>
 #include <cstring>
+#include <stdexcept>
 #include <algorithm>
 #include <print>
 
 PPU::PPU()
 {
-    memset(vram, 0, 0x2000);
-    memset(oam_ram, 0, sizeof(OAMEntry) * 40);
-
-    background_pixels = {};
+    // the rest is set by Reset, which the emulator calls once everything is connected. clearing the
+    // frame here as well would double what creating an emulator costs
     sprite_buffer.reserve(10);
-
-    std::fill(videoBuffer.begin(), videoBuffer.end(), 3);
-
 }
 
 void PPU::Reset()
@@ -23,51 +20,94 @@ void PPU::Reset()
     memset(vram, 0, 0x2000);
     memset(oam_ram, 0, sizeof(OAMEntry) * 40);
     std::fill(videoBuffer.begin(), videoBuffer.end(), 3);
-
+    outputBuffer.fill(0);
+    grayRowSums.fill(0);
 
     for (int i = 0; i < sprite_pixels.size(); i++)
         sprite_pixels[i] = {};
 
     background_pixels = {};
+
+    dots = 0;
+    scanlineX = 0; // this is the x position in the scanline, used for pixel drawing
+    pushedX = 0;
+
+    lastSync = emu->m_SystemTicks;
+
     if (lcd != nullptr)
     {
         lcd->ly = 0;
-        SwitchMode(OAMSCAN);
+        EnterOAMScan();
+        ScheduleNextEvent();
     }
+}
 
+void PPU::Sync(uint64_t now)
+{
+    // drawing is the only mode that does something every dot, the rest just wait for the next event
+    while (lastSync < now && mode == DRAWPIXELS)
+    {
+        HandleModeDrawPixels();
+        dots++;
+        lastSync++;
+    }
 
-    sprite_buffer.clear();
-    
+    if (lastSync < now)
+    {
+        dots += now - lastSync;
+        lastSync = now;
+    }
+}
 
-    dots = 0;
-    scanlineX = 0; // this is the x position in the scanline, used for pixel drawing
-    pushedX = 0;
+void PPU::OnEvent(uint64_t when)
+{
+    Sync(when);
 
+    // something might have synced the ppu past when, so keep going until every due mode change is done
+    Mode previous;
+    do
+    {
+        previous = mode;
+
+        switch (mode)
+        {
+        case Mode::OAMSCAN:
+            HandleModeOAMScan();
+            break;
+        case Mode::HBLANK:
+            HandleModeHBLANK();
+            break;
+        case Mode::VBLANK:
+            HandleModeVBLANK();
+            break;
+        case Mode::DRAWPIXELS:
+            break; // Sync already did the work
+        }
+    } while (mode != previous && mode != DRAWPIXELS);
+
+    ScheduleNextEvent();
 }
 
-void PPU::tick()
+void PPU::ScheduleNextEvent()
 {
+    uint16_t delay = 1;
+
     switch (mode)
     {
     case Mode::OAMSCAN:
-        HandleModeOAMScan();
+        if (dots < 80) delay = 80 - dots;
         break;
-    
-    case Mode::HBLANK:
-        HandleModeHBLANK();
+    case Mode::DRAWPIXELS:
+        // at most one pixel gets pushed every dot so drawing cant finish any sooner than this
+        if (pushedX < RESX) delay = RESX - pushedX;
         break;
-
+    case Mode::HBLANK:
     case Mode::VBLANK:
-        HandleModeVBLANK();
+        if (dots < 456) delay = 456 - dots;
         break;
-    case Mode::DRAWPIXELS:
-        HandleModeDrawPixels();
-        break;
-    
     }
 
-    dots++;
-
+    emu->scheduler.Schedule(Scheduler::EventType::PPU, lastSync + delay);
 }
 
 void PPU::ConnectCPU(CPU* cpu)
@@ -93,31 +133,34 @@ void PPU::SwitchMode(Mode mode)
     lcd->SetStatusBit(LCD::Status::PPUMODE, mode);
 }
 
-void PPU::HandleModeOAMScan()
+void PPU::EnterOAMScan()
 {
+    SwitchMode(OAMSCAN);
+    sprite_buffer.clear();
 
-    if(dots == 1) 
-    {
-        for(OAMEntry& oam_sprite : oam_ram)
+    // the whole scan is done up front instead of during the 80 dots
+    for(OAMEntry& oam_sprite : oam_ram)
         {
-            if(sprite_buffer.size() >= 10) break;
-
-            uint8_t spriteHeight = lcd->GetControlBit(LCD::Control::OBJ_SIZE) ? 16 : 8;
-            if (!(lcd->ly + 16 < oam_sprite.y + spriteHeight)) continue;
-            if(oam_sprite.x <= 0) continue;
-            if(!(lcd->ly + 16 >= oam_sprite.y)) continue;
+        if(sprite_buffer.size() >= 10) break;
 
-            sprite_buffer.emplace_back(oam_sprite, spriteHeight);
-            
-        }
+        uint8_t spriteHeight = lcd->GetControlBit(LCD::Control::OBJ_SIZE) ? 16 : 8;
+        if (!(lcd->ly + 16 < oam_sprite.y + spriteHeight)) continue;
+        if(oam_sprite.x <= 0) continue;
+        if(!(lcd->ly + 16 >= oam_sprite.y)) continue;
 
-        std::sort(sprite_buffer.begin(), sprite_buffer.end(), [](const Sprite& sprite1, const Sprite& sprite2)
-            {
-                return sprite1.spriteData.x < sprite2.spriteData.x;
-            });
+        sprite_buffer.emplace_back(oam_sprite, spriteHeight);
         
     }
-    else if(dots >= 80)
+
+    std::sort(sprite_buffer.begin(), sprite_buffer.end(), [](const Sprite& sprite1, const Sprite& sprite2)
+        {
+            return sprite1.spriteData.x < sprite2.spriteData.x;
+        });
+}
+
+void PPU::HandleModeOAMScan()
+{
+    if(dots >= 80)
     {        
         fetchedX = 0;
         scanlineX = 0;
@@ -149,12 +192,11 @@ void PPU::HandleModeHBLANK()
         } 
         else
         {
-            SwitchMode(OAMSCAN);
-            sprite_buffer.clear();
+            EnterOAMScan();
             if (lcd->GetStatusBit(LCD::Status::MODE2))  emu->cpu.RequestInterrupt(CPU::Interrupt::STAT);
         }
 
-        dots = 0;
+        dots -= 456;
 
     }
 
@@ -171,11 +213,11 @@ void PPU::HandleModeVBLANK()
             windowLineCounter = 0;
 
             lcd->ly = 0;
-            SwitchMode(OAMSCAN);
+            EnterOAMScan();
             windowTriggered = false;
             if (lcd->GetStatusBit(LCD::Status::MODE2)) emu->cpu.RequestInterrupt(CPU::Interrupt::STAT);
         }
-        dots = 0;
+        dots -= 456;
 
     }
 
@@ -204,8 +246,7 @@ void PPU::HandleModeDrawPixels()
         }
         SwitchMode(HBLANK);
 
-        while (!background_pixels.empty())
-            background_pixels.pop();
+        background_pixels.clear();
 
         sprite_pixels.fill({});
 
@@ -240,8 +281,8 @@ void PPU::FetchSpritePixels()
 
             uint16_t tileAddress = 0x8000 + (tileIndex * 16) + (tileY * 2);
 
-            uint8_t lo = emu->read(tileAddress);
-            uint8_t hi = emu->read(tileAddress + 1);
+            uint8_t lo = VRAM_read(tileAddress);
+            uint8_t hi = VRAM_read(tileAddress + 1);
 
 
             for (int i = 0; i < 8; i++)
@@ -285,7 +326,7 @@ void PPU::FetchWindowPixels()
    
    
     tileIndexAddress += 32 * (fetcherY / 8) + fetcherX;
-    uint8_t tileIndex = emu->read(tileIndexAddress);
+    uint8_t tileIndex = VRAM_read(tileIndexAddress);
 
     tileAddress = lcd->GetControlBit(LCD::Control::BG_WINDOW_TILES) ? 0x8000 + tileIndex * 16 : 0x9000 + (int8_t)tileIndex * 16;
     tileY = ((windowLineCounter) % 8) * 2;
@@ -304,7 +345,7 @@ void PPU::FetchBackGroundPixels()
         uint16_t fetcherY = (lcd->scrollY + lcd->ly) & 255;
 
         tileIndexAddress += fetcherY / 8 * 32 + fetcherX;
-        uint8_t tileIndex = emu->read(tileIndexAddress);
+        uint8_t tileIndex = VRAM_read(tileIndexAddress);
         tileAddress = lcd->GetControlBit(LCD::Control::BG_WINDOW_TILES) ? 0x8000 + tileIndex * 16 : 0x9000 + (int8_t)tileIndex * 16;
 
         tileY = ((lcd->ly + lcd->scrollY) % 8) * 2;
@@ -318,8 +359,8 @@ void PPU::FetchBackGroundPixels()
 
     fetchedX++;
 
-    uint8_t tileLo = emu->read(tileAddress + tileY);
-    uint8_t tileHi = emu->read(tileAddress + tileY + 1);
+    uint8_t tileLo = VRAM_read(tileAddress + tileY);
+    uint8_t tileHi = VRAM_read(tileAddress + tileY + 1);
 
 
 
@@ -334,7 +375,7 @@ void PPU::FetchBackGroundPixels()
             if (!lcd->GetControlBit(LCD::Control::BG_WINDOW_ENABLE))
                 col = 0;
 
-               background_pixels.emplace(lcd->GetColor(col, lcd->bgp));
+               background_pixels.emplace_back(lcd->GetColor(col, lcd->bgp));
 
 
         }
@@ -349,26 +390,24 @@ void PPU::PixelRender()
     if (background_pixels.empty() || lcd->ly >= RESY) return;
 
     uint8_t color = background_pixels.front();
-    background_pixels.pop();
+    background_pixels.pop_front();
 
     
     OBJPixel spritePixel = sprite_pixels[pushedX];
 
-    if (spritePixel.exists && !(spritePixel.background_priority == 1 && color != 0))
+    if (renderVideo && spritePixel.exists && !(spritePixel.background_priority == 1 && color != 0))
     {
 
         uint8_t pallete = spritePixel.pallete ? lcd->obp1 : lcd->obp0;
         color = lcd->GetColor(spritePixel.color, pallete);
     }
   
-    int index = lcd->ly * RESX + pushedX;
-    
-  
+
     if (WindowVisible() && !(lcd->ly < lcd->windowY || scanlineX < lcd->windowX - 7))
     {
         if (scanlineX >= (lcd->windowX - 7) % 8) // this needs to check window x and window y for smooth window scrolling
         {
-            videoBuffer[index] = DEFAULT_COLORS[color];
+            if (renderVideo) OutputPixel(pushedX, lcd->ly, color);
             pushedX++;
         }
 
@@ -378,7 +417,7 @@ void PPU::PixelRender()
         if (scanlineX >= lcd->scrollX % 8) // this needs to check window x and window y for smooth window scrolling
         {
 
-            videoBuffer[index] = DEFAULT_COLORS[color];
+            if (renderVideo) OutputPixel(pushedX, lcd->ly, color);
             pushedX++;
         }
 
@@ -390,6 +429,57 @@ void PPU::PixelRender()
 
 }
 
+// how bright each shade is in the downsampled modes, the same as DEFAULT_COLORS
+static constexpr std::array<uint8_t, 4> GRAY_LEVELS = { 0xFF, 0xA9, 0x54, 0x00 };
+
+void PPU::OutputPixel(int x, int y, uint8_t color)
+{
+    switch (videoOutput)
+    {
+    case VideoOutput::RGBA:
+        videoBuffer[y * RESX + x] = DEFAULT_COLORS[color];
+        break;
+    case VideoOutput::Indexed:
+        outputBuffer[y * RESX + x] = color;
+        break;
+    case VideoOutput::Packed2bpp:
+    {
+        int index = y * RESX + x;
+        int shift = (index & 3) * 2;
+        uint8_t& packed = outputBuffer[index >> 2];
+        packed = (uint8_t)((packed & ~(3 << shift)) | (color << shift));
+        break;
+    }
+    case VideoOutput::Gray2x:
+    case VideoOutput::Gray4x:
+    {
+        // pixels come out a line at a time so each block is summed over its rows, and written once its last pixel is in
+        int shift = videoOutput == VideoOutput::Gray2x ? 1 : 2;
+        int mask = (1 << shift) - 1;
+
+        uint16_t& sum = grayRowSums[x >> shift];
+        if ((x & mask) == 0 && (y & mask) == 0) sum = 0;
+        sum += GRAY_LEVELS[color];
+
+        if ((x & mask) == mask && (y & mask) == mask)
+            outputBuffer[(y >> shift) * (RESX >> shift) + (x >> shift)] = (uint8_t)(sum >> (shift * 2));
+        break;
+    }
+    }
+}
+
+std::span<const uint8_t> PPU::GetOutput() const
+{
+    switch (videoOutput)
+    {
+    case VideoOutput::Indexed: return { outputBuffer.data(), RESX * RESY };
+    case VideoOutput::Packed2bpp: return { outputBuffer.data(), RESX * RESY / 4 };
+    case VideoOutput::Gray2x: return { outputBuffer.data(), (RESX / 2) * (RESY / 2) };
+    case VideoOutput::Gray4x: return { outputBuffer.data(), (RESX / 4) * (RESY / 4) };
+    default: return { (const uint8_t*)videoBuffer.data(), sizeof(videoBuffer) };
+    }
+}
+
 void PPU::OAM_write(uint16_t address, uint8_t data)
 {
 
@@ -426,21 +516,28 @@ void DMA::ConnectToEmulator(Emulator *emu)
     this->emu = emu;
 }
 
+void DMA::Reset()
+{
+    currentAddress = 0;
+    transferring = false;
+    emu->scheduler.Cancel(Scheduler::EventType::DMA);
+}
+
 void DMA::StartTransfer(uint8_t value)
 {
     currentAddress = (uint16_t)value << 8;
     transferring = true;
+
+    // 160 bytes, one every M-cycle. the copy itself happens all at once when it finishes
+    emu->scheduler.Schedule(Scheduler::EventType::DMA, emu->m_SystemTicks + 160 * 4);
 }
 
-void DMA::Tick()
+void DMA::Complete()
 {
-    uint8_t data = emu->read(currentAddress);
-    uint16_t destinationAddress = 0xFE00 | (currentAddress & 0xFF);
+    for (uint16_t i = 0; i < 0xA0; i++)
+        emu->ppu.OAM_write(0xFE00 | i, emu->read(currentAddress + i));
 
-    emu->ppu.OAM_write(destinationAddress, data);
-
-    transferring = destinationAddress < 0xFE9F;
-    currentAddress++;
+    transferring = false;
 }
 
 LCD::LCD()
@@ -459,6 +556,8 @@ void LCD::Reset()
     windowX = 0;
     windowY = 0;
     bgp = 0xFC;
+    obp0 = 0xFF; // the boot ROM doesnt set these, they still have to be something so save states come out the same
+    obp1 = 0xFF;
 }
 
 uint8_t LCD::read(uint16_t address)
@@ -561,3 +660,190 @@ uint8_t LCD::GetColor(uint8_t index, uint8_t pallete)
 
     return gb_colors[colorID];
 }
+
+struct PPUState
+{
+    uint64_t lastSync;
+    uint16_t dots;
+    uint16_t scanlineX;
+    uint16_t pushedX;
+    uint16_t tileAddress;
+    uint16_t windowLineCounter;
+    uint8_t mode;
+    uint8_t tileY;
+    uint8_t fetchedX;
+    uint8_t fetchState;
+    bool windowTriggered;
+
+    uint8_t spriteCount;
+    uint8_t backgroundPixelCount;
+    uint8_t unused[7] = {};
+};
+
+static constexpr uint32_t PPU_STATE_ID = MakeChunkID("PPU ");
+static constexpr uint32_t PPU_STATE_VERSION = 2;
+static constexpr uint32_t FRAME_STATE_ID = MakeChunkID("FRAM");
+static constexpr uint32_t FRAME_STATE_VERSION = 1;
+
+void PPU::SaveState(StateWriter& writer) const
+{
+    static_assert(std::has_unique_object_representations_v<Sprite> && std::has_unique_object_representations_v<OBJPixel>,
+        "sprites go into save states as is, they cant have padding");
+
+    PPUState state;
+    state.mode = mode;
+    state.dots = dots;
+    state.lastSync = lastSync;
+    state.scanlineX = scanlineX;
+    state.pushedX = pushedX;
+    state.tileY = tileY;
+    state.fetchedX = fetchedX;
+    state.tileAddress = tileAddress;
+    state.windowTriggered = windowTriggered;
+    state.fetchState = fetch_state;
+    state.windowLineCounter = windowLineCounter;
+    state.spriteCount = (uint8_t)sprite_buffer.size();
+    state.backgroundPixelCount = (uint8_t)background_pixels.size();
+
+    writer.BeginChunk(PPU_STATE_ID, PPU_STATE_VERSION);
+    writer.Write(state);
+
+    writer.WriteBytes(vram, sizeof(vram));
+    writer.WriteBytes(oam_ram, sizeof(oam_ram));
+
+    writer.WriteBytes(sprite_buffer.data(), sprite_buffer.size() * sizeof(Sprite));
+    writer.WriteBytes(sprite_pixels.data(), sizeof(sprite_pixels));
+    for (uint8_t pixel : background_pixels)
+        writer.Write(pixel);
+    writer.EndChunk();
+}
+
+void PPU::SaveFrame(StateWriter& writer) const
+{
+    // loading a state mid frame should show what was drawn up to that point, not the frame after it
+    writer.BeginChunk(FRAME_STATE_ID, FRAME_STATE_VERSION);
+    writer.WriteBytes(videoBuffer.data(), sizeof(videoBuffer));
+    writer.EndChunk();
+}
+
+void PPU::LoadState(StateReader& reader)
+{
+    PPUState state;
+
+    reader.OpenChunk(PPU_STATE_ID, PPU_STATE_VERSION);
+    reader.Read(state);
+
+    if (state.mode > DRAWPIXELS || state.fetchState > Push || state.spriteCount > 10)
+        throw std::runtime_error("Save state has a broken PPU");
+
+    // these index the frame, the sprite line and VRAM without any more checks. drawing stops as soon as a line is full
+    // so pushedX can only be RESX outside of it, and the background FIFO never has more than two tiles in it
+    bool drawing = state.mode == DRAWPIXELS;
+    if (state.dots >= 456 || state.scanlineX >= 456 || state.fetchedX > 456 / 10 || state.windowLineCounter > 153 ||
+        state.pushedX > RESX || (drawing && state.pushedX == RESX) || state.backgroundPixelCount > 16 ||
+        state.tileAddress < 0x8000 || state.tileAddress + state.tileY + 1 >= 0xA000)
+        throw std::runtime_error("Save state has a broken PPU");
+
+    mode = (Mode)state.mode;
+    dots = state.dots;
+    lastSync = state.lastSync;
+    scanlineX = state.scanlineX;
+    pushedX = state.pushedX;
+    tileY = state.tileY;
+    fetchedX = state.fetchedX;
+    tileAddress = state.tileAddress;
+    windowTriggered = state.windowTriggered;
+    fetch_state = (FetchState)state.fetchState;
+    windowLineCounter = state.windowLineCounter;
+
+    reader.ReadBytes(vram, sizeof(vram));
+    reader.ReadBytes(oam_ram, sizeof(oam_ram));
+
+    sprite_buffer.resize(state.spriteCount);
+    reader.ReadBytes(sprite_buffer.data(), sprite_buffer.size() * sizeof(Sprite));
+    reader.ReadBytes(sprite_pixels.data(), sizeof(sprite_pixels));
+
+    const uint8_t* pixels = reader.ReadView(state.backgroundPixelCount);
+    background_pixels.assign(pixels, pixels + state.backgroundPixelCount);
+}
+
+void PPU::LoadFrame(StateReader& reader)
+{
+    if (!reader.HasChunk(FRAME_STATE_ID)) return;
+
+    reader.OpenChunk(FRAME_STATE_ID, FRAME_STATE_VERSION);
+    reader.ReadBytes(videoBuffer.data(), sizeof(videoBuffer));
+}
+
+struct LCDState
+{
+    uint8_t lcdc, ly, lyc, status;
+    uint8_t scrollY, scrollX, windowY, windowX;
+    uint8_t bgp, obp0, obp1;
+};
+
+static constexpr uint32_t LCD_STATE_ID = MakeChunkID("LCD ");
+static constexpr uint32_t LCD_STATE_VERSION = 1;
+
+void LCD::SaveState(StateWriter& writer) const
+{
+    LCDState state = { lcdc, ly, lyc, status, scrollY, scrollX, windowY, windowX, bgp, obp0, obp1 };
+
+    writer.BeginChunk(LCD_STATE_ID, LCD_STATE_VERSION);
+    writer.Write(state);
+    writer.EndChunk();
+}
+
+void LCD::LoadState(StateReader& reader)
+{
+    LCDState state;
+
+    reader.OpenChunk(LCD_STATE_ID, LCD_STATE_VERSION);
+    reader.Read(state);
+
+    // the ppu draws to row ly
+    if (state.ly > 153) throw std::runtime_error("Save state has a broken LCD");
+
+    lcdc = state.lcdc;
+    ly = state.ly;
+    lyc = state.lyc;
+    status = state.status;
+    scrollY = state.scrollY;
+    scrollX = state.scrollX;
+    windowY = state.windowY;
+    windowX = state.windowX;
+    bgp = state.bgp;
+    obp0 = state.obp0;
+    obp1 = state.obp1;
+}
+
+struct DMAState
+{
+    uint16_t currentAddress;
+    bool transferring;
+    uint8_t unused = 0;
+};
+
+static constexpr uint32_t DMA_STATE_ID = MakeChunkID("DMA ");
+static constexpr uint32_t DMA_STATE_VERSION = 2;
+
+void DMA::SaveState(StateWriter& writer) const
+{
+    DMAState state = { currentAddress, transferring };
+
+    writer.BeginChunk(DMA_STATE_ID, DMA_STATE_VERSION);
+    writer.Write(state);
+    writer.EndChunk();
+}
+
+void DMA::LoadState(StateReader& reader)
+{
+    DMAState state;
+
+    reader.OpenChunk(DMA_STATE_ID, DMA_STATE_VERSION);
+    reader.Read(state);
+
+    // the completion event comes back with the scheduler
+    transferring = state.transferring;
+    currentAddress = state.currentAddress;
+}
@@ -0,0 +1,318 @@
+#include "rewind.h"
+#include "emulator.h"
+
+#include <cstring>
+#include <algorithm>
+
+static void WriteVarint(std::vector<uint8_t>& out, size_t value)
+{
+	while (value >= 0x80)
+	{
+		out.push_back((uint8_t)(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((uint8_t)value);
+}
+
+static size_t ReadVarint(std::span<const uint8_t> in, size_t& pos)
+{
+	size_t value = 0;
+	for (int shift = 0; pos < in.size(); shift += 7)
+	{
+		uint8_t byte = in[pos++];
+		value |= (size_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) break;
+	}
+	return value;
+}
+
+Rewind::~Rewind()
+{
+	Disable();
+}
+
+void Rewind::ConnectToEmulator(Emulator* emu)
+{
+	this->emu = emu;
+}
+
+void Rewind::Enable(const RewindOptions& options)
+{
+	Disable();
+
+	m_Options = options;
+	m_Options.interval = std::max(m_Options.interval, 1);
+
+	m_Stopping = false;
+	m_Enabled = true;
+	m_Thread = std::thread(&Rewind::Run, this);
+}
+
+void Rewind::Disable()
+{
+	if (m_Thread.joinable())
+	{
+		{
+			std::lock_guard lock(m_Mutex);
+			m_Stopping = true;
+		}
+
+		m_Wake.notify_one();
+		m_Thread.join();
+	}
+
+	m_Enabled = false;
+	Clear();
+}
+
+void Rewind::Clear()
+{
+	// StepBack loads states through the emulator, which would otherwise throw away what it is loading from
+	if (m_Replaying) return;
+
+	std::unique_lock lock(m_Mutex);
+
+	for (PendingState& pending : m_Pending)
+		m_Spare.push_back(std::move(pending.state));
+	m_Pending.clear();
+
+	WaitUntilIdle(lock);
+
+	m_Snapshots.clear();
+	m_DeltaBytes = 0;
+	m_HasLatest = false;
+
+	m_Inputs.clear();
+	m_InputBase = 0;
+
+	m_Frame = 0;
+	m_Captured = false;
+}
+
+void Rewind::OnFrame()
+{
+	if (!m_Enabled) return;
+
+	std::vector<uint8_t> state;
+
+	{
+		std::lock_guard lock(m_Mutex);
+		m_Inputs.push_back(emu->buttonState.GetHeld());
+
+		m_Frame++;
+		if (m_Captured && m_Frame - m_LastCapture < (uint64_t)m_Options.interval) return;
+
+		if (!m_Spare.empty())
+		{
+			state = std::move(m_Spare.back());
+			m_Spare.pop_back();
+		}
+	}
+
+	// the screen is left out, StepBack always runs at least one frame after loading which draws it again
+	emu->SaveState(state, false);
+
+	{
+		std::lock_guard lock(m_Mutex);
+		m_Pending.push_back({ m_Frame, std::move(state) });
+	}
+	m_Wake.notify_one();
+
+	m_LastCapture = m_Frame;
+	m_Captured = true;
+}
+
+bool Rewind::StepBack()
+{
+	if (!m_Enabled || !emu->romLoaded) return false;
+
+	std::unique_lock lock(m_Mutex);
+	WaitUntilIdle(lock);
+
+	if (!m_HasLatest || m_Frame == 0) return false;
+
+	// snapshots dont have the screen so the target has to be at least a frame after one of them, running that frame
+	// draws it again
+	uint64_t target = m_Frame - 1;
+	uint64_t oldest = m_Snapshots.empty() ? m_LatestFrame : m_Snapshots.front().frame;
+	if (target <= oldest) return false;
+
+	// anything at or after the target is dropped, the frames from there on are about to be played differently
+	while (!m_Snapshots.empty() && m_LatestFrame >= target)
+	{
+		Snapshot& snapshot = m_Snapshots.back();
+		ApplyDelta(snapshot.delta, m_Latest);
+
+		m_LatestFrame = snapshot.frame;
+		m_DeltaBytes -= snapshot.delta.size();
+		m_Snapshots.pop_back();
+	}
+
+	uint8_t held = emu->buttonState.GetHeld();
+
+	{
+		// cleared however this ends, recording would stop for good if it was left set
+		struct ReplayGuard
+		{
+			bool& replaying;
+			~ReplayGuard() { replaying = false; }
+		} guard{ m_Replaying };
+
+		m_Replaying = true;
+		emu->LoadState(m_Latest);
+
+		for (uint64_t frame = m_LatestFrame; frame < target; frame++)
+		{
+			emu->buttonState.SetHeld(m_Inputs[frame - m_InputBase]);
+			emu->RunFrame();
+		}
+	}
+
+	// the host gets its buttons back, the select bits stay as the game left them
+	emu->buttonState.SetHeld(held);
+
+	m_Inputs.resize(target - m_InputBase);
+	m_Frame = target;
+	m_LastCapture = m_LatestFrame;
+	m_Captured = true;
+
+	return true;
+}
+
+uint64_t Rewind::GetHistoryFrames()
+{
+	std::lock_guard lock(m_Mutex);
+
+	if (!m_HasLatest) return 0;
+
+	// StepBack cant go all the way back to the oldest snapshot, see there
+	uint64_t oldest = m_Snapshots.empty() ? m_LatestFrame : m_Snapshots.front().frame;
+	return m_Frame > oldest ? m_Frame - oldest - 1 : 0;
+}
+
+size_t Rewind::GetMemoryUsed()
+{
+	std::lock_guard lock(m_Mutex);
+	return m_DeltaBytes + m_Latest.size() + m_Inputs.size();
+}
+
+void Rewind::WaitUntilIdle(std::unique_lock<std::mutex>& lock)
+{
+	m_Idle.wait(lock, [this] { return m_Pending.empty() && !m_Busy; });
+}
+
+void Rewind::Evict()
+{
+	while (!m_Snapshots.empty() && m_DeltaBytes + m_Latest.size() > m_Options.memoryBudget)
+	{
+		m_DeltaBytes -= m_Snapshots.front().delta.size();
+		m_Snapshots.pop_front();
+	}
+
+	// buttons from before the oldest snapshot are never played again
+	uint64_t oldest = m_Snapshots.empty() ? m_LatestFrame : m_Snapshots.front().frame;
+	while (m_InputBase < oldest && !m_Inputs.empty())
+	{
+		m_Inputs.pop_front();
+		m_InputBase++;
+	}
+}
+
+void Rewind::Run()
+{
+	std::unique_lock lock(m_Mutex);
+
+	while (true)
+	{
+		m_Wake.wait(lock, [this] { return m_Stopping || !m_Pending.empty(); });
+		if (m_Stopping) return;
+
+		PendingState pending = std::move(m_Pending.front());
+		m_Pending.pop_front();
+		m_Busy = true;
+
+		bool hadLatest = m_HasLatest;
+		uint64_t latestFrame = m_LatestFrame;
+
+		// m_Latest is only touched by whoever is busy, everyone else waits until idle
+		lock.unlock();
+		if (hadLatest) EncodeDelta(m_Latest, pending.state, m_Scratch);
+		lock.lock();
+
+		if (hadLatest)
+		{
+			m_DeltaBytes += m_Scratch.size();
+			m_Snapshots.push_back({ latestFrame, std::vector<uint8_t>(m_Scratch.begin(), m_Scratch.end()) });
+		}
+
+		std::swap(m_Latest, pending.state);
+		m_LatestFrame = pending.frame;
+		m_HasLatest = true;
+		m_Spare.push_back(std::move(pending.state));
+
+		Evict();
+
+		m_Busy = false;
+		m_Idle.notify_all();
+	}
+}
+
+void Rewind::EncodeDelta(std::span<const uint8_t> older, std::span<const uint8_t> newer, std::vector<uint8_t>& delta)
+{
+	// layout: size of older, then until it is all covered: zero count, literal count, literal bytes
+	delta.clear();
+	WriteVarint(delta, older.size());
+
+	const size_t size = older.size();
+	const size_t common = std::min(size, newer.size());
+
+	auto diff = [&](size_t i) -> uint8_t { return older[i] ^ (i < common ? newer[i] : 0); };
+
+	size_t i = 0;
+	while (i < size)
+	{
+		size_t zerosStart = i;
+		while (i + 8 <= common && memcmp(&older[i], &newer[i], 8) == 0) i += 8;
+		while (i < size && diff(i) == 0) i++;
+
+		size_t literalStart = i;
+		while (i < size)
+		{
+			if (diff(i) != 0)
+			{
+				i++;
+				continue;
+			}
+
+			// a couple of zeros are cheaper to keep as literals than to start a new run
+			size_t gapEnd = i;
+			while (gapEnd < size && gapEnd - i < 3 && diff(gapEnd) == 0) gapEnd++;
+			if (gapEnd - i >= 3 || gapEnd == size) break;
+			i = gapEnd;
+		}
+
+		WriteVarint(delta, literalStart - zerosStart);
+		WriteVarint(delta, i - literalStart);
+		for (size_t j = literalStart; j < i; j++)
+			delta.push_back(diff(j));
+	}
+}
+
+void Rewind::ApplyDelta(std::span<const uint8_t> delta, std::vector<uint8_t>& state)
+{
+	size_t pos = 0;
+	size_t size = ReadVarint(delta, pos);
+
+	// bytes past the end of the newer state were XORed with zero
+	state.resize(size, 0);
+
+	size_t i = 0;
+	while (pos < delta.size() && i < size)
+	{
+		i += ReadVarint(delta, pos);
+
+		size_t literals = ReadVarint(delta, pos);
+		for (size_t j = 0; j < literals && i < size && pos < delta.size(); j++)
+			state[i++] ^= delta[pos++];
+	}
+}
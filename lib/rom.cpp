@@ -0,0 +1,216 @@
+#include "rom.h"
+
+#include <map>
+#include <mutex>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <filesystem>
+#include <unordered_map>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// what a file looked like when it was loaded. as long as it still looks the same it is assumed to hold the same ROM,
+// so loading it again doesnt have to read and hash the whole thing
+struct ROMFileKey
+{
+	std::string path;
+	uintmax_t size = 0;
+	int64_t modified = 0;
+
+	auto operator<=>(const ROMFileKey&) const = default;
+};
+
+static std::mutex s_CacheMutex;
+static std::unordered_map<uint64_t, std::weak_ptr<const ROM>> s_Cache; // by content
+static std::map<ROMFileKey, std::weak_ptr<const ROM>> s_FileCache;
+
+static bool GetFileKey(const std::string& path, ROMFileKey& key)
+{
+	std::error_code error;
+
+	std::filesystem::path canonical = std::filesystem::canonical(path, error);
+	if (error) return false;
+
+	key.size = std::filesystem::file_size(canonical, error);
+	if (error) return false;
+
+	std::filesystem::file_time_type modified = std::filesystem::last_write_time(canonical, error);
+	if (error) return false;
+
+	key.path = canonical.string();
+	key.modified = (int64_t)modified.time_since_epoch().count();
+	return true;
+}
+
+// maps the whole file, returns false if that isnt possible (empty file, pipe etc.) and the caller should read it instead
+static bool MapFile(const std::string& path, void*& mapping, size_t& size, void*& handle)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	HANDLE mappingHandle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file); // the mapping keeps the file open
+	if (!mappingHandle) return false;
+
+	mapping = MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+	if (!mapping)
+	{
+		CloseHandle(mappingHandle);
+		return false;
+	}
+
+	size = (size_t)fileSize.QuadPart;
+	handle = mappingHandle;
+	return true;
+#else
+	int file = open(path.c_str(), O_RDONLY);
+	if (file < 0) return false;
+
+	struct stat info;
+	if (fstat(file, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0)
+	{
+		close(file);
+		return false;
+	}
+
+	mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, file, 0);
+	close(file); // the mapping keeps the file open
+	if (mapping == MAP_FAILED)
+	{
+		mapping = nullptr;
+		return false;
+	}
+
+	size = info.st_size;
+	handle = nullptr;
+	return true;
+#endif
+}
+
+std::shared_ptr<const ROM> ROM::Load(const std::string& path)
+{
+	ROMFileKey fileKey;
+	bool hasFileKey = GetFileKey(path, fileKey);
+
+	if (hasFileKey)
+	{
+		std::lock_guard lock(s_CacheMutex);
+
+		auto it = s_FileCache.find(fileKey);
+		if (it != s_FileCache.end())
+			if (std::shared_ptr<const ROM> cached = it->second.lock()) return cached;
+	}
+
+	std::shared_ptr<ROM> rom(new ROM());
+
+	size_t fileSize = 0;
+	void* handle = nullptr;
+
+	if (MapFile(path, rom->m_Mapping, rom->m_MappingSize, handle))
+	{
+#ifdef _WIN32
+		rom->m_MappingHandle = handle;
+#endif
+		rom->m_Data = (const uint8_t*)rom->m_Mapping;
+		fileSize = rom->m_MappingSize;
+	}
+	else
+	{
+		std::ifstream ifs(path, std::ios::binary);
+		if (!ifs.good()) throw std::runtime_error("ERROR LOADING FILE");
+
+		rom->m_Buffer.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+		rom->m_Data = rom->m_Buffer.data();
+		fileSize = rom->m_Buffer.size();
+	}
+
+	// the header ends at 0x14F, 0x148 is the ROM size
+	if (fileSize < 0x150) throw std::runtime_error("ROM is too small to have a header");
+
+	uint8_t romSizeCode = rom->m_Data[0x148];
+	if (romSizeCode > 8) throw std::runtime_error("ROM header has an unknown ROM size");
+
+	rom->m_Size = (size_t)32768 << romSizeCode;
+	if (fileSize < rom->m_Size) throw std::runtime_error("ROM is smaller than its header says");
+
+	rom->m_Hash = Hash(rom->m_Data, rom->m_Size);
+
+	std::lock_guard lock(s_CacheMutex);
+
+	std::erase_if(s_Cache, [](const auto& entry) { return entry.second.expired(); });
+	std::erase_if(s_FileCache, [](const auto& entry) { return entry.second.expired(); });
+
+	std::shared_ptr<const ROM> result = rom;
+
+	if (auto it = s_Cache.find(rom->m_Hash); it != s_Cache.end())
+	{
+		// the new mapping gets dropped, everyone keeps using the one that is already resident
+		std::shared_ptr<const ROM> cached = it->second.lock();
+		if (cached && cached->m_Size == rom->m_Size && memcmp(cached->m_Data, rom->m_Data, rom->m_Size) == 0)
+			result = cached;
+	}
+
+	if (result == rom) s_Cache[rom->m_Hash] = rom;
+	if (hasFileKey) s_FileCache[fileKey] = result;
+
+	return result;
+}
+
+ROM::~ROM()
+{
+	if (!m_Mapping) return;
+
+#ifdef _WIN32
+	UnmapViewOfFile(m_Mapping);
+	CloseHandle(m_MappingHandle);
+#else
+	munmap(m_Mapping, m_MappingSize);
+#endif
+}
+
+size_t ROM::GetCachedCount()
+{
+	std::lock_guard lock(s_CacheMutex);
+
+	size_t count = 0;
+	for (const auto& [hash, rom] : s_Cache)
+		if (!rom.expired()) count++;
+
+	return count;
+}
+
+uint64_t ROM::Hash(const uint8_t* data, size_t size)
+{
+	// FNV-1a over 8 bytes at a time, ROM sizes are always a multiple of 8
+	uint64_t hash = 0xCBF29CE484222325;
+
+	for (size_t i = 0; i + 8 <= size; i += 8)
+	{
+		uint64_t word = 0;
+		for (int b = 0; b < 8; b++)
+			word |= (uint64_t)data[i + b] << (b * 8);
+
+		hash ^= word;
+		hash *= 0x100000001B3;
+	}
+
+	return hash ^ size;
+}
@@ -0,0 +1,158 @@
+#include "savemanager.h"
+
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <filesystem>
+
+SaveManager::SaveManager(const std::string& fileName, uint8_t* data, size_t size)
+	: m_FileName(fileName), m_Data(data), m_Shadow(data, data + size), m_Size(size)
+{
+	m_Thread = std::thread(&SaveManager::Run, this);
+}
+
+SaveManager::~SaveManager()
+{
+	{
+		std::lock_guard lock(m_Mutex);
+		m_Stopping = true;
+	}
+
+	m_Wake.notify_one();
+	m_Thread.join();
+}
+
+void SaveManager::Flush()
+{
+	std::unique_lock lock(m_Mutex);
+
+	uint64_t request = ++m_FlushRequests;
+	m_Wake.notify_one();
+
+	m_Flushed.wait(lock, [&] { return m_FlushesDone >= request; });
+}
+
+void SaveManager::WriteBlock(size_t offset, const uint8_t* data, size_t size)
+{
+	if (size == 0) return;
+
+	std::lock_guard lock(m_Mutex);
+
+	memcpy(m_Data + offset, data, size);
+
+	if (m_DirtyBegin >= m_DirtyEnd)
+	{
+		m_DirtyBegin = offset;
+		m_DirtyEnd = offset + size;
+		m_DirtySince = Clock::now();
+	}
+	else
+	{
+		m_DirtyBegin = std::min(m_DirtyBegin, offset);
+		m_DirtyEnd = std::max(m_DirtyEnd, offset + size);
+	}
+
+	m_Writes++;
+}
+
+void SaveManager::SetFooter(const uint8_t* data, size_t size)
+{
+	std::lock_guard lock(m_Mutex);
+
+	m_Footer.assign(data, data + size);
+	m_FooterChanged = true;
+}
+
+void SaveManager::SetFooterStamp(std::function<void(std::vector<uint8_t>&)> stamp)
+{
+	std::lock_guard lock(m_Mutex);
+
+	m_FooterStamp = std::move(stamp);
+}
+
+void SaveManager::Run()
+{
+	std::unique_lock lock(m_Mutex);
+
+	uint64_t writesLastTick = m_Writes;
+
+	while (true)
+	{
+		m_Wake.wait_for(lock, DEBOUNCE_TIME, [this] { return m_Stopping || m_FlushRequests > m_FlushesDone; });
+
+		bool dirty = m_DirtyBegin < m_DirtyEnd;
+		bool quiet = m_Writes == writesLastTick;
+		bool forced = m_Stopping || m_FlushRequests > m_FlushesDone;
+
+		writesLastTick = m_Writes;
+
+		if (dirty && (forced || quiet || Clock::now() - m_DirtySince >= MAX_DELAY))
+			WriteFile(lock);
+		else if (forced && m_FooterChanged)
+			WriteFile(lock);
+
+		if (m_FlushRequests > m_FlushesDone)
+		{
+			m_FlushesDone = m_FlushRequests;
+			m_Flushed.notify_all();
+		}
+
+		if (m_Stopping) return;
+	}
+}
+
+void SaveManager::WriteFile(std::unique_lock<std::mutex>& lock)
+{
+	// only the part that changed has to be copied while the emulator is locked out
+	size_t begin = m_DirtyBegin;
+	size_t end = m_DirtyEnd;
+
+	memcpy(m_Shadow.data() + begin, m_Data + begin, end - begin);
+	m_DirtyBegin = m_DirtyEnd = 0;
+
+	std::vector<uint8_t> footer = m_Footer;
+	m_FooterChanged = false;
+
+	if (m_FooterStamp && !footer.empty()) m_FooterStamp(footer);
+
+	lock.unlock();
+
+	std::string tempName = m_FileName + ".tmp";
+	bool ok;
+	{
+		std::ofstream ofs(tempName, std::ios::binary | std::ios::trunc);
+		ofs.write((const char*)m_Shadow.data(), m_Size);
+		ofs.write((const char*)footer.data(), footer.size());
+		ofs.close();
+		ok = ofs.good();
+	}
+
+	std::error_code error;
+	if (ok) std::filesystem::rename(tempName, m_FileName, error);
+
+	lock.lock();
+
+	if (!ok || error)
+	{
+		std::cerr << "Failed to write save file " << m_FileName << std::endl;
+
+		m_FooterChanged = true;
+
+		// try again next time around
+		if (m_DirtyBegin >= m_DirtyEnd)
+		{
+			m_DirtySince = Clock::now();
+			m_DirtyBegin = begin;
+			m_DirtyEnd = end;
+		}
+		else
+		{
+			m_DirtyBegin = std::min(m_DirtyBegin, begin);
+			m_DirtyEnd = std::max(m_DirtyEnd, end);
+		}
+		return;
+	}
+
+	m_FileWrites++;
+}
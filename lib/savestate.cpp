@@ -0,0 +1,98 @@
+#include "savestate.h"
+
+#include <stdexcept>
+
+StateWriter::StateWriter(std::vector<uint8_t>& buffer)
+	: m_Buffer(buffer)
+{
+	m_Buffer.clear();
+
+	Write(MAGIC);
+	Write(VERSION);
+}
+
+void StateWriter::BeginChunk(uint32_t id, uint32_t version)
+{
+	Write(id);
+	Write(version);
+
+	m_ChunkStart = m_Buffer.size();
+	Write((uint32_t)0); // filled in by EndChunk
+}
+
+void StateWriter::EndChunk()
+{
+	uint32_t size = (uint32_t)(m_Buffer.size() - m_ChunkStart - sizeof(uint32_t));
+	memcpy(m_Buffer.data() + m_ChunkStart, &size, sizeof(size));
+}
+
+StateReader::StateReader(std::span<const uint8_t> data)
+	: m_Data(data)
+{
+	auto readU32 = [&](size_t offset)
+	{
+		uint32_t value;
+		memcpy(&value, m_Data.data() + offset, sizeof(value));
+		return value;
+	};
+
+	if (m_Data.size() < 8 || readU32(0) != StateWriter::MAGIC)
+		throw std::runtime_error("Not a save state");
+
+	if (readU32(4) != StateWriter::VERSION)
+		throw std::runtime_error("Save state was made by a different version");
+
+	size_t offset = 8;
+	while (offset < m_Data.size())
+	{
+		if (m_Data.size() - offset < 12) throw std::runtime_error("Save state is truncated");
+		if (m_ChunkCount == MAX_CHUNKS) throw std::runtime_error("Save state has too many chunks");
+
+		Chunk& chunk = m_Chunks[m_ChunkCount++];
+		chunk.id = readU32(offset);
+		chunk.version = readU32(offset + 4);
+		chunk.size = readU32(offset + 8);
+		chunk.offset = offset + 12;
+
+		if (chunk.size > m_Data.size() - chunk.offset) throw std::runtime_error("Save state is truncated");
+
+		offset = chunk.offset + chunk.size;
+	}
+}
+
+bool StateReader::HasChunk(uint32_t id) const
+{
+	for (int i = 0; i < m_ChunkCount; i++)
+		if (m_Chunks[i].id == id) return true;
+
+	return false;
+}
+
+uint32_t StateReader::OpenChunk(uint32_t id)
+{
+	for (int i = 0; i < m_ChunkCount; i++)
+	{
+		if (m_Chunks[i].id != id) continue;
+
+		m_Cursor = m_Chunks[i].offset;
+		m_ChunkEnd = m_Chunks[i].offset + m_Chunks[i].size;
+		return m_Chunks[i].version;
+	}
+
+	throw std::runtime_error("Save state is missing a chunk");
+}
+
+void StateReader::OpenChunk(uint32_t id, uint32_t version)
+{
+	if (OpenChunk(id) != version)
+		throw std::runtime_error("Save state chunk has an unsupported version");
+}
+
+const uint8_t* StateReader::ReadView(size_t size)
+{
+	if (size > m_ChunkEnd - m_Cursor) throw std::runtime_error("Save state chunk is too small");
+
+	const uint8_t* data = m_Data.data() + m_Cursor;
+	m_Cursor += size;
+	return data;
+}
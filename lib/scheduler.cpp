@@ -0,0 +1,142 @@
+#include "scheduler.h"
+
+#include <utility>
+#include <stdexcept>
+
+#include "savestate.h"
+
+Scheduler::Scheduler()
+{
+	Reset();
+}
+
+void Scheduler::Reset()
+{
+	m_Size = 0;
+	m_HeapIndex.fill(NOT_QUEUED);
+}
+
+static constexpr uint32_t SCHEDULER_STATE_ID = MakeChunkID("SCHD");
+static constexpr uint32_t SCHEDULER_STATE_VERSION = 1;
+
+void Scheduler::SaveState(StateWriter& writer) const
+{
+	static_assert(std::has_unique_object_representations_v<Event>, "events cant have padding");
+
+	writer.BeginChunk(SCHEDULER_STATE_ID, SCHEDULER_STATE_VERSION);
+	writer.Write(m_Size);
+	writer.WriteBytes(m_Heap.data(), m_Size * sizeof(Event));
+	writer.EndChunk();
+}
+
+void Scheduler::LoadState(StateReader& reader)
+{
+	int size;
+	std::array<Event, MAX_EVENTS> events;
+
+	reader.OpenChunk(SCHEDULER_STATE_ID, SCHEDULER_STATE_VERSION);
+	reader.Read(size);
+
+	if (size < 0 || size > MAX_EVENTS) throw std::runtime_error("Save state has a broken event queue");
+	reader.ReadBytes(events.data(), size * sizeof(Event));
+
+	// pushed back in one at a time so the heap indices get rebuilt instead of trusted
+	Reset();
+	for (int i = 0; i < size; i++)
+	{
+		if (events[i].type >= EventType::Count) throw std::runtime_error("Save state has a broken event queue");
+		Schedule(events[i].type, events[i].when);
+	}
+}
+
+void Scheduler::Schedule(EventType type, uint64_t when)
+{
+	uint8_t index = m_HeapIndex[(int)type];
+
+	if (index == NOT_QUEUED)
+	{
+		index = m_Size++;
+		m_Heap[index] = { when, type };
+		m_HeapIndex[(int)type] = index;
+		SiftUp(index);
+		return;
+	}
+
+	// already pending, just move it
+	uint64_t previous = m_Heap[index].when;
+	m_Heap[index].when = when;
+
+	if (when < previous) SiftUp(index);
+	else SiftDown(index);
+}
+
+void Scheduler::Cancel(EventType type)
+{
+	uint8_t index = m_HeapIndex[(int)type];
+	if (index == NOT_QUEUED) return;
+
+	RemoveAt(index);
+}
+
+bool Scheduler::PopDue(uint64_t now, EventType& type, uint64_t& when)
+{
+	if (m_Size == 0 || m_Heap[0].when > now) return false;
+
+	type = m_Heap[0].type;
+	when = m_Heap[0].when;
+
+	RemoveAt(0);
+	return true;
+}
+
+void Scheduler::RemoveAt(int index)
+{
+	EventType removed = m_Heap[index].type;
+	int last = --m_Size;
+
+	if (index != last)
+	{
+		Swap(index, last);
+		SiftDown(index);
+		SiftUp(index);
+	}
+
+	m_HeapIndex[(int)removed] = NOT_QUEUED;
+}
+
+void Scheduler::SiftUp(int index)
+{
+	while (index > 0)
+	{
+		int parent = (index - 1) / 2;
+		if (m_Heap[parent].when <= m_Heap[index].when) break;
+
+		Swap(parent, index);
+		index = parent;
+	}
+}
+
+void Scheduler::SiftDown(int index)
+{
+	while (true)
+	{
+		int left = index * 2 + 1;
+		int right = left + 1;
+		int smallest = index;
+
+		if (left < m_Size && m_Heap[left].when < m_Heap[smallest].when) smallest = left;
+		if (right < m_Size && m_Heap[right].when < m_Heap[smallest].when) smallest = right;
+
+		if (smallest == index) break;
+
+		Swap(smallest, index);
+		index = smallest;
+	}
+}
+
+void Scheduler::Swap(int a, int b)
+{
+	std::swap(m_Heap[a], m_Heap[b]);
+	m_HeapIndex[(int)m_Heap[a].type] = a;
+	m_HeapIndex[(int)m_Heap[b].type] = b;
+}
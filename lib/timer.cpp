@@ -1,81 +1,144 @@
 #include "timer.h"
 
+#include "emulator.h"
+#include "savestate.h"
+
 Timer::Timer()
 {
-    div = 0xAC00;
+    divBase = (uint64_t)0 - 0xAC00;
 }
 
 void Timer::ConnectTimerToCPU(CPU* cpu)
 {
     this->cpu = cpu;
-    div = 0xABCC; // happens when cpu resets, probably should go somewhere else
+}
 
+void Timer::ConnectToEmulator(Emulator* emu)
+{
+    this->emu = emu;
 }
 
 void Timer::Reset()
 {
-    div = 0xABCC;
+    uint64_t now = emu->m_SystemTicks;
+
+    divBase = now - 0xABCC; // happens when cpu resets, probably should go somewhere else
+    timaSync = now;
     tima = 0;
     tac = 0;
     tma = 0;
 
+    emu->scheduler.Cancel(Scheduler::EventType::Timer);
 }
 
+struct TimerState
+{
+    uint64_t divBase;
+    uint64_t timaSync;
+    uint8_t tima;
+    uint8_t tma;
+    uint8_t tac;
+    uint8_t unused[5] = {};
+};
+
+static constexpr uint32_t TIMER_STATE_ID = MakeChunkID("TIMR");
+static constexpr uint32_t TIMER_STATE_VERSION = 1;
+
+void Timer::SaveState(StateWriter& writer)
+{
+    TimerState state = { divBase, timaSync, tima, tma, tac };
+
+    writer.BeginChunk(TIMER_STATE_ID, TIMER_STATE_VERSION);
+    writer.Write(state);
+    writer.EndChunk();
+}
 
-void Timer::tick()
+void Timer::LoadState(StateReader& reader)
 {
-    uint16_t prev_div = div;
+    TimerState state;
 
-    div++;
+    reader.OpenChunk(TIMER_STATE_ID, TIMER_STATE_VERSION);
+    reader.Read(state);
 
-    bool timer_update = false;
+    // the pending overflow comes back with the scheduler
+    divBase = state.divBase;
+    timaSync = state.timaSync;
+    tima = state.tima;
+    tma = state.tma;
+    tac = state.tac;
+}
 
+uint8_t Timer::GetEdgeShift() const
+{
+    // TIMA goes up on the falling edge of a divider bit, which happens every 2^(bit + 1) T-cycles
     switch (tac & 0b11)
     {
-    case 0b00:
-        timer_update = (prev_div & (1 << 9)) && (!(div & (1 << 9)));
-        break;
-    
-    case 0b01:
-        timer_update = (prev_div & (1 << 3)) && (!(div & (1 << 3)));
-        break;
-    
-    case 0b10:
-        timer_update = (prev_div & (1 << 5)) && (!(div & (1 << 5)));
-        break;
+    case 0b00: return 10;   // bit 9
+    case 0b01: return 4;    // bit 3
+    case 0b10: return 6;    // bit 5
+    case 0b11: return 8;    // bit 7
+    }
+    return 10;
+}
 
-    case 0b11:
-        timer_update = (prev_div & (1 << 7)) && (!(div & (1 << 7)));
-        break;
+void Timer::Sync(uint64_t now)
+{
+    if (now <= timaSync) return;
+
+    if (IsEnabled())
+    {
+        uint8_t shift = GetEdgeShift();
+        uint64_t edges = ((now - divBase) >> shift) - ((timaSync - divBase) >> shift);
 
+        // the overflow event always fires before tima can wrap so this never carries
+        tima += (uint8_t)edges;
     }
 
-    if(timer_update && tac & (1 << 2)) {
-        tima++;
+    timaSync = now;
+}
 
-        if(tima == 0xFF)
-        {
-            tima = tma;
-            // request interrupt
-            cpu->RequestInterrupt(CPU::Interrupt::TIMER);
-        }
-            
+void Timer::ScheduleOverflow()
+{
+    if (!IsEnabled())
+    {
+        emu->scheduler.Cancel(Scheduler::EventType::Timer);
+        return;
     }
+
+    uint8_t shift = GetEdgeShift();
+    uint64_t remaining = 0x100 - tima;
+    uint64_t firstEdge = ((timaSync - divBase) >> shift) + 1;
+
+    uint64_t overflowAt = divBase + ((firstEdge + remaining - 1) << shift);
+    emu->scheduler.Schedule(Scheduler::EventType::Timer, overflowAt);
+}
+
+void Timer::OnOverflow(uint64_t when)
+{
+    timaSync = when;
+    tima = tma;
+
+    cpu->RequestInterrupt(CPU::Interrupt::TIMER);
+
+    ScheduleOverflow();
 }
 
 uint8_t Timer::read(uint16_t address)
 {
+    uint64_t now = emu->m_SystemTicks;
+
     switch (address)
     {
     case 0xFF04:
-        return div >> 8;
+        return (uint16_t)(now - divBase) >> 8;
     case 0xFF05:
+        Sync(now);
         return tima;
     case 0xFF06:
         return tma;
     case 0xFF07:
         return tac;
-    
+
     default:
         break;
     }
@@ -84,21 +147,26 @@ uint8_t Timer::read(uint16_t address)
 
 void Timer::write(uint16_t address, uint8_t data)
 {
+    uint64_t now = emu->m_SystemTicks;
+    Sync(now);
+
     switch (address)
     {
     case 0xFF04:
-        div = 0;
+        divBase = now;
         break;
     case 0xFF05:
         tima = data;
         break;
     case 0xFF06:
         tma = data;
-        break;
+        return; // doesnt change when the next overflow happens
     case 0xFF07:
         tac = data;
         break;
     default:
-        break;
+        return;
     }
-}
\ No newline at end of file
+
+    ScheduleOverflow();
+}
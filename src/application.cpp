@@ -161,7 +161,50 @@ void Application::ImGuiDraw()
 		if (ImGui::BeginMenu("Emulation"))
 		{
 			if (ImGui::MenuItem(emu_run ? "Pause" : "Continue"))
+			{
 				emu_run = !emu_run;
+				if (!emu_run) emu.FlushSave();
+			}
+			if (ImGui::MenuItem("Save State", nullptr, false, emu.romLoaded))
+				emu.SaveState(m_QuickState);
+			if (ImGui::MenuItem("Load State", nullptr, false, !m_QuickState.empty()))
+			{
+				try
+				{
+					emu.LoadState(m_QuickState);
+				}
+				catch (std::exception& e)
+				{
+					Utils::ShowMessageBox(GetWindowHandle(), e.what(), "Error");
+				}
+			}
+			if (ImGui::BeginMenu("Rewind"))
+			{
+				bool enabled = emu.rewind.IsEnabled();
+				if (ImGui::MenuItem("Record History (hold Backspace)", nullptr, &enabled))
+				{
+					if (enabled) emu.rewind.Enable();
+					else emu.rewind.Disable();
+				}
+
+				if (enabled)
+					ImGui::Text("%.1fs of history, %.1f MB", emu.rewind.GetHistoryFrames() / 60.0, emu.rewind.GetMemoryUsed() / (1024.0 * 1024.0));
+
+				ImGui::EndMenu();
+			}
+			if (ImGui::BeginMenu("Run Ahead"))
+			{
+				int& frames = emu.runAheadFrames;
+
+				if (ImGui::MenuItem("Off", nullptr, frames == 0)) frames = 0;
+				if (ImGui::MenuItem("1 Frame", nullptr, frames == 1)) frames = 1;
+				if (ImGui::MenuItem("2 Frames", nullptr, frames == 2)) frames = 2;
+				if (ImGui::MenuItem("3 Frames", nullptr, frames == 3)) frames = 3;
+
+				ImGui::TextDisabled("Too many frames makes games react before you press anything");
+
+				ImGui::EndMenu();
+			}
 			if (ImGui::BeginMenu("Speed"))
 			{
 				if (ImGui::MenuItem("100%")) SetTargetFPS(60);
@@ -172,6 +215,45 @@ void Application::ImGuiDraw()
 				
 				ImGui::EndMenu();
 			}
+			if (ImGui::BeginMenu("Save Files"))
+			{
+				SaveOptions::Mode& mode = emu.saveOptions.mode;
+
+				if (ImGui::MenuItem("Background Writer", nullptr, mode == SaveOptions::Mode::Writer)) mode = SaveOptions::Mode::Writer;
+				if (ImGui::MenuItem("Memory Mapped", nullptr, mode == SaveOptions::Mode::Mapped)) mode = SaveOptions::Mode::Mapped;
+
+				ImGui::Separator();
+				ImGui::MenuItem("Catch Up Cartridge Clock", nullptr, &emu.saveOptions.rtcCatchUp);
+
+				ImGui::TextDisabled("Takes effect when a ROM is opened");
+
+				ImGui::EndMenu();
+			}
+			if (ImGui::BeginMenu("CPU Core"))
+			{
+				CPU::ExecutionMode& mode = emu.cpu.executionMode;
+
+				if (ImGui::MenuItem("Interpreter", nullptr, mode == CPU::ExecutionMode::Interpreter)) mode = CPU::ExecutionMode::Interpreter;
+				if (ImGui::MenuItem("Block Cache", nullptr, mode == CPU::ExecutionMode::BlockCache)) mode = CPU::ExecutionMode::BlockCache;
+				if (ImGui::MenuItem("Threaded", nullptr, mode == CPU::ExecutionMode::Threaded)) mode = CPU::ExecutionMode::Threaded;
+				if (ImGui::MenuItem("JIT", nullptr, mode == CPU::ExecutionMode::JIT, Jit::IsSupported())) mode = CPU::ExecutionMode::JIT;
+				if (ImGui::MenuItem("JIT (Lockstep)", nullptr, mode == CPU::ExecutionMode::Lockstep, Jit::IsSupported())) mode = CPU::ExecutionMode::Lockstep;
+
+				if (mode == CPU::ExecutionMode::Lockstep)
+					ImGui::Text("Mismatches: %llu", (unsigned long long)emu.blockCache.GetMismatchCount());
+
+				if (mode == CPU::ExecutionMode::JIT || mode == CPU::ExecutionMode::Lockstep)
+					ImGui::Text("Compiled code: %zu KB", emu.blockCache.GetNativeCodeSize() / 1024);
+
+				ImGui::Separator();
+				ImGui::MenuItem("Skip Idle Loops", nullptr, &emu.cpu.idleLoopDetection);
+
+				const CPU::IdleLoopStats& stats = emu.cpu.idleLoopStats;
+				double skipped = emu.m_SystemTicks ? 100.0 * stats.cyclesSkipped / emu.m_SystemTicks : 0.0;
+				ImGui::Text("Idle loops skipped: %llu (%.1f%% of cycles)", (unsigned long long)stats.loopsSkipped, skipped);
+
+				ImGui::EndMenu();
+			}
 
 			ImGui::EndMenu();
 		}
@@ -271,6 +353,7 @@ void Application::Run()
 		else if (IsKeyPressed(KEY_SPACE))
 		{
 			emu_run = !emu_run;
+			if (!emu_run) emu.FlushSave();
 		}
 		else if (IsKeyPressed(KEY_P))
 		{
@@ -284,7 +367,14 @@ void Application::Run()
 		}
 
 
-		if (emu_run && emu.romLoaded) emu.UpdateFrame();
+		// holding backspace plays the game backwards, it stops at the oldest frame still in the history
+		if (emu_run && emu.romLoaded)
+		{
+			if (IsKeyDown(KEY_BACKSPACE) && emu.rewind.IsEnabled())
+				emu.rewind.StepBack();
+			else
+				emu.UpdateFrame();
+		}
 		ImGuiDraw();
 
 		UpdateTexture(renderTexture.texture, GetVideoBuffer().data());
@@ -43,6 +43,8 @@ private:
 	std::vector<std::unique_ptr<Panel>> m_Panels;
 	bool m_ShowFPS = false;
 
+	std::vector<uint8_t> m_QuickState; // Emulation > Save State, empty until something is saved
+
 	std::filesystem::path startupPath; // used to make sure imgui.ini file is saved the correct location
 
 
@@ -31,25 +31,30 @@ std::vector<std::string> Disassembler::disassemble(Emulator& emu, uint16_t start
 	for (uint16_t currentAddress = startAddress; currentAddress <= endAddress;)
 	{
 		uint8_t opcode = emu.read(currentAddress++);
-		CPU::Instruction currentInstruction;
+		const CPU::Instruction* currentInstruction;
+		const CPU::InstructionInfo* currentInfo;
 		if (opcode == 0xCB)
 		{
 			opcode = emu.read(currentAddress++);
-			currentInstruction = emu.cpu.m_CBPrefixJumpTable[opcode];
+			currentInstruction = &emu.cpu.m_CBPrefixJumpTable[opcode];
+			currentInfo = &emu.cpu.m_CBPrefixJumpTableInfo[opcode];
 
 		}
 		else
-			currentInstruction = emu.cpu.m_JumpTable[opcode];
+		{
+			currentInstruction = &emu.cpu.m_JumpTable[opcode];
+			currentInfo = &emu.cpu.m_JumpTableInfo[opcode];
+		}
 
 		std::stringstream ss;
 
 		if (currentAddress == emu.cpu.PC)
 			ss << "***";
 
-		ss << std::hex << currentAddress - 1 << " " << std::hex << (int)opcode << " " << currentInstruction.name;
+		ss << std::hex << currentAddress - 1 << " " << std::hex << (int)opcode << " " << currentInfo->name;
 
-		WriteParams(emu, currentInstruction.operand1, ss, currentAddress);
-		WriteParams(emu, currentInstruction.operand2, ss, currentAddress);
+		WriteParams(emu, currentInstruction->operand1, ss, currentAddress);
+		WriteParams(emu, currentInstruction->operand2, ss, currentAddress);
 
 		output.push_back(ss.str());
 	}
@@ -58,7 +63,7 @@ std::vector<std::string> Disassembler::disassemble(Emulator& emu, uint16_t start
 	return output;
 }
 
-void Disassembler::WriteParams(Emulator& emu, CPU::Operand& op, std::stringstream& ss, uint16_t& currentAddress)
+void Disassembler::WriteParams(Emulator& emu, const CPU::Operand& op, std::stringstream& ss, uint16_t& currentAddress)
 {
 	switch (op.mode)
 	{
@@ -17,6 +17,6 @@ private:
 	Emulator& m_Emulator;
 
 	std::vector<std::string> disassemble(Emulator& emu, uint16_t startAddress, uint16_t endAddress);
-	void WriteParams(Emulator& emu, CPU::Operand& op, std::stringstream& ss, uint16_t& currentAddress);
+	void WriteParams(Emulator& emu, const CPU::Operand& op, std::stringstream& ss, uint16_t& currentAddress);
 
 };
\ No newline at end of file
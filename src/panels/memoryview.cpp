@@ -57,7 +57,7 @@ void MemoryView::Update()
 		int targetRow = searchNumber / 16;
 
 		// Ensure the row exists
-		if (targetRow >= 0 && targetRow < (emu.memory.size() / 16)) {
+		if (targetRow >= 0 && targetRow < 0x10000 / 16) {
 			// Calculate exact scroll position
 			float scrollTarget = targetRow * ImGui::GetTextLineHeightWithSpacing();
 
@@ -73,7 +73,7 @@ void MemoryView::Update()
 
 				std::string text;
 				for (int j = 0; j < 16; j++) {
-					if (i + j >= emu.memory.size())
+					if (i + j >= 0x10000)
 						break;
 					text += std::format("{:02X} ", emu.read(i + j)); // Fix formatting
 				}
@@ -1,9 +1,16 @@
 #include <iostream>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include "cpu.h"
 
 #include <gtest/gtest.h>
 
 #include "emulator.h" // Assuming Emulator is your bus/memory system
+#include "batchrunner.h"
+#include "savestate.h"
+#include "gameboy.h"
 
 
 class CPUTest : public ::testing::Test {
@@ -147,4 +154,1230 @@ protected:
 //        EXPECT_EQ(cpu.GetFlag(FLAG_C), test.expectedC) << "C flag failed for input " << std::hex << +test.A;
 //        EXPECT_FALSE(cpu.GetFlag(FLAG_H)) << "H flag should always be cleared after DAA";
 //    }
-//}
\ No newline at end of file
+//}
+
+TEST(SchedulerTest, PopsEventsInTimeOrder)
+{
+    Scheduler scheduler;
+    scheduler.Schedule(Scheduler::EventType::Timer, 300);
+    scheduler.Schedule(Scheduler::EventType::PPU, 100);
+    scheduler.Schedule(Scheduler::EventType::Serial, 200);
+
+    // moving an already pending event should not duplicate it
+    scheduler.Schedule(Scheduler::EventType::Timer, 50);
+    scheduler.Cancel(Scheduler::EventType::Serial);
+
+    Scheduler::EventType type;
+    uint64_t when;
+
+    EXPECT_EQ(scheduler.NextEventTime(), 50);
+    EXPECT_FALSE(scheduler.PopDue(49, type, when));
+
+    ASSERT_TRUE(scheduler.PopDue(1000, type, when));
+    EXPECT_EQ(type, Scheduler::EventType::Timer);
+    EXPECT_EQ(when, 50);
+
+    ASSERT_TRUE(scheduler.PopDue(1000, type, when));
+    EXPECT_EQ(type, Scheduler::EventType::PPU);
+    EXPECT_EQ(when, 100);
+
+    EXPECT_FALSE(scheduler.PopDue(1000, type, when));
+    EXPECT_EQ(scheduler.NextEventTime(), Scheduler::NEVER);
+}
+
+TEST(CPUFlagsTest, FlagsRegisterRoundTrips)
+{
+    CPU cpu;
+
+    for (int f = 0; f < 0x100; f += 0x10)
+    {
+        cpu.SetFlagsRegister(f);
+        EXPECT_EQ(cpu.GetFlagsRegister(), f);
+
+        cpu.MaterializeFlags();
+        EXPECT_EQ(cpu.AF.lo, f);
+    }
+
+    cpu.SetFlagsRegister(0x0F); // low nibble is always 0
+    EXPECT_EQ(cpu.GetFlagsRegister(), 0);
+
+    cpu.SetFlag(CPU::Z, 1);
+    cpu.SetFlag(CPU::C, 1);
+    EXPECT_EQ(cpu.GetFlag(CPU::Z), 1);
+    EXPECT_EQ(cpu.GetFlag(CPU::N), 0);
+    EXPECT_EQ(cpu.GetFlag(CPU::H), 0);
+    EXPECT_EQ(cpu.GetFlag(CPU::C), 1);
+}
+
+TEST(MemoryMapTest, WatchedPagesFallBackToSlowPath)
+{
+    MemoryMap map;
+    std::array<uint8_t, 0x200> ram{};
+
+    map.Map(0xC000, 0x200, ram.data(), true);
+    EXPECT_EQ(map.GetReadPage(0xC123), ram.data() + 0x100);
+    EXPECT_EQ(map.GetWritePage(0xC123), ram.data() + 0x100);
+    EXPECT_EQ(map.GetReadPage(0xC200), nullptr);
+
+    map.WatchWrites(0xC1);
+    EXPECT_EQ(map.GetWritePage(0xC100), nullptr);
+    EXPECT_EQ(map.GetReadPage(0xC100), ram.data() + 0x100);
+
+    map.UnwatchWrites(0xC1);
+    EXPECT_EQ(map.GetWritePage(0xC100), ram.data() + 0x100);
+}
+
+// Not a correctness test, run with --gtest_also_run_disabled_tests to compare calling the memory bank controllers
+// through the virtual MBC interface against the variant dispatch Cartridge uses.
+// Reads are spread over every bank with a bank switch every 64 reads.
+static std::string WriteBenchmarkROM(uint8_t cartridgeType, uint8_t romSizeCode)
+{
+    std::vector<uint8_t> rom((size_t)32768 << romSizeCode);
+    for (size_t i = 0; i < rom.size(); i++)
+        rom[i] = (uint8_t)(i * 131 + (i >> 14));
+
+    std::fill(rom.begin() + 0x134, rom.begin() + 0x144, 0);
+    memcpy(&rom[0x134], "MBCBENCH", 8);
+    rom[0x147] = cartridgeType;
+    rom[0x148] = romSizeCode;
+    rom[0x149] = 0;
+
+    std::string path = (std::filesystem::temp_directory_path() / ("mbc_bench_" + std::to_string(cartridgeType) + ".gb")).string();
+    std::ofstream(path, std::ios::binary).write((char*)rom.data(), rom.size());
+    return path;
+}
+
+template<typename Read, typename Write>
+static double TimeBankedReads(Read read, Write write, uint32_t banks, uint64_t& checksum)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < 20'000'000; i++)
+    {
+        if ((i & 63) == 0) write(0x2000, (uint8_t)(1 + (i >> 6) % (banks - 1)));
+        checksum += read(0x4000 + ((i * 37) & 0x3FFF));
+    }
+
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+TEST(MBCBenchmark, DISABLED_VirtualVsVariant)
+{
+    struct Case { const char* name; uint8_t type; uint8_t romSizeCode; uint32_t banks; };
+
+    for (Case test : { Case{ "MBC1 512KiB", 0x01, 0x04, 32 }, Case{ "MBC3 2MiB", 0x11, 0x06, 128 } })
+    {
+        std::string path = WriteBenchmarkROM(test.type, test.romSizeCode);
+        Cartridge cartridge(path);
+
+        // a second copy of the same controller that is only ever used through a base pointer
+        std::vector<uint8_t> data((size_t)32768 << test.romSizeCode);
+        std::ifstream(path, std::ios::binary).read((char*)data.data(), data.size());
+        const CartridgeHeader& header = *(CartridgeHeader*)&data[0x100];
+
+        std::unique_ptr<MBC> owned;
+        if (test.type == 0x01) owned = std::make_unique<MBC1>(data.data(), header);
+        else owned = std::make_unique<MBC3>(data.data(), header, false);
+
+        MBC* volatile mbc = owned.get(); // stops the compiler from seeing the real type
+
+        uint64_t virtualSum = 0;
+        uint64_t variantSum = 0;
+
+        double virtualMs = TimeBankedReads([&](uint16_t a) { return mbc->read(a); }, [&](uint16_t a, uint8_t d) { mbc->write(a, d); }, test.banks, virtualSum);
+        double variantMs = TimeBankedReads([&](uint16_t a) { return cartridge.ReadCart(a); }, [&](uint16_t a, uint8_t d) { cartridge.WriteCart(a, d); }, test.banks, variantSum);
+
+        EXPECT_EQ(virtualSum, variantSum);
+        std::cout << test.name << ": virtual " << virtualMs << "ms, variant " << variantMs << "ms" << std::endl;
+
+        std::filesystem::remove(path);
+    }
+}
+
+TEST(SaveManagerTest, CoalescesWritesAndFlushesAtomically)
+{
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "savemanager_test.sav";
+    std::filesystem::remove(path);
+
+    std::vector<uint8_t> ram(0x2000, 0);
+
+    {
+        SaveManager saveManager(path.string(), ram.data(), ram.size());
+
+        // clearing the whole RAM used to mean a write of the whole file per byte
+        for (size_t i = 0; i < ram.size(); i++)
+            saveManager.Write(i, (uint8_t)i);
+
+        saveManager.Flush();
+        EXPECT_EQ(saveManager.GetFileWrites(), 1);
+
+        saveManager.Write(0x10, 0xAB);
+    }
+
+    std::vector<uint8_t> file(ram.size());
+    std::ifstream(path, std::ios::binary).read((char*)file.data(), file.size());
+
+    EXPECT_EQ(file, ram);
+    EXPECT_EQ(file[0x10], 0xAB);
+    EXPECT_FALSE(std::filesystem::exists(path.string() + ".tmp"));
+
+    std::filesystem::remove(path);
+}
+
+TEST(SaveManagerTest, MappedSaveWritesThroughToFile)
+{
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "mappedsave_test.sav";
+    std::filesystem::remove(path);
+
+    {
+        std::unique_ptr<MappedSave> save = MappedSave::Open(path.string(), 0x2000, std::chrono::milliseconds(0));
+        ASSERT_NE(save, nullptr);
+
+        uint8_t* ram = save->GetData();
+        EXPECT_EQ(ram[0x1FFF], 0); // new files start out cleared
+
+        ram[0] = 0x12;
+        ram[0x1FFF] = 0x34;
+        save->Flush();
+    }
+
+    std::vector<uint8_t> file(0x2000);
+    std::ifstream(path, std::ios::binary).read((char*)file.data(), file.size());
+
+    EXPECT_EQ(std::filesystem::file_size(path), 0x2000);
+    EXPECT_EQ(file[0], 0x12);
+    EXPECT_EQ(file[0x1FFF], 0x34);
+
+    std::filesystem::remove(path);
+}
+
+TEST(ROMTest, SharesImagesByContent)
+{
+    std::string path = WriteBenchmarkROM(0x01, 0x01);
+    std::string copy = path + ".copy.gb";
+    std::filesystem::copy_file(path, copy, std::filesystem::copy_options::overwrite_existing);
+
+    {
+        Cartridge first(path);
+        Cartridge second(copy); // different file, same bytes
+
+        std::shared_ptr<const ROM> rom = ROM::Load(path);
+        EXPECT_EQ(rom->GetSize(), 0x10000);
+        EXPECT_EQ(ROM::GetCachedCount(), 1);
+        EXPECT_EQ(first.ReadCart(0x0150), rom->GetData()[0x150]);
+        EXPECT_EQ(second.ReadCart(0x7FFF), rom->GetData()[0x7FFF]);
+
+        // the same file again is found without reading it
+        EXPECT_EQ(ROM::Load(path), rom);
+        EXPECT_EQ(ROM::Load(copy), rom);
+    }
+
+    EXPECT_EQ(ROM::GetCachedCount(), 0);
+
+    // the header says 64KiB, so a file cut short has to be refused
+    std::filesystem::resize_file(copy, 0x8000);
+    EXPECT_THROW(ROM::Load(copy), std::runtime_error);
+
+    std::filesystem::remove(path);
+    std::filesystem::remove(copy);
+}
+
+TEST(RTCTest, CountsEmulatedCycles)
+{
+    uint64_t ticks = 0;
+
+    RTC rtc;
+    rtc.ConnectSystemClock(&ticks);
+
+    auto latch = [&]() { rtc.WriteLatch(0); rtc.WriteLatch(1); };
+
+    ticks += RTC::CYCLES_PER_SECOND * (86400 + 3600 + 60 + 1) + RTC::CYCLES_PER_SECOND / 2;
+    latch();
+    EXPECT_EQ(rtc.Read(0x08), 1);
+    EXPECT_EQ(rtc.Read(0x09), 1);
+    EXPECT_EQ(rtc.Read(0x0A), 1);
+    EXPECT_EQ(rtc.Read(0x0B), 1);
+
+    // the half second left over carries into the next one
+    ticks += RTC::CYCLES_PER_SECOND / 2;
+    latch();
+    EXPECT_EQ(rtc.Read(0x08), 2);
+
+    // halted clocks dont count
+    rtc.Write(0x0C, 1 << 6);
+    ticks += RTC::CYCLES_PER_SECOND * 10;
+    latch();
+    EXPECT_EQ(rtc.Read(0x08), 2);
+
+    // going past day 511 sets the carry
+    rtc.Write(0x0C, 1);
+    rtc.Write(0x0B, 0xFF);
+    rtc.AdvanceSeconds(86400);
+    latch();
+    EXPECT_EQ(rtc.Read(0x0B), 0);
+    EXPECT_EQ(rtc.Read(0x0C), 0x80);
+
+    // and it all comes back the same from the save footer
+    std::array<uint8_t, RTC::SAVE_FOOTER_SIZE> footer;
+    rtc.SaveFooter(footer.data());
+
+    RTC loaded;
+    loaded.LoadFooter(footer.data(), false);
+    EXPECT_EQ(loaded.Read(0x08), rtc.Read(0x08));
+    EXPECT_EQ(loaded.Read(0x0A), rtc.Read(0x0A));
+    EXPECT_EQ(loaded.Read(0x0C), 0x80);
+}
+
+TEST(RTCTest, DebouncedRAMWritesKeepTheFooter)
+{
+    std::vector<uint8_t> data(0x8000, 0);
+    CartridgeHeader& header = *(CartridgeHeader*)&data[0x100];
+    memcpy(header.title, "RTCFOOTER", 9);
+    header.cartridgeType = 0x10; // MBC3+TIMER+RAM+BATTERY
+    header.ramSize = 0x02;
+
+    std::string path = "RTCFOOTER.sav";
+
+    // a .sav from an earlier run with the clock at 1:01:01
+    RTC saved;
+    saved.AdvanceSeconds(3661);
+
+    std::array<uint8_t, RTC::SAVE_FOOTER_SIZE> footer;
+    saved.SaveFooter(footer.data());
+    {
+        std::vector<uint8_t> ram(0x2000, 0);
+        std::ofstream ofs(path, std::ios::binary);
+        ofs.write((char*)ram.data(), ram.size());
+        ofs.write((char*)footer.data(), footer.size());
+    }
+
+    std::vector<uint8_t> file;
+
+    {
+        uint64_t ticks = 0;
+
+        MBC3 mbc(data.data(), header, true);
+        mbc.ConnectSystemClock(&ticks);
+
+        ticks += RTC::CYCLES_PER_SECOND * 2;
+        mbc.write(0x0000, 0x0A);
+        mbc.write(0xA000, 0x42);
+
+        // left to the writer thread, the cart is still running so nothing flushes it
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (std::chrono::steady_clock::now() < deadline)
+        {
+            std::this_thread::sleep_for(SaveManager::DEBOUNCE_TIME);
+
+            std::ifstream ifs(path, std::ios::binary);
+            file.assign(std::istreambuf_iterator<char>(ifs), {});
+            if (!file.empty() && file[0] == 0x42) break;
+        }
+    }
+
+    ASSERT_EQ(file.size(), 0x2000 + RTC::SAVE_FOOTER_SIZE);
+    EXPECT_EQ(file[0], 0x42);
+
+    // with the two seconds run since it was loaded
+    RTC loaded;
+    loaded.LoadFooter(file.data() + 0x2000, false);
+    loaded.WriteLatch(0);
+    loaded.WriteLatch(1);
+    EXPECT_EQ(loaded.Read(0x08), 3);
+    EXPECT_EQ(loaded.Read(0x09), 1);
+    EXPECT_EQ(loaded.Read(0x0A), 1);
+
+    std::filesystem::remove(path);
+}
+
+TEST(MBC5Test, SwitchesAmongAllBanks)
+{
+    // 8MiB, every bank starts with its own number
+    std::vector<uint8_t> rom((size_t)32768 << 8);
+    for (size_t bank = 0; bank < 512; bank++)
+    {
+        rom[bank * 0x4000] = (uint8_t)bank;
+        rom[bank * 0x4000 + 1] = (uint8_t)(bank >> 8);
+    }
+
+    memcpy(&rom[0x134], "MBC5TEST", 8);
+    rom[0x147] = 0x1A; // MBC5+RAM, nothing gets saved
+    rom[0x148] = 0x08;
+    rom[0x149] = 0x04; // 128KiB, 16 banks
+
+    std::string path = (std::filesystem::temp_directory_path() / "mbc5_test.gb").string();
+    std::ofstream(path, std::ios::binary).write((char*)rom.data(), rom.size());
+
+    {
+        Cartridge cartridge(path);
+
+        for (uint16_t bank : { 1, 0, 0xFF, 0x100, 0x1FF })
+        {
+            cartridge.WriteCart(0x2000, bank & 0xFF);
+            cartridge.WriteCart(0x3000, bank >> 8);
+
+            EXPECT_EQ(cartridge.GetROMBank(), bank);
+            EXPECT_EQ(cartridge.ReadCart(0x4000) | (cartridge.ReadCart(0x4001) << 8), bank);
+        }
+
+        cartridge.WriteCart(0x0000, 0x0A);
+        for (uint8_t bank = 0; bank < 16; bank++)
+        {
+            cartridge.WriteCart(0x4000, bank);
+            cartridge.WriteCart(0xA000, bank * 3);
+        }
+        for (uint8_t bank = 0; bank < 16; bank++)
+        {
+            cartridge.WriteCart(0x4000, bank);
+            EXPECT_EQ(cartridge.ReadCart(0xA000), bank * 3);
+        }
+    }
+
+    std::filesystem::remove(path);
+}
+
+// a cart that keeps the cpu, timer interrupts and WRAM busy
+static std::string WriteStateTestROM(const char* name)
+{
+    std::vector<uint8_t> rom(0x8000);
+
+    const uint8_t entry[] = { 0xC3, 0x50, 0x01 }; // JP 0x150
+    const uint8_t timerInterrupt[] = { 0x0C, 0xD9 }; // INC C, RETI
+    const uint8_t program[] = {
+        0x31, 0xFE, 0xFF,   // LD SP,0xFFFE
+        0x3E, 0x05,         // LD A,0x05
+        0xE0, 0x07,         // LDH (TAC),A
+        0x3E, 0x04,         // LD A,0x04
+        0xE0, 0xFF,         // LDH (IE),A
+        0xFB,               // EI
+        0x21, 0x00, 0xC0,   // LD HL,0xC000
+        0x04,               // loop: INC B
+        0x78,               // LD A,B
+        0x22,               // LD (HL+),A
+        0x7C,               // LD A,H
+        0xFE, 0xE0,         // CP 0xE0
+        0x20, 0xF8,         // JR NZ,loop
+        0x26, 0xC0,         // LD H,0xC0
+        0x18, 0xF4,         // JR loop
+    };
+
+    memcpy(&rom[0x100], entry, sizeof(entry));
+    memcpy(&rom[0x50], timerInterrupt, sizeof(timerInterrupt));
+    memcpy(&rom[0x150], program, sizeof(program));
+    memcpy(&rom[0x134], name, strlen(name));
+
+    std::string path = (std::filesystem::temp_directory_path() / (std::string(name) + ".gb")).string();
+    std::ofstream(path, std::ios::binary).write((char*)rom.data(), rom.size());
+    return path;
+}
+
+// a cart that jumps straight to program at 0x150, with optional vblank and timer interrupt handlers
+static std::string WriteProgramROM(const char* name, std::span<const uint8_t> program,
+    std::span<const uint8_t> vblankHandler = {}, std::span<const uint8_t> timerHandler = {})
+{
+    std::vector<uint8_t> rom(0x8000);
+
+    const uint8_t entry[] = { 0xC3, 0x50, 0x01 }; // JP 0x150
+
+    memcpy(&rom[0x100], entry, sizeof(entry));
+    memcpy(&rom[0x150], program.data(), program.size());
+    if (!vblankHandler.empty()) memcpy(&rom[0x40], vblankHandler.data(), vblankHandler.size());
+    if (!timerHandler.empty()) memcpy(&rom[0x50], timerHandler.data(), timerHandler.size());
+    memcpy(&rom[0x134], name, strlen(name));
+
+    std::string path = (std::filesystem::temp_directory_path() / (std::string(name) + ".gb")).string();
+    std::ofstream(path, std::ios::binary).write((char*)rom.data(), rom.size());
+    return path;
+}
+
+// fills tile 0 with all four shades and scrolls it one pixel further every vblank, so every frame looks different
+static const uint8_t SCROLL_PROGRAM[] = {
+    0x3E, 0x00,         // LD A,0x00
+    0xE0, 0x40,         // LDH (LCDC),A
+    0x21, 0x00, 0x80,   // LD HL,0x8000
+    0x06, 0x10,         // LD B,0x10
+    0x7D,               // fill: LD A,L
+    0x22,               // LD (HL+),A
+    0x05,               // DEC B
+    0x20, 0xFB,         // JR NZ,fill
+    0x3E, 0xE4,         // LD A,0xE4
+    0xE0, 0x47,         // LDH (BGP),A
+    0x3E, 0x91,         // LD A,0x91
+    0xE0, 0x40,         // LDH (LCDC),A
+    0xF0, 0x44,         // wait: LDH A,(LY)
+    0xFE, 0x90,         // CP 144
+    0x20, 0xFA,         // JR NZ,wait
+    0xF0, 0x43,         // LDH A,(SCX)
+    0x3C,               // INC A
+    0xE0, 0x43,         // LDH (SCX),A
+    0xF0, 0x44,         // leave: LDH A,(LY)
+    0xFE, 0x90,         // CP 144
+    0x28, 0xFA,         // JR Z,leave
+    0x18, 0xED,         // JR wait
+};
+
+static const CPU::ExecutionMode EXECUTION_MODES[] = {
+    CPU::ExecutionMode::Interpreter,
+    CPU::ExecutionMode::BlockCache,
+    CPU::ExecutionMode::Lockstep,
+    CPU::ExecutionMode::Threaded,
+    CPU::ExecutionMode::JIT,
+};
+
+// which chunk two states first differ in and where, so a failure says more than that two big vectors differ
+static std::string DescribeDifference(const std::vector<uint8_t>& a, const std::vector<uint8_t>& b)
+{
+    for (size_t offset = 8; offset + 12 <= a.size() && offset + 12 <= b.size();)
+    {
+        uint32_t size;
+        memcpy(&size, &a[offset + 8], 4);
+
+        for (size_t i = offset; i < offset + 12 + size && i < a.size() && i < b.size(); i++)
+            if (a[i] != b[i]) return std::string((const char*)&a[offset], 4) + " chunk differs at byte " + std::to_string(i - offset - 12);
+
+        offset += 12 + size;
+    }
+
+    return a.size() == b.size() ? "no difference" : "different sizes";
+}
+
+static std::unique_ptr<Emulator> RunInMode(const std::string& path, CPU::ExecutionMode mode, bool idleLoops, int frames)
+{
+    std::unique_ptr<Emulator> emu = std::make_unique<Emulator>();
+    emu->serialOutput = nullptr;
+    emu->LoadROM(path);
+    emu->Reset();
+    emu->cpu.executionMode = mode;
+    emu->cpu.idleLoopDetection = idleLoops;
+
+    for (int i = 0; i < frames; i++) emu->UpdateFrame();
+    return emu;
+}
+
+TEST(SaveStateTest, LoadingReplaysTheSameFrames)
+{
+    std::string path = WriteStateTestROM("STATETEST");
+
+    Emulator emu;
+    emu.LoadROM(path);
+    emu.Reset();
+
+    for (int i = 0; i < 10; i++) emu.UpdateFrame();
+
+    std::vector<uint8_t> start;
+    emu.SaveState(start);
+
+    for (int i = 0; i < 5; i++) emu.UpdateFrame();
+
+    std::vector<uint8_t> first;
+    emu.SaveState(first);
+
+    emu.LoadState(start);
+    for (int i = 0; i < 5; i++) emu.UpdateFrame();
+
+    std::vector<uint8_t> second;
+    emu.SaveState(second);
+
+    EXPECT_NE(start, first);
+    EXPECT_EQ(first, second);
+
+    // broken states are turned away
+    std::vector<uint8_t> truncated(first.begin(), first.begin() + first.size() / 2);
+    EXPECT_THROW(emu.LoadState(truncated), std::runtime_error);
+
+    // even when the broken chunk comes after ones that loaded fine, or the chunk is fine but a value in it isnt
+    auto corrupt = [&start](const char (&chunk)[5], size_t at, uint8_t value)
+    {
+        std::vector<uint8_t> state = start;
+        for (size_t offset = 8; offset < state.size();)
+        {
+            uint32_t id, size;
+            memcpy(&id, &state[offset], 4);
+            memcpy(&size, &state[offset + 8], 4);
+            if (id == MakeChunkID(chunk)) state[offset + at] = value;
+            offset += 12 + size;
+        }
+        return state;
+    };
+
+    std::vector<uint8_t> badChunks[] = {
+        corrupt("DMA ", 4, 0xFF), // version
+        corrupt("PPU ", 12 + 13, 0xFF), // top of pushedX
+        corrupt("LCD ", 12 + 1, 200), // ly
+    };
+
+    for (const std::vector<uint8_t>& badChunk : badChunks)
+    {
+        EXPECT_THROW(emu.LoadState(badChunk), std::runtime_error);
+
+        std::vector<uint8_t> afterBadLoad;
+        emu.SaveState(afterBadLoad);
+        EXPECT_EQ(afterBadLoad, second);
+    }
+
+    // and so are states for another game
+    std::string otherPath = WriteStateTestROM("OTHERGAME");
+    Emulator other;
+    other.LoadROM(otherPath);
+    other.Reset();
+    EXPECT_THROW(other.LoadState(first), std::runtime_error);
+
+    std::filesystem::remove(path);
+    std::filesystem::remove(otherPath);
+}
+
+TEST(RewindTest, StepsBackToEarlierFrames)
+{
+    std::string path = WriteStateTestROM("REWINDTEST");
+
+    Emulator emu;
+    emu.LoadROM(path);
+    emu.Reset();
+    emu.rewind.Enable({ .interval = 4 });
+
+    // history[i] is the state after i frames
+    std::vector<std::vector<uint8_t>> history(1);
+    emu.SaveState(history[0], false);
+
+    for (int i = 1; i <= 20; i++)
+    {
+        emu.UpdateFrame();
+        emu.SaveState(history.emplace_back(), false);
+    }
+
+    std::vector<uint8_t> state;
+    for (int i = 19; i >= 10; i--)
+    {
+        ASSERT_TRUE(emu.rewind.StepBack());
+        emu.SaveState(state, false);
+        EXPECT_EQ(state, history[i]) << "after stepping back to frame " << i;
+    }
+
+    // running on from a rewound frame records a new future
+    emu.UpdateFrame();
+    emu.SaveState(state, false);
+    EXPECT_EQ(state, history[11]);
+    EXPECT_TRUE(emu.rewind.StepBack());
+
+    // the delta gets the older state back even when the sizes differ
+    std::vector<uint8_t> older = { 1, 2, 3, 0, 0, 0, 0, 0, 0, 9, 9 };
+    std::vector<uint8_t> newer = { 1, 2, 4, 0, 0, 0, 0, 0, 0, 9, 9, 7, 7 };
+    std::vector<uint8_t> delta;
+    Rewind::EncodeDelta(older, newer, delta);
+    Rewind::ApplyDelta(delta, newer);
+    EXPECT_EQ(newer, older);
+
+    emu.rewind.Disable();
+    EXPECT_FALSE(emu.rewind.StepBack());
+
+    std::filesystem::remove(path);
+}
+
+TEST(RewindTest, DrawsTheFrameItStepsBackTo)
+{
+    std::string path = WriteProgramROM("REWINDSCREEN", SCROLL_PROGRAM);
+
+    Emulator emu;
+    emu.LoadROM(path);
+    emu.Reset();
+    emu.rewind.Enable({ .interval = 4 });
+
+    // snapshots after frames 1 and 5
+    std::vector<std::array<uint32_t, RESX * RESY>> screens(1);
+    for (int i = 1; i <= 7; i++)
+    {
+        emu.UpdateFrame();
+        screens.push_back(emu.ppu.videoBuffer);
+    }
+    EXPECT_EQ(emu.rewind.GetHistoryFrames(), 5);
+
+    // down to the frame after the oldest snapshot, every one of them drawn again
+    for (int i = 6; i >= 2; i--)
+    {
+        ASSERT_TRUE(emu.rewind.StepBack());
+        EXPECT_EQ(emu.ppu.videoBuffer, screens[i]) << "after stepping back to frame " << i;
+    }
+
+    EXPECT_NE(screens[2], screens[1]);
+    EXPECT_FALSE(emu.rewind.StepBack());
+
+    std::filesystem::remove(path);
+}
+
+TEST(RunAheadTest, ShowsFramesAheadWithoutChangingTheGame)
+{
+    std::string path = WriteStateTestROM("RUNAHEADTEST");
+
+    Emulator ahead;
+    ahead.LoadROM(path);
+    ahead.Reset();
+    ahead.runAheadFrames = 2;
+
+    Emulator plain;
+    plain.LoadROM(path);
+    plain.Reset();
+
+    for (int i = 0; i < 10; i++)
+    {
+        ahead.UpdateFrame();
+        plain.UpdateFrame();
+    }
+
+    // the frames run ahead are rolled back
+    std::vector<uint8_t> aheadState, plainState;
+    ahead.SaveState(aheadState, false);
+    plain.SaveState(plainState, false);
+    EXPECT_EQ(aheadState, plainState);
+
+    // but what is on screen is from two frames later
+    plain.UpdateFrame();
+    plain.UpdateFrame();
+    EXPECT_EQ(ahead.ppu.videoBuffer, plain.ppu.videoBuffer);
+
+    std::filesystem::remove(path);
+}
+
+TEST(BatchRunnerTest, RunsJobsOnEveryThreadWithTheSameResults)
+{
+    std::string path = WriteStateTestROM("BATCHTEST");
+
+    std::istringstream script("# hold start for a while\n5 start\n10\n12 right a\n");
+    InputScript input = InputScript::Parse(script);
+    ASSERT_EQ(input.changes.size(), 3);
+    size_t cursor = 0;
+    EXPECT_EQ(input.GetButtons(4, cursor), 0);
+    EXPECT_EQ(input.GetButtons(12, cursor), 0x11);
+
+    std::vector<BatchJob> jobs;
+    for (int i = 0; i < 16; i++)
+        jobs.push_back({ path, input, (uint64_t)(10 + i % 4) });
+
+    jobs.push_back({ "does_not_exist.gb" });
+    jobs.push_back({ path, {}, 1000000, std::chrono::milliseconds(20) });
+
+    BatchRunner runner(4);
+    std::vector<BatchResult> results = runner.Run(jobs);
+    ASSERT_EQ(results.size(), jobs.size());
+
+    for (int i = 0; i < 16; i++)
+    {
+        BatchResult alone = BatchRunner::RunJob(jobs[i]);
+
+        EXPECT_EQ(results[i].status, BatchResult::Status::Finished);
+        EXPECT_EQ(results[i].framesRun, jobs[i].frames);
+        EXPECT_EQ(results[i].framebufferHash, alone.framebufferHash);
+        EXPECT_EQ(results[i].ram, alone.ram);
+    }
+
+    EXPECT_EQ(results[16].status, BatchResult::Status::Failed);
+    EXPECT_FALSE(results[16].error.empty());
+
+    EXPECT_EQ(results[17].status, BatchResult::Status::TimedOut);
+    EXPECT_LT(results[17].framesRun, jobs[17].frames);
+
+    std::filesystem::remove(path);
+}
+
+TEST(ResetPointTest, FastResetSkipsTheWarmUp)
+{
+    std::string path = WriteStateTestROM("RESETTEST");
+
+    Emulator emu;
+    emu.LoadROM(path);
+    emu.CaptureResetPoint(10);
+    ASSERT_TRUE(emu.HasResetPoint());
+
+    std::vector<uint8_t> warm, first, second;
+    emu.SaveState(warm);
+
+    for (int i = 0; i < 5; i++) emu.UpdateFrame();
+    emu.SaveState(first);
+
+    emu.FastReset();
+    std::vector<uint8_t> reset;
+    emu.SaveState(reset);
+    EXPECT_EQ(reset, warm);
+
+    for (int i = 0; i < 5; i++) emu.UpdateFrame();
+    emu.SaveState(second);
+    EXPECT_EQ(first, second);
+
+    // another game doesnt reset into this one
+    emu.LoadROM(path);
+    EXPECT_FALSE(emu.HasResetPoint());
+
+    std::filesystem::remove(path);
+}
+
+TEST(CInterfaceTest, StepsClonesAndBatches)
+{
+    std::string path = WriteStateTestROM("CAPITEST");
+
+    EXPECT_EQ(gb_create("does_not_exist.gb"), nullptr);
+    EXPECT_STRNE(gb_last_error(), "");
+
+    gb_env* env = gb_create(path.c_str());
+    ASSERT_NE(env, nullptr);
+    ASSERT_EQ(gb_set_reset_point(env, 5, GB_BUTTON_START), 0);
+
+    // observations point into the emulator
+    size_t wramSize = 0;
+    const uint8_t* wram = gb_wram(env, &wramSize);
+    EXPECT_EQ(wramSize, 0x2000);
+    int64_t size = gb_save_state(env, nullptr, 0);
+    ASSERT_GT(size, 0);
+    std::vector<uint8_t> a(size), b(size);
+    gb_save_state(env, b.data(), b.size());
+
+    ASSERT_EQ(gb_step(env, GB_BUTTON_A, 3), 0);
+    EXPECT_EQ(gb_save_state(env, a.data(), a.size()), size);
+    EXPECT_NE(a, b);
+    EXPECT_EQ(gb_wram(env, nullptr), wram);
+    EXPECT_EQ(gb_read(env, 0xC123), wram[0x123]);
+
+    ASSERT_EQ(gb_set_output(env, GB_OUTPUT_GRAY_4X), 0);
+    gb_env* clone = gb_clone(env);
+    ASSERT_NE(clone, nullptr);
+
+    size_t observationSize = 0;
+    gb_observation(clone, &observationSize);
+    EXPECT_EQ(observationSize, (GB_SCREEN_WIDTH / 4) * (GB_SCREEN_HEIGHT / 4));
+
+    std::vector<gb_env*> envs = { env, clone };
+    std::vector<uint8_t> actions = { GB_BUTTON_A, GB_BUTTON_A };
+
+    gb_pool* pool = gb_pool_create(2);
+    EXPECT_EQ(gb_step_batch(pool, envs.data(), actions.data(), envs.size(), 4), 0);
+    gb_pool_destroy(pool);
+
+    // the clone started in the same place and got the same input
+    EXPECT_EQ(gb_save_state(env, a.data(), a.size()), size);
+    EXPECT_EQ(gb_save_state(clone, b.data(), b.size()), size);
+    EXPECT_EQ(a, b);
+    EXPECT_EQ(memcmp(gb_observation(env, nullptr), gb_observation(clone, nullptr), observationSize), 0);
+
+    // and resets to the same reset point
+    ASSERT_EQ(gb_reset(env), 0);
+    ASSERT_EQ(gb_reset(clone), 0);
+    EXPECT_EQ(memcmp(gb_wram(env, nullptr), gb_wram(clone, nullptr), wramSize), 0);
+    EXPECT_EQ(memcmp(gb_screen(env), gb_screen(clone), GB_SCREEN_WIDTH * GB_SCREEN_HEIGHT * 4), 0);
+
+    EXPECT_EQ(gb_load_state(env, b.data(), b.size() / 2), -1);
+
+    gb_destroy(clone);
+    gb_destroy(env);
+    std::filesystem::remove(path);
+}
+
+TEST(VideoOutputTest, ModesMatchTheRGBAFrame)
+{
+    std::vector<uint8_t> rom(0x8000);
+
+    const uint8_t entry[] = { 0xC3, 0x50, 0x01 }; // JP 0x150
+    const uint8_t program[] = {
+        0x3E, 0x00,         // LD A,0x00
+        0xE0, 0x40,         // LDH (LCDC),A
+        0x21, 0x00, 0x80,   // LD HL,0x8000
+        0x06, 0x10,         // LD B,0x10
+        0x7D,               // loop: LD A,L
+        0x22,               // LD (HL+),A
+        0x05,               // DEC B
+        0x20, 0xFB,         // JR NZ,loop
+        0x3E, 0xE4,         // LD A,0xE4
+        0xE0, 0x47,         // LDH (BGP),A
+        0x3E, 0x91,         // LD A,0x91
+        0xE0, 0x40,         // LDH (LCDC),A
+        0x18, 0xFE,         // JR -2
+    };
+
+    // tile 0 fills the background with all four shades
+    memcpy(&rom[0x100], entry, sizeof(entry));
+    memcpy(&rom[0x150], program, sizeof(program));
+    memcpy(&rom[0x134], "VIDEOTEST", 9);
+
+    std::string path = (std::filesystem::temp_directory_path() / "VIDEOTEST.gb").string();
+    std::ofstream(path, std::ios::binary).write((char*)rom.data(), rom.size());
+
+    auto run = [&](PPU::VideoOutput mode)
+    {
+        std::unique_ptr<Emulator> emu = std::make_unique<Emulator>();
+        emu->LoadROM(path);
+        emu->Reset();
+        emu->ppu.videoOutput = mode;
+        for (int i = 0; i < 3; i++) emu->UpdateFrame();
+        return emu;
+    };
+
+    std::unique_ptr<Emulator> rgba = run(PPU::VideoOutput::RGBA);
+    EXPECT_EQ(rgba->ppu.GetOutput().size(), RESX * RESY * 4);
+
+    std::vector<uint8_t> shades(RESX * RESY);
+    for (int i = 0; i < RESX * RESY; i++)
+        shades[i] = (uint8_t)(std::find(DEFAULT_COLORS.begin(), DEFAULT_COLORS.end(), rgba->ppu.videoBuffer[i]) - DEFAULT_COLORS.begin());
+    ASSERT_NE(std::count(shades.begin(), shades.end(), 0), RESX * RESY);
+
+    std::span<const uint8_t> indexed = run(PPU::VideoOutput::Indexed)->ppu.GetOutput();
+    ASSERT_EQ(indexed.size(), RESX * RESY);
+    EXPECT_TRUE(std::equal(indexed.begin(), indexed.end(), shades.begin()));
+
+    std::unique_ptr<Emulator> packedEmu = run(PPU::VideoOutput::Packed2bpp);
+    std::span<const uint8_t> packed = packedEmu->ppu.GetOutput();
+    ASSERT_EQ(packed.size(), RESX * RESY / 4);
+    for (int i = 0; i < RESX * RESY; i++)
+        ASSERT_EQ((packed[i / 4] >> ((i % 4) * 2)) & 3, shades[i]) << "pixel " << i;
+
+    for (int scale : { 2, 4 })
+    {
+        std::unique_ptr<Emulator> grayEmu = run(scale == 2 ? PPU::VideoOutput::Gray2x : PPU::VideoOutput::Gray4x);
+        std::span<const uint8_t> gray = grayEmu->ppu.GetOutput();
+        ASSERT_EQ(gray.size(), (RESX / scale) * (RESY / scale));
+
+        for (int y = 0; y < RESY / scale; y++)
+        {
+            for (int x = 0; x < RESX / scale; x++)
+            {
+                int sum = 0;
+                for (int dy = 0; dy < scale; dy++)
+                    for (int dx = 0; dx < scale; dx++)
+                        sum += DEFAULT_COLORS[shades[(y * scale + dy) * RESX + x * scale + dx]] & 0xFF;
+
+                ASSERT_EQ(gray[y * (RESX / scale) + x], sum / (scale * scale)) << scale << "x at " << x << "," << y;
+            }
+        }
+    }
+
+    // and the same through the C interface
+    gb_env* env = gb_create(path.c_str());
+    ASSERT_NE(env, nullptr);
+    EXPECT_EQ(gb_set_output(env, 99), -1);
+    ASSERT_EQ(gb_set_output(env, GB_OUTPUT_PACKED_2BPP), 0);
+    gb_step(env, 0, 3);
+
+    size_t size = 0;
+    const uint8_t* observation = gb_observation(env, &size);
+    ASSERT_EQ(size, packed.size());
+    EXPECT_EQ(memcmp(observation, packed.data(), size), 0);
+
+    gb_destroy(env);
+    std::filesystem::remove(path);
+}
+
+TEST(IdleLoopTest, SkipsPollingLoopsWithoutChangingTheResult)
+{
+    // waits for a flag in WRAM that the vblank handler sets
+    const uint8_t flagProgram[] = {
+        0x31, 0xFE, 0xFF,   // LD SP,0xFFFE
+        0x3E, 0x01,         // LD A,0x01
+        0xE0, 0xFF,         // LDH (IE),A
+        0xFB,               // EI
+        0xFA, 0x00, 0xC0,   // poll: LD A,(0xC000)
+        0xA7,               // AND A
+        0x28, 0xFA,         // JR Z,poll
+        0xAF,               // XOR A
+        0xEA, 0x00, 0xC0,   // LD (0xC000),A
+        0x04,               // INC B
+        0x18, 0xF3,         // JR poll
+    };
+    const uint8_t setFlag[] = {
+        0x3E, 0x01,         // LD A,0x01
+        0xEA, 0x00, 0xC0,   // LD (0xC000),A
+        0xD9,               // RETI
+    };
+
+    // and one that polls LY
+    std::string paths[] = { WriteProgramROM("IDLEFLAG", flagProgram, setFlag), WriteProgramROM("IDLELY", SCROLL_PROGRAM) };
+
+    for (const std::string& path : paths)
+    {
+        std::vector<uint8_t> expected, state;
+        RunInMode(path, CPU::ExecutionMode::Interpreter, false, 10)->SaveState(expected);
+
+        for (CPU::ExecutionMode mode : EXECUTION_MODES)
+        {
+            for (bool idleLoops : { false, true })
+            {
+                std::unique_ptr<Emulator> emu = RunInMode(path, mode, idleLoops, 10);
+                emu->SaveState(state);
+
+                SCOPED_TRACE(path + " mode " + std::to_string((int)mode) + (idleLoops ? " skipping idle loops" : ""));
+                EXPECT_TRUE(state == expected) << DescribeDifference(state, expected);
+
+                if (idleLoops)
+                {
+                    EXPECT_GT(emu->cpu.idleLoopStats.loopsSkipped, 0);
+                    EXPECT_GT(emu->cpu.idleLoopStats.cyclesSkipped, 10 * 10000);
+                }
+                else
+                    EXPECT_EQ(emu->cpu.idleLoopStats.loopsSkipped, 0);
+
+                // skipped cycles dont count against the block the loop is in
+                EXPECT_EQ(emu->blockCache.GetMismatchCount(), 0);
+            }
+        }
+
+        std::filesystem::remove(path);
+    }
+}
+
+TEST(BlockCacheTest, RecompilesCodeRewrittenInRAM)
+{
+    const uint8_t program[] = {
+        0x31, 0xFE, 0xFF,   // LD SP,0xFFFE
+        0x21, 0x00, 0xC0,   // LD HL,0xC000
+        0x11, 0x70, 0x01,   // LD DE,routine
+        0x0E, 0x08,         // LD C,8
+        0x1A,               // copy: LD A,(DE)
+        0x22,               // LD (HL+),A
+        0x13,               // INC DE
+        0x0D,               // DEC C
+        0x20, 0xFA,         // JR NZ,copy
+        0xCD, 0x00, 0xC0,   // CALL 0xC000
+        0x50,               // LD D,B
+        0x3E, 0x09,         // LD A,0x09
+        0xEA, 0x01, 0xC0,   // LD (0xC001),A, rewrites the routine after it has been cached
+        0xCD, 0x00, 0xC0,   // CALL 0xC000
+        0x58,               // LD E,B
+        0x18, 0xFE,         // JR -2
+
+        // routine, copied to 0xC000. the store lands on the immediate of the next instruction in the same block
+        0x3E, 0x07,         // LD A,0x07
+        0xEA, 0x06, 0xC0,   // LD (0xC006),A
+        0x06, 0x00,         // LD B,0x00
+        0xC9,               // RET
+    };
+
+    std::string path = WriteProgramROM("BLOCKSMC", program);
+
+    std::vector<uint8_t> expected, state;
+    RunInMode(path, CPU::ExecutionMode::Interpreter, true, 2)->SaveState(expected);
+
+    for (CPU::ExecutionMode mode : EXECUTION_MODES)
+    {
+        std::unique_ptr<Emulator> emu = RunInMode(path, mode, true, 2);
+        emu->SaveState(state);
+
+        SCOPED_TRACE("mode " + std::to_string((int)mode));
+        EXPECT_EQ(emu->cpu.DE.reg, 0x0709);
+        EXPECT_TRUE(state == expected) << DescribeDifference(state, expected);
+    }
+
+    std::filesystem::remove(path);
+}
+
+TEST(BlockCacheTest, LeavesSelfModifyingCodeToTheInterpreter)
+{
+    const uint8_t program[] = {
+        0x31, 0xFE, 0xFF,   // LD SP,0xFFFE
+        0x21, 0x00, 0xC0,   // LD HL,0xC000
+        0x11, 0x71, 0x01,   // LD DE,routine
+        0x0E, 0x05,         // LD C,5
+        0x1A,               // copy: LD A,(DE)
+        0x22,               // LD (HL+),A
+        0x13,               // INC DE
+        0x0D,               // DEC C
+        0x20, 0xFA,         // JR NZ,copy
+        0x06, 0x00,         // LD B,0
+        0x1E, 0x28,         // LD E,40
+        0x7B,               // loop: LD A,E
+        0xEA, 0x02, 0xC0,   // LD (0xC002),A, patches the ADD below every time round
+        0xCD, 0x00, 0xC0,   // CALL 0xC000
+        0x1D,               // DEC E
+        0x20, 0xF6,         // JR NZ,loop
+        0x18, 0xFE,         // JR -2
+
+        // routine, copied to 0xC000
+        0x78,               // LD A,B
+        0xC6, 0x00,         // ADD A,n
+        0x47,               // LD B,A
+        0xC9,               // RET
+    };
+
+    std::string path = WriteProgramROM("BLOCKSMCMANY", program);
+
+    std::vector<uint8_t> expected, state;
+    RunInMode(path, CPU::ExecutionMode::Interpreter, true, 2)->SaveState(expected);
+
+    for (CPU::ExecutionMode mode : EXECUTION_MODES)
+    {
+        std::unique_ptr<Emulator> emu = RunInMode(path, mode, true, 2);
+        emu->SaveState(state);
+
+        SCOPED_TRACE("mode " + std::to_string((int)mode));
+        EXPECT_EQ(emu->cpu.BC.hi, (40 * 41 / 2) & 0xFF);
+        EXPECT_TRUE(state == expected) << DescribeDifference(state, expected);
+
+        // rewritten more than SELF_MODIFYING_THRESHOLD times, so it isnt cached again after the last rewrite
+        EXPECT_EQ(emu->blockCache.Find(0xC000, 0), nullptr);
+        EXPECT_EQ(emu->blockCache.GetMismatchCount(), 0);
+    }
+
+    std::filesystem::remove(path);
+}
+
+TEST(ThreadedCoreTest, MatchesTheInterpreter)
+{
+    // a mix of ALU, CB prefixed, stack and flag instructions writing all over WRAM
+    const uint8_t program[] = {
+        0x31, 0xFE, 0xFF,   // LD SP,0xFFFE
+        0x21, 0x00, 0xC0,   // LD HL,0xC000
+        0x3C,               // loop: INC A
+        0xCE, 0x35,         // ADC A,0x35
+        0x27,               // DAA
+        0xCB, 0x37,         // SWAP A
+        0xCB, 0x11,         // RL C
+        0x98,               // SBC A,B
+        0xF5,               // PUSH AF
+        0xC1,               // POP BC
+        0xCB, 0x40,         // BIT 0,B
+        0x28, 0x02,         // JR Z,+2
+        0xCB, 0xC2,         // SET 0,D
+        0xCB, 0x8A,         // RES 1,D
+        0xAA,               // XOR D
+        0x1F,               // RRA
+        0x22,               // LD (HL+),A
+        0x7C,               // LD A,H
+        0xFE, 0xE0,         // CP 0xE0
+        0x20, 0xE5,         // JR NZ,loop
+        0x26, 0xC0,         // LD H,0xC0
+        0x18, 0xE1,         // JR loop
+    };
+
+    // and timer interrupts landing in the middle of it all
+    std::string paths[] = { WriteProgramROM("THREADALU", program), WriteStateTestROM("THREADINT") };
+
+    for (const std::string& path : paths)
+    {
+        std::unique_ptr<Emulator> interpreter = RunInMode(path, CPU::ExecutionMode::Interpreter, false, 0);
+        std::unique_ptr<Emulator> threaded = RunInMode(path, CPU::ExecutionMode::Threaded, false, 0);
+
+        std::vector<uint8_t> expected, state;
+        for (int frame = 0; frame < 10; frame++)
+        {
+            interpreter->UpdateFrame();
+            threaded->UpdateFrame();
+
+            interpreter->SaveState(expected);
+            threaded->SaveState(state);
+            ASSERT_TRUE(state == expected) << path << " frame " << frame << ": " << DescribeDifference(state, expected);
+        }
+
+        std::filesystem::remove(path);
+    }
+}
+
+TEST(JitTest, MatchesTheInterpreter)
+{
+    // mostly instructions that get compiled inline, with the flags they leave read by DAA and ADC through the handlers
+    const uint8_t program[] = {
+        0x31, 0xFE, 0xFF,   // LD SP,0xFFFE
+        0x3E, 0x05,         // LD A,0x05
+        0xE0, 0x07,         // LDH (TAC),A
+        0x3E, 0x04,         // LD A,0x04
+        0xE0, 0xFF,         // LDH (IE),A
+        0xFB,               // EI
+        0x21, 0x00, 0xC0,   // LD HL,0xC000
+        0x78,               // loop: LD A,B
+        0x81,               // ADD A,C
+        0x27,               // DAA
+        0x8A,               // ADC A,D
+        0xEE, 0x5A,         // XOR 0x5A
+        0x57,               // LD D,A
+        0x93,               // SUB E
+        0xE6, 0x7F,         // AND 0x7F
+        0xB2,               // OR D
+        0xFE, 0x40,         // CP 0x40
+        0x1C,               // INC E
+        0x15,               // DEC D
+        0x4F,               // LD C,A
+        0xC6, 0x33,         // ADD A,0x33
+        0x22,               // LD (HL+),A
+        0x04,               // INC B
+        0x7C,               // LD A,H
+        0xFE, 0xE0,         // CP 0xE0
+        0x20, 0xE7,         // JR NZ,loop
+        0x26, 0xC0,         // LD H,0xC0
+        0x18, 0xE3,         // JR loop
+    };
+    const uint8_t timer[] = { 0x0C, 0xD9 }; // INC C, RETI
+
+    std::string paths[] = { WriteProgramROM("JITALU", program, {}, timer), WriteStateTestROM("JITINT") };
+
+    for (const std::string& path : paths)
+    {
+        for (CPU::ExecutionMode mode : { CPU::ExecutionMode::JIT, CPU::ExecutionMode::Lockstep })
+        {
+            std::unique_ptr<Emulator> interpreter = RunInMode(path, CPU::ExecutionMode::Interpreter, true, 0);
+            std::unique_ptr<Emulator> jit = RunInMode(path, mode, true, 0);
+
+            std::vector<uint8_t> expected, state;
+            for (int frame = 0; frame < 10; frame++)
+            {
+                interpreter->UpdateFrame();
+                jit->UpdateFrame();
+
+                interpreter->SaveState(expected);
+                jit->SaveState(state);
+                ASSERT_TRUE(state == expected) << path << " mode " << (int)mode << " frame " << frame << ": " << DescribeDifference(state, expected);
+            }
+
+            // the interrupt handler ran in the middle of it all
+            EXPECT_GT(jit->cpu.BC.lo, 0);
+            EXPECT_EQ(jit->blockCache.GetMismatchCount(), 0);
+            if (Jit::IsSupported())
+            {
+                EXPECT_GT(jit->blockCache.GetNativeCodeSize(), 0);
+            }
+        }
+
+        std::filesystem::remove(path);
+    }
+}
+
+TEST(HaltTest, SkipsToTheSameTickAsSteppingThroughIt)
+{
+    const uint8_t program[] = {
+        0x31, 0xFE, 0xFF,   // LD SP,0xFFFE
+        0x3E, 0x05,         // LD A,0x05
+        0xE0, 0x07,         // LDH (TAC),A
+        0x3E, 0x05,         // LD A,0x05
+        0xE0, 0xFF,         // LDH (IE),A, vblank and timer
+        0xFB,               // EI
+        0x76,               // loop: HALT
+        0x04,               // INC B
+        0x18, 0xFC,         // JR loop
+    };
+    const uint8_t vblank[] = { 0x14, 0xD9 }; // INC D, RETI
+    const uint8_t timer[] = { 0x0C, 0xD9 }; // INC C, RETI
+
+    std::string path = WriteProgramROM("HALTTEST", program, vblank, timer);
+
+    for (CPU::ExecutionMode mode : EXECUTION_MODES)
+    {
+        std::unique_ptr<Emulator> emu = RunInMode(path, mode, false, 0);
+        // Emulator::clock runs one Step at a time, which goes through HALT one M-cycle at a time
+        std::unique_ptr<Emulator> reference = RunInMode(path, CPU::ExecutionMode::Interpreter, false, 0);
+
+        std::vector<uint8_t> expected, state;
+
+        // targets that dont line up with M-cycles or events
+        for (uint64_t target = 1001; target < 300000; target += 7919)
+        {
+            while (reference->m_SystemTicks < target) reference->clock();
+            emu->RunUntil(target);
+
+            reference->SaveState(expected);
+            emu->SaveState(state);
+
+            SCOPED_TRACE("mode " + std::to_string((int)mode) + " target " + std::to_string(target));
+            ASSERT_EQ(emu->m_SystemTicks, reference->m_SystemTicks);
+            ASSERT_TRUE(state == expected) << DescribeDifference(state, expected);
+        }
+
+        // woken by both interrupts, and halted again after each one
+        EXPECT_GT(emu->cpu.BC.hi, 10);
+        EXPECT_GT(emu->cpu.BC.lo, 10);
+        EXPECT_GT(emu->cpu.DE.hi, 2);
+    }
+
+    std::filesystem::remove(path);
+}